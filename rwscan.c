@@ -41,130 +41,447 @@ static work_queue_t *cleanup_queue;
 /* Lock to prevent interleaved output from threads */
 static pthread_mutex_t output_mutex;
 
+/* Lock to serialize reader threads' access to the list of input ranges */
+static pthread_mutex_t input_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The input files, or pieces of them, for the reader threads to read,
+ * and the index of the next range to be taken */
+static input_range_t *input_ranges = NULL;
+static size_t input_ranges_count = 0;
+static size_t input_ranges_next = 0;
+
+/* Set when a reader thread fails to read an input range; protected by
+ * input_mutex */
+static int input_failed = 0;
+
+
+/* LOCAL TYPES */
+
+/* where process_file() gets its records: a memory-mapped file or a
+ * stream, which may be read by a decoder thread */
+typedef struct input_source_st {
+    skstream_t     *stream;
+    decoder_t      *dec;
+    mapped_file_t   mf;
+    /* positions in the file of the next record and the current one */
+    uint64_t        next_index;
+    uint64_t        index;
+    /* the current record when reading a stream */
+    rwRec           rwrec;
+    unsigned        is_mapped :1;
+} input_source_t;
+
+/* reads the flows of an event to a model one block at a time */
+typedef struct event_stream_st {
+    worker_thread_data_t   *work;
+    rwscan_flow_t          *flows;  /* the flows of the current block */
+    const uint32_t         *index;  /* when not NULL, the order in which
+                                     * to read the flows of an event
+                                     * held in memory */
+    uint32_t                first;  /* index in the event of flows[0] */
+    uint32_t                count;  /* number of flows in the block */
+} event_stream_t;
+
 
 /* LOCAL FUNCTION PROTOTYPES */
 
 static int
 process_file(
-    const char         *infile);
+    const input_range_t    *range);
 static int
 invoke_trw_model(
     worker_thread_data_t   *work);
 static int
+stream_blr_metrics(
+    worker_thread_data_t   *work,
+    const uint32_t         *index);
+static int
 invoke_blr_model(
     worker_thread_data_t   *work);
+static int
+invoke_blr_sampled(
+    worker_thread_data_t   *work,
+    uint32_t                sample_size);
+static uint64_t
+thread_cpu_msec(
+    void);
+static void
+work_release(
+    worker_thread_data_t   *work);
 
 
 /* FUNCTION DEFINITONS */
 
+/*
+ *  is_sketched = event_is_sketched(metrics);
+ *
+ *    Return true if the BLR features of the event described by
+ *    'metrics' are to be estimated from sketches; see --sketch-events.
+ */
+static int
+event_is_sketched(
+    const event_metrics_t  *metrics)
+{
+    return (options.sketch_events
+            && metrics->event_size >= options.sketch_events);
+}
+
+
+/*
+ *  threads = event_parallel_threads(work);
+ *
+ *    Return the number of threads to use for sorting the flows of the
+ *    event in 'work' and for calculating its BLR features; see
+ *    --parallel-events.  Only events held in memory and not sketched
+ *    are split, each thread getting at least
+ *    RWSCAN_MIN_PARTITION_FLOWS flows.
+ */
+static uint32_t
+event_parallel_threads(
+    const worker_thread_data_t *work)
+{
+    uint32_t threads;
+
+    if (options.parallel_events == 0
+        || work->metrics->event_size < options.parallel_events
+        || work->chunks != NULL
+        || event_is_sketched(work->metrics))
+    {
+        return 1;
+    }
+    threads = work->metrics->event_size / RWSCAN_MIN_PARTITION_FLOWS;
+    if (threads > options.worker_threads) {
+        threads = options.worker_threads;
+    }
+    return (threads ? threads : 1);
+}
+
+
+/*
+ *  event_sort(work, order);
+ *
+ *    Sort the flows of the event in 'work', which are in memory, into
+ *    'order'.
+ */
+static void
+event_sort(
+    worker_thread_data_t   *work,
+    flow_order_t            order)
+{
+    parallel_sort(work->flows, work->metrics->event_size, order,
+                  event_parallel_threads(work));
+}
+
+
+/*
+ *  event_times_add(metrics, flow, first);
+ *
+ *    Update the start and end times of the event described by
+ *    'metrics' for 'flow', the next of the event's flows, or set them
+ *    from 'flow' when 'first' is true.  The end time depends on the
+ *    order in which the flows are added.
+ */
+static void
+event_times_add(
+    event_metrics_t        *metrics,
+    const rwscan_flow_t    *flow,
+    int                     first)
+{
+    if (first) {
+        metrics->stime = flowGetStartSeconds(flow);
+        metrics->etime = flowGetEndSeconds(flow);
+    } else {
+        if (flowGetStartSeconds(flow) < metrics->stime) {
+            metrics->stime = flowGetStartSeconds(flow);
+        }
+        if (flowGetStartSeconds(flow) > metrics->etime) {
+            metrics->etime = flowGetEndSeconds(flow);
+        }
+    }
+}
+
+
+/*
+ *  status = event_order_flows(work);
+ *
+ *    Put the flows of the event in 'work', which were grouped from
+ *    unsorted input, in the order of flow_compare_sip_proto_dip(),
+ *    and set the event's start and end times from the flows in that
+ *    order.  The reader threads add the flows of an event in no fixed
+ *    order, while the first flow to each dip decides TRW's view of
+ *    the dip and the order decides the end time; this gives the
+ *    results of input sorted by rwsort(1).  The runs of a compressed
+ *    event are already sorted and merged in this order.  Return 0 on
+ *    success or -1 on failure.
+ */
+static int
+event_order_flows(
+    worker_thread_data_t   *work)
+{
+    event_metrics_t *metrics = work->metrics;
+    uint64_t seen = 0;
+    int64_t count;
+    int64_t i;
+
+    if (work->chunks == NULL) {
+        event_sort(work, FLOW_ORDER_FULL);
+        for (i = 0; i < metrics->event_size; ++i) {
+            event_times_add(metrics, &work->flows[i], (i == 0));
+        }
+        return 0;
+    }
+
+    if (event_chunks_rewind(work->chunks)) {
+        return -1;
+    }
+    while ((count = event_chunks_read(work->chunks, work->block,
+                                      RWSCAN_STREAM_BLOCK_SIZE)) > 0)
+    {
+        for (i = 0; i < count; ++i, ++seen) {
+            event_times_add(metrics, &work->block[i], (seen == 0));
+        }
+    }
+    return ((count == -1) ? -1 : 0);
+}
+
+
+/*
+ *  sample_size = event_over_budget(metrics, cpu_start);
+ *
+ *    Return the number of flows to sample for the BLR model when the
+ *    event described by 'metrics' is larger than --event-flow-budget
+ *    or has used more than --event-time-budget milliseconds of CPU
+ *    time since 'cpu_start'.  Return 0 when the event is within its
+ *    budget.
+ */
+static uint32_t
+event_over_budget(
+    const event_metrics_t  *metrics,
+    uint64_t                cpu_start)
+{
+    uint32_t sample_size;
+
+    sample_size = (options.budget_flows
+                   ? options.budget_flows : RWSCAN_BUDGET_SAMPLE_FLOWS);
+    if (metrics->event_size <= sample_size) {
+        return 0;
+    }
+    if (options.budget_flows) {
+        return sample_size;
+    }
+    if (options.budget_msec
+        && thread_cpu_msec() - cpu_start > options.budget_msec)
+    {
+        return sample_size;
+    }
+    return 0;
+}
+
+
+/*
+ *  status = event_stream_start(stream, work);
+ *
+ *    Prepare 'stream' to read the flows of the event in 'work' from
+ *    the beginning.  Return 0 on success or -1 on failure.
+ */
+static int
+event_stream_start(
+    event_stream_t         *stream,
+    worker_thread_data_t   *work)
+{
+    memset(stream, 0, sizeof(event_stream_t));
+    stream->work = work;
+    if (work->chunks) {
+        return event_chunks_rewind(work->chunks);
+    }
+    return 0;
+}
+
+
+/*
+ *  count = event_stream_next(stream);
+ *
+ *    Read the next block of flows from 'stream' into its 'flows'
+ *    member and load them into the worker's columns.  An event that
+ *    is not held in an event_chunks_t is read as a single block, in
+ *    the order of the stream's 'index' when that is set.  Return the
+ *    number of flows in the block, 0 at the end of the event, or -1
+ *    on failure.
+ */
+static int64_t
+event_stream_next(
+    event_stream_t     *stream)
+{
+    worker_thread_data_t *work = stream->work;
+    int64_t count;
+
+    stream->first += stream->count;
+    if (work->chunks) {
+        stream->flows = work->block;
+        count = event_chunks_read(work->chunks, work->block,
+                                  RWSCAN_STREAM_BLOCK_SIZE);
+        if (count == -1) {
+            return -1;
+        }
+    } else if (stream->first == 0) {
+        stream->flows = work->flows;
+        count = work->metrics->event_size;
+    } else {
+        count = 0;
+    }
+    stream->count = (uint32_t)count;
+    if (count == 0) {
+        return 0;
+    }
+
+    if (stream->index
+        ? event_columns_gather(work->columns, stream->flows, stream->index,
+                               stream->count)
+        : event_columns_load(work->columns, stream->flows, stream->count))
+    {
+        skAppPrintOutOfMemory("event columns");
+        return -1;
+    }
+    return count;
+}
+
+
+/*
+ *  status = stream_shared_metrics(work);
+ *
+ *    Compute the metrics shared by the protocols over all the flows
+ *    of the event in 'work'.  Return 0 on success or -1 on failure.
+ */
+static int
+stream_shared_metrics(
+    worker_thread_data_t   *work)
+{
+    event_stream_t stream;
+    metric_state_t state;
+    int64_t count;
+
+    if (event_stream_start(&stream, work)) {
+        return -1;
+    }
+    memset(&state, 0, sizeof(state));
+    while ((count = event_stream_next(&stream)) > 0) {
+        calculate_shared_metrics(&state, work->columns, work->metrics);
+    }
+    return (count == 0) ? 0 : -1;
+}
+
+
 int
 invoke_trw_model(
     worker_thread_data_t   *work)
 {
-    rwRec           *flows    = NULL;
     event_metrics_t *metrics  = NULL;
     trw_counters_t  *counters = NULL;
+    event_columns_t *cols     = NULL;
+    event_stream_t   stream;
+    int64_t          count;
+    int              stop = 0;
 
-    rwRec   *rwcurr = NULL;
-    uint32_t i;
+    uint32_t i, k;
     uint32_t dip_prev = 0xffffffff, dip_curr = 0;
+    uint8_t  flags;
+    int      hit;
+    skipaddr_t ipaddr;
 
-    flows    = work->flows;
     metrics  = work->metrics;
     counters = work->counters;
+    cols     = work->columns;
 
     metrics->model = RWSCAN_MODEL_TRW;
 
-    for (i = 0; i < metrics->event_size; i++) {
-        uint32_t j;
+    if (event_stream_start(&stream, work)) {
+        return metrics->event_class;
+    }
 
-        rwcurr   = &(flows[i]);
-        dip_curr = rwRecGetDIPv4(rwcurr);
-        if (options.verbose_flows) {
-            fprintf(RWSCAN_VERBOSE_FH, "%4u/%4u  ", i + 1,
-                    metrics->event_size);
-            print_flow(rwcurr);
-        }
-        counters->flows++;
+    while (!stop && (count = event_stream_next(&stream)) > 0) {
+        for (k = 0; k < stream.count; k++) {
+            i        = stream.first + k;
+            dip_curr = cols->dip[k];
+            flags    = cols->flags[k];
+            if (options.verbose_flows) {
+                fprintf(RWSCAN_VERBOSE_FH, "%4u/%4u  ", i + 1,
+                        metrics->event_size);
+                print_flow(&stream.flows[k]);
+            }
+            counters->flows++;
 
-        if (dip_curr != dip_prev) {
-            pthread_mutex_lock(&trw_data.mutex);
-            if (skIPSetCheckRecordDIP(trw_data.existing, rwcurr)) {
-                counters->hits++;
-            } else {
-                if ((rwRecGetFlags(rwcurr) & TCP_FLAGS_STATE) == SYN_FLAG) {
-                    counters->misses++;
-                } else {
+            if (dip_curr != dip_prev) {
+                pthread_mutex_lock(&trw_data.mutex);
+                skipaddrSetV4(&ipaddr, &dip_curr);
+                hit = (skIPSetCheckAddress(trw_data.existing, &ipaddr)
+                       || (flags & TCP_FLAGS_STATE) != SYN_FLAG);
+                pthread_mutex_unlock(&trw_data.mutex);
+
+                /* each new destination updates the log of the
+                 * likelihood ratio in constant time */
+                if (hit) {
                     counters->hits++;
+                    counters->log_likelihood += trw_data.log_hit;
+                } else {
+                    counters->misses++;
+                    counters->log_likelihood += trw_data.log_miss;
                 }
+                counters->dips++;
+            }
+            if ((flags & TCP_FLAGS_STATE) == SYN_FLAG) {
+                counters->syns++;
             }
-            pthread_mutex_unlock(&trw_data.mutex);
-            counters->dips++;
-        }
-        if ((rwRecGetFlags(rwcurr) & TCP_FLAGS_STATE) == SYN_FLAG) {
-            counters->syns++;
-        }
 
-        if (rwRecGetFlags(rwcurr) == RST_FLAG
-            || rwRecGetFlags(rwcurr) == (SYN_FLAG | ACK_FLAG)
-            || rwRecGetFlags(rwcurr) == (RST_FLAG | ACK_FLAG))
-        {
-            counters->bs++;
-        }
-        if (rwRecGetFlags(rwcurr) == RST_FLAG
-            || rwRecGetFlags(rwcurr)  == (SYN_FLAG | RST_FLAG)
-            || rwRecGetFlags(rwcurr)  == (RST_FLAG | ACK_FLAG))
-        {
-            counters->floodresponse++;
-        }
-        if (dip_curr != dip_prev) {
-            for (j = 0, counters->likelihood = 1.0;
-                 j < counters->hits;
-                 j++)
+            if (flags == RST_FLAG
+                || flags == (SYN_FLAG | ACK_FLAG)
+                || flags == (RST_FLAG | ACK_FLAG))
             {
-                counters->likelihood = counters->likelihood
-                                       * (options.trw_theta1 /
-                                          options.trw_theta0);
+                counters->bs++;
             }
-            for (j = 0; j < counters->misses; j++) {
-                counters->likelihood =
-                    counters->likelihood * ((1.0 - options.trw_theta1) /
-                                            (1.0 - options.trw_theta0));
+            if (flags == RST_FLAG
+                || flags == (SYN_FLAG | RST_FLAG)
+                || flags == (RST_FLAG | ACK_FLAG))
+            {
+                counters->floodresponse++;
             }
-        }
-        if (i > RWSCAN_FLOW_CUTOFF) {
-            if (options.verbose_progress) {
-                fprintf(RWSCAN_VERBOSE_FH,
-                        "warning:  TRW giving up after %d flows\n",
-                        RWSCAN_FLOW_CUTOFF);
+            if (i > RWSCAN_FLOW_CUTOFF) {
+                if (options.verbose_progress) {
+                    fprintf(RWSCAN_VERBOSE_FH,
+                            "warning:  TRW giving up after %d flows\n",
+                            RWSCAN_FLOW_CUTOFF);
+                }
+                stop = 1;
+                break;
             }
-            break;
-        }
-        if (counters->syns == counters->flows) {
-            if (counters->likelihood > TRW_ETA1) {
-                /* add to scanners iptree */
-                pthread_mutex_lock(&trw_data.mutex);
-                skIPTreeAddAddress(trw_data.scanners, rwRecGetSIPv4(rwcurr));
-                pthread_mutex_unlock(&trw_data.mutex);
-                metrics->scan_probability = counters->likelihood;
-                calculate_shared_metrics(flows, metrics);
-
-                print_verbose_results((RWSCAN_VERBOSE_FH, "\ttrw: scan (%f)",
-                                       counters->likelihood));
-                return (metrics->event_class = EVENT_SCAN);
-            } else if (counters->likelihood < TRW_ETA0) {
-                /* add to benign iptree */
-                pthread_mutex_lock(&trw_data.mutex);
-                skIPTreeAddAddress(trw_data.benign, rwRecGetSIPv4(rwcurr));
-                pthread_mutex_unlock(&trw_data.mutex);
-                metrics->scan_probability = counters->likelihood;
-                print_verbose_results((RWSCAN_VERBOSE_FH,
-                                       "\ttrw: benign (%f)",
-                                       counters->likelihood));
-                return (metrics->event_class = EVENT_BENIGN);
+            if (counters->syns == counters->flows) {
+                if (counters->log_likelihood > trw_data.log_eta1) {
+                    /* add to scanners iptree */
+                    pthread_mutex_lock(&trw_data.mutex);
+                    skIPTreeAddAddress(trw_data.scanners, metrics->sip);
+                    pthread_mutex_unlock(&trw_data.mutex);
+                    metrics->scan_probability = exp(counters->log_likelihood);
+                    if (stream_shared_metrics(work)) {
+                        return metrics->event_class;
+                    }
+
+                    print_verbose_results((RWSCAN_VERBOSE_FH,
+                                           "\ttrw: scan (%f)",
+                                           metrics->scan_probability));
+                    return (metrics->event_class = EVENT_SCAN);
+                } else if (counters->log_likelihood < trw_data.log_eta0) {
+                    /* add to benign iptree */
+                    pthread_mutex_lock(&trw_data.mutex);
+                    skIPTreeAddAddress(trw_data.benign, metrics->sip);
+                    pthread_mutex_unlock(&trw_data.mutex);
+                    metrics->scan_probability = exp(counters->log_likelihood);
+                    print_verbose_results((RWSCAN_VERBOSE_FH,
+                                           "\ttrw: benign (%f)",
+                                           metrics->scan_probability));
+                    return (metrics->event_class = EVENT_BENIGN);
+                }
             }
+            dip_prev = dip_curr;
         }
-        dip_prev = dip_curr;
     }
 
     if (counters->bs == counters->flows
@@ -181,439 +498,1791 @@ invoke_trw_model(
         return (metrics->event_class = EVENT_FLOOD);
     }
     print_verbose_results((RWSCAN_VERBOSE_FH, "\ttrw: unknown (%f)",
-                           counters->likelihood));
+                           exp(counters->log_likelihood)));
     return (metrics->event_class = EVENT_UNKNOWN);
 }
 
+
+/*
+ *  status = stream_blr_metrics(work, index);
+ *
+ *    Calculate and finish the BLR features of the event in 'work' on
+ *    the calling thread, streaming its flows through the column
+ *    buffer.  When 'index' is not NULL, the flows are read in the
+ *    order it gives; see flow_group().  Return 0 on success, 1 when
+ *    the event runs past --event-time-budget before the last block of
+ *    flows, leaving the features incomplete, or -1 on failure.
+ */
+static int
+stream_blr_metrics(
+    worker_thread_data_t   *work,
+    const uint32_t         *index)
+{
+    uint32_t         i;
+    event_metrics_t *metrics = work->metrics;
+    event_columns_t *cols = work->columns;
+    event_stream_t   stream;
+    metric_state_t   state;
+    int64_t          count;
+
+    if (metric_state_init(&state, metrics->protocol)) {
+        return -1;
+    }
+    if (event_is_sketched(metrics)) {
+        state.sketch = event_sketch_create(metrics->protocol);
+        if (state.sketch == NULL) {
+            skAppPrintOutOfMemory("event sketches");
+            metric_state_free(&state, metrics->protocol);
+            return -1;
+        }
+    }
+    if (event_stream_start(&stream, work)) {
+        metric_state_free(&state, metrics->protocol);
+        return -1;
+    }
+    stream.index = index;
+
+    /* Every flow in the event has the same protocol. */
+    while ((count = event_stream_next(&stream)) > 0) {
+        if ((work->chunks || state.sketch) && options.verbose_flows) {
+            for (i = 0; i < stream.count; i++) {
+                fprintf(RWSCAN_VERBOSE_FH, "%4u/%4u  ",
+                        stream.first + i + 1, metrics->event_size);
+                print_flow(&stream.flows[i]);
+            }
+        }
+        switch (metrics->protocol) {
+          case IPPROTO_ICMP:
+            calculate_icmp_metrics(&state, cols, metrics);
+            break;
+          case IPPROTO_TCP:
+            calculate_tcp_metrics(&state, cols, metrics);
+            break;
+          case IPPROTO_UDP:
+            calculate_udp_metrics(&state, cols, metrics);
+            break;
+          default:
+            skAppPrintErr("%s:%d: invalid protocol", __FILE__, __LINE__);
+            exit(EXIT_FAILURE);
+        }
+        if (options.budget_msec
+            && event_over_budget(metrics, work->cpu_start))
+        {
+            metric_state_free(&state, metrics->protocol);
+            return 1;
+        }
+    }
+    if (count == -1) {
+        metric_state_free(&state, metrics->protocol);
+        return -1;
+    }
+
+    switch (metrics->protocol) {
+      case IPPROTO_ICMP:
+        finish_icmp_metrics(&state, metrics);
+        break;
+      case IPPROTO_TCP:
+        finish_tcp_metrics(&state, metrics);
+        break;
+      case IPPROTO_UDP:
+        finish_udp_metrics(&state, metrics);
+        break;
+    }
+    metric_state_free(&state, metrics->protocol);
+    return 0;
+}
+
+
 int
 invoke_blr_model(
     worker_thread_data_t   *work)
 {
     uint32_t         i;
-    rwRec           *flows;
     event_metrics_t *metrics;
+    event_metrics_t  saved;
+    uint32_t        *index = NULL;
+    uint32_t         threads;
+    uint32_t         sample_size;
+    int              rv;
 
-    flows   = work->flows;
     metrics = work->metrics;
 
     metrics->model = RWSCAN_MODEL_BLR;
     if (metrics->event_size >= EVENT_FLOW_THRESHOLD) {
-        rwRec *rwcurr = NULL;
-
-        /* Loop through each RW record in the event, incrementing various
-         * counters which will be used later. */
-        for (i = 0; i < metrics->event_size; i++) {
-            rwcurr = &(flows[i]);
+        if (options.budget_msec) {
+            memcpy(&saved, metrics, sizeof(event_metrics_t));
+        }
+        threads = event_parallel_threads(work);
+        if (work->chunks == NULL && !event_is_sketched(metrics)) {
             if (options.verbose_flows) {
-                fprintf(RWSCAN_VERBOSE_FH, "%4u/%4u  ", i + 1,
-                        metrics->event_size);
-                print_flow(rwcurr);
+                for (i = 0; i < metrics->event_size; i++) {
+                    fprintf(RWSCAN_VERBOSE_FH, "%4u/%4u  ", i + 1,
+                            metrics->event_size);
+                    print_flow(&work->flows[i]);
+                }
             }
-            switch (rwRecGetProto(rwcurr)) {
-              case IPPROTO_ICMP:
-                increment_icmp_counters(rwcurr, metrics);
-                break;
-              case IPPROTO_TCP:
-                increment_tcp_counters(rwcurr, metrics);
-                break;
-              case IPPROTO_UDP:
-                increment_udp_counters(rwcurr, metrics);
-                break;
-              default:
-                /* we only detect scans in ICMP, TCP, and UDP protocols */
-                skAbortBadCase(rwRecGetProto(rwcurr));
+
+            /* Visit the flows by dest IP and source port (for TCP;
+             * otherwise just dest IP) to get further metrics.  When
+             * the event has few destinations, index the flows by
+             * grouping them; otherwise sort them.  The flows of a
+             * compressed event are read in this order, and the
+             * sketches accept the flows in any order. */
+            if (threads < 2) {
+                index = flow_group(work->flows, metrics->event_size,
+                                   FLOW_ORDER_DIP_SPORT);
+            }
+            if (index == NULL) {
+                event_sort(work, FLOW_ORDER_DIP_SPORT);
             }
         }
 
-        /* Now that we know we have a scan, we sort by dest IP and source
-         * port (or for ICMP, just dest IP) to get further metrics-> */
-        qsort(flows, metrics->event_size, sizeof(rwRec),
-              rwrec_compare_dip_sport);
+        /* When the sort or the feature pass uses up the event's time
+         * budget, start over on a sample of the flows */
+        sample_size = event_over_budget(metrics, work->cpu_start);
+        if (sample_size == 0
+            && (index || threads < 2 || parallel_blr_metrics(work, threads)))
+        {
+            rv = stream_blr_metrics(work, index);
+            if (rv == 1) {
+                memcpy(metrics, &saved, sizeof(event_metrics_t));
+                sample_size = event_over_budget(metrics, work->cpu_start);
+            } else if (rv) {
+                free(index);
+                return metrics->event_class;
+            }
+        }
+        free(index);
+        if (sample_size) {
+            return invoke_blr_sampled(work, sample_size);
+        }
 
         switch (metrics->protocol) {
           case IPPROTO_ICMP:
-            calculate_icmp_metrics(flows, metrics);
             calculate_icmp_scan_probability(metrics);
             break;
           case IPPROTO_TCP:
-            calculate_tcp_metrics(flows, metrics);
             calculate_tcp_scan_probability(metrics);
             break;
           case IPPROTO_UDP:
-            calculate_udp_metrics(flows, metrics);
             calculate_udp_scan_probability(metrics);
             break;
-          default:
-            skAppPrintErr("%s:%d: invalid protocol", __FILE__, __LINE__);
-            exit(EXIT_FAILURE);
         }
 
     } else {
         print_verbose_results((RWSCAN_VERBOSE_FH, "\tmissile: small"));
     }
-    return metrics->event_class;
+    return metrics->event_class;
+}
+
+
+/*
+ *  class = invoke_blr_sampled(work, sample_size);
+ *
+ *    Run the BLR model on a uniform sample of 'sample_size' of the
+ *    flows of the event in 'work', chosen by reservoir sampling in a
+ *    single pass over the event.  The packet and byte counts of the
+ *    event are computed from every flow.  Mark the event as sampled
+ *    and return its classification.
+ */
+static int
+invoke_blr_sampled(
+    worker_thread_data_t   *work,
+    uint32_t                sample_size)
+{
+    worker_thread_data_t sample_work;
+    event_metrics_t sample_metrics;
+    event_metrics_t *metrics = work->metrics;
+    event_stream_t stream;
+    rwscan_flow_t *sample;
+    uint32_t capacity;
+    uint64_t seen = 0;
+    uint64_t rand_state;
+    uint64_t j;
+    uint32_t pkts = 0;
+    uint32_t bytes = 0;
+    uint32_t i;
+    int64_t count;
+
+    if (sample_size > metrics->event_size) {
+        sample_size = metrics->event_size;
+    }
+    capacity = pool_flows_capacity(sample_size);
+    sample = pool_flows_get(capacity);
+    if (sample == NULL) {
+        skAppPrintOutOfMemory("event sample");
+        return metrics->event_class;
+    }
+
+    /* seed from the source so the same input gives the same sample */
+    rand_state = (((uint64_t)metrics->sip << 8) | metrics->protocol) + 1;
+
+    if (event_stream_start(&stream, work)) {
+        pool_flows_put(sample, capacity);
+        return metrics->event_class;
+    }
+    while ((count = event_stream_next(&stream)) > 0) {
+        for (i = 0; i < stream.count; ++i, ++seen) {
+            pkts  += flowGetPkts(&stream.flows[i]);
+            bytes += flowGetBytes(&stream.flows[i]);
+            if (seen < sample_size) {
+                sample[seen] = stream.flows[i];
+                continue;
+            }
+            /* xorshift64 */
+            rand_state ^= rand_state << 13;
+            rand_state ^= rand_state >> 7;
+            rand_state ^= rand_state << 17;
+            j = rand_state % (seen + 1);
+            if (j < sample_size) {
+                sample[j] = stream.flows[i];
+            }
+        }
+    }
+    if (count == -1) {
+        pool_flows_put(sample, capacity);
+        return metrics->event_class;
+    }
+
+    print_verbose_results((RWSCAN_VERBOSE_FH, "\tsampled %u of %u flows",
+                           sample_size, metrics->event_size));
+
+    memcpy(&sample_metrics, metrics, sizeof(event_metrics_t));
+    sample_metrics.event_size = sample_size;
+    memcpy(&sample_work, work, sizeof(worker_thread_data_t));
+    sample_work.flows    = sample;
+    sample_work.capacity = capacity;
+    sample_work.chunks   = NULL;
+    sample_work.metrics  = &sample_metrics;
+
+    invoke_blr_model(&sample_work);
+    pool_flows_put(sample, capacity);
+
+    sample_metrics.event_size = metrics->event_size;
+    sample_metrics.pkts       = pkts;
+    sample_metrics.bytes      = bytes;
+    sample_metrics.sampled    = 1;
+    memcpy(metrics, &sample_metrics, sizeof(event_metrics_t));
+
+    return metrics->event_class;
+}
+
+
+/*
+ *  msec = thread_cpu_msec();
+ *
+ *    Return the CPU time used by the calling thread, in milliseconds,
+ *    or the wall clock time where thread CPU time is unavailable.
+ */
+static uint64_t
+thread_cpu_msec(
+    void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+        return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+    }
+#endif
+    return (uint64_t)sktimeNow();
+}
+
+
+#ifndef SKTHREAD_UNKNOWN_ID
+/* Create a local copy of the function from libsilk-thrd. */
+/*
+ *    Tell the current thread to ignore all signals except those
+ *    indicating a failure (e.g., SIGBUS and SIGSEGV).
+ */
+void
+skthread_ignore_signals(
+    void)
+{
+    sigset_t sigs;
+
+    sigfillset(&sigs);
+    sigdelset(&sigs, SIGABRT);
+    sigdelset(&sigs, SIGBUS);
+    sigdelset(&sigs, SIGILL);
+    sigdelset(&sigs, SIGSEGV);
+
+#ifdef SIGEMT
+    sigdelset(&sigs, SIGEMT);
+#endif
+#ifdef SIGIOT
+    sigdelset(&sigs, SIGIOT);
+#endif
+#ifdef SIGSYS
+    sigdelset(&sigs, SIGSYS);
+#endif
+
+    pthread_sigmask(SIG_SETMASK, &sigs, NULL);
+}
+#endif  /* #ifndef SKTHREAD_UNKNOWN_ID */
+
+
+/*
+ *  status = process_event(work, threadnum);
+ *
+ *    Run the scan models on the event in 'work' and report the
+ *    result.  'threadnum' identifies the worker thread in verbose
+ *    output.  The event's buffers are not released.  Return 0 on
+ *    success or -1 on allocation failure.
+ */
+static int
+process_event(
+    worker_thread_data_t   *work,
+    int                     threadnum)
+{
+    event_metrics_t *metrics = work->metrics;
+    uint32_t         sample_size;
+    skipaddr_t       ipaddr;
+    char             ipstr[SKIPADDR_STRLEN];
+
+    if (options.budget_msec) {
+        work->cpu_start = thread_cpu_msec();
+    }
+    if (options.unsorted_input && options.sort_buffer_size == 0) {
+        /* the flows of the external sort are already in order */
+        if (event_order_flows(work)) {
+            return -1;
+        }
+    }
+
+    skipaddrSetV4(&ipaddr, &metrics->sip);
+    skipaddrString(ipstr, &ipaddr, 0);
+    print_verbose_results((RWSCAN_VERBOSE_FH, "%d. %s [%d] (%u) ",
+                           threadnum, ipstr,
+                           metrics->protocol, metrics->event_size));
+
+    if (metrics->event_class != EVENT_UNKNOWN) {
+        /* the reader's TRW test decided the event; see
+         * --trw-in-reader */
+        print_verbose_results((RWSCAN_VERBOSE_FH, "\ttrw: %s (%f)",
+                               ((metrics->event_class == EVENT_SCAN)
+                                ? "scan" : "benign"),
+                               metrics->scan_probability));
+    } else if ((metrics->protocol == IPPROTO_TCP)
+               && (options.scan_model == RWSCAN_MODEL_HYBRID
+                   || options.scan_model == RWSCAN_MODEL_TRW))
+    {
+        memset(work->counters, 0, sizeof(trw_counters_t));
+        invoke_trw_model(work);
+    }
+    if ((metrics->event_class != EVENT_SCAN
+         && metrics->event_class != EVENT_FLOOD
+         && metrics->event_class != EVENT_BACKSCATTER)
+        && (options.scan_model == RWSCAN_MODEL_HYBRID
+            || options.scan_model == RWSCAN_MODEL_BLR))
+    {
+        sample_size = event_over_budget(metrics, work->cpu_start);
+        if (sample_size) {
+            invoke_blr_sampled(work, sample_size);
+        } else {
+            invoke_blr_model(work);
+        }
+    }
+    switch (metrics->event_class) {
+      case EVENT_SCAN:
+      {
+          scan_info_t *scan = (scan_info_t*)malloc(sizeof(scan_info_t));
+
+          print_verbose_results((RWSCAN_VERBOSE_FH, "\tscan (%.3f)\n",
+                                 metrics->scan_probability));
+
+          if (scan == NULL) {
+              skAppPrintOutOfMemory("scan data");
+              return -1;
+          }
+
+          /* yup, it's a scan */
+          pthread_mutex_lock(&summary_metrics.mutex);
+          summary_metrics.scanners++;
+          pthread_mutex_unlock(&summary_metrics.mutex);
+          memset(scan, 0, sizeof(scan_info_t));
+          scan->ip        = metrics->sip;
+          scan->model     = metrics->model;
+          scan->stime     = metrics->stime;
+          scan->etime     = metrics->etime;
+          scan->flows     = metrics->event_size;
+          scan->pkts      = metrics->pkts;
+          scan->bytes     = metrics->bytes;
+          scan->proto     = metrics->protocol;
+          scan->scan_prob = metrics->scan_probability;
+          scan->sampled   = metrics->sampled;
+
+          assert(scan->scan_prob > 0);
+
+          pthread_mutex_lock(&output_mutex);
+          write_scan_record(scan, out_scans.of_fp, options.no_columns,
+                            options.delimiter,
+                            options.model_fields);
+          pthread_mutex_unlock(&output_mutex);
+          free(scan);
+      }
+        break;
+      case EVENT_BENIGN:
+        print_verbose_results((RWSCAN_VERBOSE_FH, "\tbenign (%.3f)\n",
+                               metrics->scan_probability));
+        pthread_mutex_lock(&summary_metrics.mutex);
+        summary_metrics.benign++;
+        pthread_mutex_unlock(&summary_metrics.mutex);
+        break;
+      case EVENT_BACKSCATTER:
+        print_verbose_results((RWSCAN_VERBOSE_FH, "\tbackscatter\n"));
+        pthread_mutex_lock(&summary_metrics.mutex);
+        summary_metrics.backscatter++;
+        pthread_mutex_unlock(&summary_metrics.mutex);
+        break;
+      case EVENT_FLOOD:
+        print_verbose_results((RWSCAN_VERBOSE_FH, "\tflood\n"));
+        pthread_mutex_lock(&summary_metrics.mutex);
+        summary_metrics.flooders++;
+        pthread_mutex_unlock(&summary_metrics.mutex);
+        break;
+      case EVENT_UNKNOWN:
+        print_verbose_results((RWSCAN_VERBOSE_FH, "\tunknown (%.3f)\n",
+                               metrics->scan_probability));
+        pthread_mutex_lock(&summary_metrics.mutex);
+        summary_metrics.unknown++;
+        pthread_mutex_unlock(&summary_metrics.mutex);
+        break;
+    }
+
+    return 0;
+}
+
+
+/*  THREAD ENTRY POINT  */
+void *
+worker_thread(
+    void               *myarg)
+{
+    work_queue_node_t    *mynode;
+    worker_thread_data_t *mywork;
+    worker_thread_data_t  event;
+    cleanup_node_t       *cleanup_node;
+
+    event_columns_t  columns;
+    trw_counters_t   counters;
+    rwscan_flow_t   *block = NULL;
+    size_t           event_bytes;
+    uint32_t         i;
+
+    /* ignore all signals */
+    skthread_ignore_signals();
+
+    cleanup_node = (cleanup_node_t *) myarg;
+    memset(&columns, 0, sizeof(columns));
+    if (options.compress_events) {
+        block = (rwscan_flow_t*)malloc(RWSCAN_STREAM_BLOCK_SIZE
+                                       * sizeof(rwscan_flow_t));
+        if (block == NULL) {
+            skAppPrintOutOfMemory("event flow block");
+            return NULL;
+        }
+    }
+
+    while (workqueue_wait_get(work_queue, cleanup_node->threadnum - 1,
+                              &mynode) == 0)
+    {
+        mywork = (worker_thread_data_t *) mynode;
+        event_bytes = mywork->node.size;
+
+        if (mywork->offsets) {
+            /* a batch of small events */
+            for (i = 0; i < mywork->events; ++i) {
+                memset(&event, 0, sizeof(event));
+                event.flows    = &mywork->flows[mywork->offsets[i]];
+                event.capacity = mywork->offsets[i+1] - mywork->offsets[i];
+                event.metrics  = &mywork->metrics[i];
+                event.counters = &counters;
+                event.columns  = &columns;
+                event.block    = block;
+                if (process_event(&event, cleanup_node->threadnum)) {
+                    return NULL;
+                }
+            }
+        } else {
+            mywork->counters = &counters;
+            mywork->columns  = &columns;
+            mywork->block    = block;
+            if (process_event(mywork, cleanup_node->threadnum)) {
+                return NULL;
+            }
+        }
+
+        /* hand the buffers back for the reader to reuse */
+        work_release(mywork);
+        workqueue_finish(work_queue, event_bytes);
+    }
+    if (options.verbose_progress) {
+        fprintf(RWSCAN_VERBOSE_FH, "work queue deactivated\n");
+    }
+
+    event_columns_free(&columns);
+    free(block);
+    workqueue_put(cleanup_queue, &(cleanup_node->node));
+
+    if (options.verbose_progress) {
+        fprintf(RWSCAN_VERBOSE_FH, "thread %d shutting down...\n",
+                cleanup_node->threadnum);
+    }
+    return NULL;
+}
+
+
+/*
+ *  status = event_buf_begin(ev, sip, proto, capacity);
+ *
+ *    Start a new event in 'ev' for 'sip' and 'proto', making room for
+ *    at least 'capacity' flows if 'ev' has no flow buffer.  The
+ *    buffers are taken from the pool.  Use event_buf_add() to add
+ *    flows to the event.  Return 0 on success or -1 on allocation
+ *    failure.
+ */
+int
+event_buf_begin(
+    event_buf_t        *ev,
+    uint32_t            sip,
+    uint8_t             proto,
+    uint32_t            capacity)
+{
+    if (ev->flows == NULL) {
+        capacity = pool_flows_capacity(capacity);
+        ev->flows = pool_flows_get(capacity);
+        if (ev->flows == NULL) {
+            skAppPrintOutOfMemory("event flow data");
+            return -1;
+        }
+        ev->capacity = capacity;
+    }
+
+    if (ev->metrics == NULL) {
+        ev->metrics = pool_metrics_get();
+        if (ev->metrics == NULL) {
+            skAppPrintOutOfMemory("metrics data");
+            return -1;
+        }
+    }
+
+    memset(ev->metrics, 0, sizeof(event_metrics_t));
+    ev->metrics->protocol = proto;
+    ev->metrics->sip      = sip;
+    ev->count = 0;
+    memset(&ev->trw, 0, sizeof(trw_stream_t));
+
+    return 0;
+}
+
+
+/*
+ *  rwrec = event_buf_reserve(ev);
+ *
+ *    Return a pointer to the slot for the next flow of the event in
+ *    'ev', moving the flows to the next larger pool buffer as needed;
+ *    see pool_flows_capacity().  Once the buffer holds
+ *    --compress-events flows, its flows are instead compressed into
+ *    the event's chunks and the buffer is reused.  The caller fills
+ *    the slot and calls event_buf_commit().  Return NULL on failure.
+ */
+rwscan_flow_t *
+event_buf_reserve(
+    event_buf_t        *ev)
+{
+    if (ev->count == ev->capacity) {
+        rwscan_flow_t *flows;
+
+        if (options.compress_events && ev->count >= options.compress_events) {
+            if (ev->chunks == NULL) {
+                ev->chunks = event_chunks_create(ev->metrics->sip,
+                                                 ev->metrics->protocol);
+                if (ev->chunks == NULL) {
+                    skAppPrintOutOfMemory("compressed event data");
+                    return NULL;
+                }
+            }
+            if (event_chunks_add_run(ev->chunks, ev->flows, ev->count)) {
+                return NULL;
+            }
+            ev->count = 0;
+            return &ev->flows[0];
+        }
+
+        flows = pool_flows_grow(ev->flows, ev->count, &ev->capacity);
+        if (flows == NULL) {
+            skAppPrintOutOfMemory("event flow data");
+            return NULL;
+        }
+        ev->flows = flows;
+    }
+
+    return &ev->flows[ev->count];
+}
+
+
+/*
+ *  keep = event_buf_trw_update(ev, rwrec);
+ *
+ *    Add the flow 'rwrec' to the TRW test the reader runs on the event
+ *    in 'ev'; see --trw-in-reader.  The test follows
+ *    invoke_trw_model() flow by flow.  Once it calls the source a
+ *    scanner, or benign when BLR will not run, the flows held by the
+ *    event are dropped and later flows only add to its packet and
+ *    byte counts.  When the test cannot reach a verdict, it stops and
+ *    the worker thread tests the whole event.  Return 1 when 'rwrec'
+ *    is to be kept in the event, or 0 when it is not.
+ */
+static int
+event_buf_trw_update(
+    event_buf_t            *ev,
+    const rwscan_flow_t    *rwrec)
+{
+    event_metrics_t *metrics  = ev->metrics;
+    trw_counters_t  *counters = &ev->trw.counters;
+    uint32_t         dip      = flowGetDIPv4(rwrec);
+    skipaddr_t       ipaddr;
+    int              hit;
+
+    metrics->pkts  += flowGetPkts(rwrec);
+    metrics->bytes += flowGetBytes(rwrec);
+    if (ev->trw.state == TRW_STREAM_DROP) {
+        return 0;
+    }
+
+    counters->flows++;
+    if ((flowGetFlags(rwrec) & TCP_FLAGS_STATE) == SYN_FLAG) {
+        counters->syns++;
+    }
+    if (counters->syns != counters->flows
+        || metrics->event_size > RWSCAN_FLOW_CUTOFF + 1)
+    {
+        /* no verdict is possible; the worker computes the packet and
+         * byte counts along with the other metrics */
+        metrics->pkts  = 0;
+        metrics->bytes = 0;
+        ev->trw.state = TRW_STREAM_OFF;
+        return 1;
+    }
+
+    if (dip != ev->trw.dip_prev) {
+        pthread_mutex_lock(&trw_data.mutex);
+        skipaddrSetV4(&ipaddr, &dip);
+        hit = skIPSetCheckAddress(trw_data.existing, &ipaddr);
+        pthread_mutex_unlock(&trw_data.mutex);
+        if (hit) {
+            counters->hits++;
+            counters->log_likelihood += trw_data.log_hit;
+        } else {
+            counters->misses++;
+            counters->log_likelihood += trw_data.log_miss;
+        }
+        counters->dips++;
+        ev->trw.dip_prev = dip;
+    }
+
+    if (counters->log_likelihood > trw_data.log_eta1) {
+        pthread_mutex_lock(&trw_data.mutex);
+        skIPTreeAddAddress(trw_data.scanners, metrics->sip);
+        pthread_mutex_unlock(&trw_data.mutex);
+        metrics->event_class = EVENT_SCAN;
+    } else if (counters->log_likelihood < trw_data.log_eta0) {
+        pthread_mutex_lock(&trw_data.mutex);
+        skIPTreeAddAddress(trw_data.benign, metrics->sip);
+        pthread_mutex_unlock(&trw_data.mutex);
+        metrics->event_class = EVENT_BENIGN;
+    } else {
+        return 1;
+    }
+    metrics->model = RWSCAN_MODEL_TRW;
+    metrics->scan_probability = exp(counters->log_likelihood);
+
+    if (metrics->event_class == EVENT_BENIGN
+        && options.scan_model == RWSCAN_MODEL_HYBRID)
+    {
+        /* BLR measures every flow of a benign source */
+        metrics->pkts  = 0;
+        metrics->bytes = 0;
+        ev->trw.state = TRW_STREAM_OFF;
+        return 1;
+    }
+    ev->count = 0;
+    event_chunks_destroy(&ev->chunks);
+    ev->trw.state = TRW_STREAM_DROP;
+    return 0;
+}
+
+
+/*
+ *  event_buf_commit(ev);
+ *
+ *    Add the flow in the slot returned by event_buf_reserve() to the
+ *    event in 'ev' and update the event's start and end times.  When
+ *    the reader's TRW test has decided the event, the flow only adds
+ *    to the event's counts and the slot is reused.
+ */
+void
+event_buf_commit(
+    event_buf_t        *ev)
+{
+    event_metrics_t *metrics = ev->metrics;
+    const rwscan_flow_t *rwrec   = &ev->flows[ev->count];
+
+    event_times_add(metrics, rwrec, (metrics->event_size == 0));
+    metrics->event_size++;
+    if (ev->trw.state != TRW_STREAM_OFF && !event_buf_trw_update(ev, rwrec)) {
+        return;
+    }
+    ev->count++;
+}
+
+
+/*
+ *  status = event_buf_add(ev, rwrec);
+ *
+ *    Append a copy of 'rwrec' to the event in 'ev'.  Return 0 on
+ *    success or -1 on allocation failure.
+ */
+int
+event_buf_add(
+    event_buf_t        *ev,
+    const rwscan_flow_t *rwrec)
+{
+    rwscan_flow_t *slot;
+
+    slot = event_buf_reserve(ev);
+    if (slot == NULL) {
+        return -1;
+    }
+    memcpy(slot, rwrec, sizeof(rwscan_flow_t));
+    event_buf_commit(ev);
+
+    return 0;
+}
+
+
+/*
+ *  flows = work_flows(work);
+ *
+ *    Return the number of flows in the event or batch of events in
+ *    'work', the estimate of the time needed to analyze it.
+ */
+static uint64_t
+work_flows(
+    const worker_thread_data_t *work)
+{
+    if (work->offsets) {
+        return work->offsets[work->events];
+    }
+    return work->metrics->event_size;
+}
+
+
+/*
+ *  cmp = held_compare(node1, node2, ctx);
+ *
+ *    Compare the worker_thread_data_t pointers at 'node1' and 'node2'
+ *    by their number of flows, so that the heap of held events keeps
+ *    the largest at the top.
+ */
+static int
+held_compare(
+    const skheapnode_t  node1,
+    const skheapnode_t  node2,
+    void        UNUSED(*ctx))
+{
+    uint64_t a = work_flows(*(worker_thread_data_t**)node1);
+    uint64_t b = work_flows(*(worker_thread_data_t**)node2);
+
+    return ((a < b) ? -1 : (a > b));
+}
+
+
+/*
+ *  work_release(work);
+ *
+ *    Return the buffers of the event or batch of events in 'work' to
+ *    the pool.
+ */
+static void
+work_release(
+    worker_thread_data_t   *work)
+{
+    if (work->offsets) {
+        pool_batch_put(work);
+        return;
+    }
+    pool_flows_put(work->flows, work->capacity);
+    pool_metrics_put(work->metrics);
+    event_chunks_destroy(&work->chunks);
+    pool_work_put(work);
+}
+
+
+/*
+ *  event_dispatch_pop(disp);
+ *
+ *    Hand the largest event held back by 'disp' to the worker
+ *    threads.
+ */
+static void
+event_dispatch_pop(
+    event_dispatch_t   *disp)
+{
+    worker_thread_data_t *work;
+
+    skHeapExtractTop(disp->held, (skheapnode_t)&work);
+    workqueue_put_reserved(work_queue, &(work->node));
+}
+
+
+/*
+ *  status = event_dispatch_queue(disp, work);
+ *
+ *    Hold back the event or batch of events in 'work', handing the
+ *    largest events held by 'disp' to the worker threads once it
+ *    holds RWSCAN_HOLDBACK_EVENTS of them.  Queueing the largest
+ *    events first keeps a large event from starting after the others
+ *    and leaving one worker running alone.  The bytes of a held event
+ *    count against --memory-limit from the time it is held; when
+ *    they do not fit, the held events are queued so the workers can
+ *    free room for it.  Return 0 on success or -1 on allocation
+ *    failure.
+ */
+static int
+event_dispatch_queue(
+    event_dispatch_t       *disp,
+    worker_thread_data_t   *work)
+{
+    if (disp->held == NULL) {
+        disp->held = skHeapCreate2(&held_compare, RWSCAN_HOLDBACK_EVENTS,
+                                   sizeof(worker_thread_data_t*), NULL,
+                                   NULL);
+        if (disp->held == NULL) {
+            skAppPrintOutOfMemory("held events");
+            work_release(work);
+            return -1;
+        }
+    }
+    if (workqueue_try_reserve(work_queue, work->node.size)) {
+        while (skHeapGetNumberEntries(disp->held) > 0) {
+            event_dispatch_pop(disp);
+        }
+        workqueue_reserve(work_queue, work->node.size);
+    }
+    skHeapInsert(disp->held, &work);
+
+    while (skHeapGetNumberEntries(disp->held) >= RWSCAN_HOLDBACK_EVENTS) {
+        event_dispatch_pop(disp);
+    }
+    return 0;
+}
+
+
+/*
+ *  status = event_batch_add(ev, disp);
+ *
+ *    Copy the flows and metrics of the small event in 'ev' into the
+ *    batch of 'disp', passing that batch to event_dispatch_queue()
+ *    first when the event does not fit and starting a new batch as
+ *    needed.  'ev' keeps its buffers, so the next event may reuse
+ *    them.  Return 0 on success or -1 on allocation failure.
+ */
+static int
+event_batch_add(
+    event_buf_t        *ev,
+    event_dispatch_t   *disp)
+{
+    worker_thread_data_t *b = disp->batch;
+    uint32_t start;
+
+    if (b != NULL
+        && (b->events == RWSCAN_BATCH_EVENTS
+            || b->offsets[b->events] + ev->count > b->capacity))
+    {
+        disp->batch = NULL;
+        if (event_dispatch_queue(disp, b)) {
+            return -1;
+        }
+        b = NULL;
+    }
+    if (b == NULL) {
+        b = pool_batch_get();
+        if (b == NULL) {
+            skAppPrintOutOfMemory("event batch");
+            return -1;
+        }
+        disp->batch = b;
+    }
+
+    start = b->offsets[b->events];
+    memcpy(&b->flows[start], ev->flows, ev->count * sizeof(rwscan_flow_t));
+    memcpy(&b->metrics[b->events], ev->metrics, sizeof(event_metrics_t));
+    ++b->events;
+    b->offsets[b->events] = start + ev->count;
+
+    ev->count = 0;
+    return 0;
+}
+
+
+/*
+ *  status = event_dispatch_flush(disp);
+ *
+ *    Hand the batch of small events and every event held back by
+ *    'disp' to the worker threads, largest first.  Return 0 on
+ *    success or -1 on allocation failure.
+ */
+int
+event_dispatch_flush(
+    event_dispatch_t   *disp)
+{
+    worker_thread_data_t *b = disp->batch;
+
+    disp->batch = NULL;
+    if (b != NULL) {
+        if (b->events == 0) {
+            pool_batch_put(b);
+        } else if (event_dispatch_queue(disp, b)) {
+            return -1;
+        }
+    }
+    while (disp->held && skHeapGetNumberEntries(disp->held) > 0) {
+        event_dispatch_pop(disp);
+    }
+    return 0;
+}
+
+
+/*
+ *  event_dispatch_free(disp);
+ *
+ *    Release the events held by 'disp' without analyzing them.
+ */
+void
+event_dispatch_free(
+    event_dispatch_t   *disp)
+{
+    worker_thread_data_t *work;
+
+    pool_batch_put(disp->batch);
+    disp->batch = NULL;
+    if (disp->held) {
+        while (skHeapExtractTop(disp->held, (skheapnode_t)&work)
+               == SKHEAP_OK)
+        {
+            workqueue_release(work_queue, work->node.size);
+            work_release(work);
+        }
+        skHeapFree(disp->held);
+        disp->held = NULL;
+    }
+}
+
+
+/*
+ *  status = event_buf_dispatch(ev, disp);
+ *
+ *    Hand the event in 'ev' to the worker threads by way of 'disp';
+ *    see event_dispatch_queue().  Handing an event to the workers
+ *    waits while the work queue is full or the events already queued
+ *    or being analyzed hold --memory-limit bytes.
+ *
+ *    An event having at most RWSCAN_BATCH_MAX_EVENT_FLOWS flows is
+ *    copied into the batch of small events in 'disp', which is queued
+ *    once it is full, and 'ev' keeps its buffers.
+ *
+ *    Otherwise the worker takes ownership of the flows and metrics,
+ *    and 'ev' is left empty.  When the event has been compressed, the
+ *    remaining flows are added to its chunks and the worker is given
+ *    the chunks instead.  Return 0 on success or -1 on allocation
+ *    failure.
+ */
+int
+event_buf_dispatch(
+    event_buf_t        *ev,
+    event_dispatch_t   *disp)
+{
+    worker_thread_data_t *mywork;
+
+    if (ev->chunks == NULL && ev->count <= RWSCAN_BATCH_MAX_EVENT_FLOWS) {
+        return event_batch_add(ev, disp);
+    }
+
+    if (ev->chunks) {
+        if (event_chunks_add_run(ev->chunks, ev->flows, ev->count)) {
+            return -1;
+        }
+        pool_flows_put(ev->flows, ev->capacity);
+        ev->flows    = NULL;
+        ev->capacity = 0;
+    }
+
+    mywork = pool_work_get();
+    if (mywork == NULL) {
+        skAppPrintOutOfMemory("worker thread data");
+        return -1;
+    }
+    mywork->flows     = ev->flows;
+    mywork->capacity  = ev->capacity;
+    mywork->chunks    = ev->chunks;
+    mywork->metrics   = ev->metrics;
+    mywork->node.size = (ev->capacity * sizeof(rwscan_flow_t)
+                         + sizeof(event_metrics_t)
+                         + sizeof(worker_thread_data_t));
+    if (ev->chunks) {
+        mywork->node.size += event_chunks_memory(ev->chunks);
+    }
+
+    ev->flows    = NULL;
+    ev->capacity = 0;
+    ev->count    = 0;
+    ev->chunks   = NULL;
+    ev->metrics  = NULL;
+
+    return event_dispatch_queue(disp, mywork);
+}
+
+
+/*
+ *  event_buf_free(ev);
+ *
+ *    Return any flows and metrics held by 'ev' to the pool and free
+ *    its compressed flows.
+ */
+void
+event_buf_free(
+    event_buf_t        *ev)
+{
+    pool_flows_put(ev->flows, ev->capacity);
+    pool_metrics_put(ev->metrics);
+    event_chunks_destroy(&ev->chunks);
+    ev->flows    = NULL;
+    ev->metrics  = NULL;
+    ev->capacity = 0;
+    ev->count    = 0;
+}
+
+
+/*
+ *  print_progress(last_sip, next_sip);
+ *
+ *    Print a progress message when 'next_sip' is in a different
+ *    --verbose-progress netblock than 'last_sip'.
+ */
+void
+print_progress(
+    uint32_t            last_sip,
+    uint32_t            next_sip)
+{
+    uint32_t prog_ip;
+
+    prog_ip = next_sip & options.verbose_progress;
+    if ((last_sip & options.verbose_progress) != prog_ip) {
+        char ipstr[SKIPADDR_STRLEN];
+        skipaddr_t ipaddr;
+        skipaddrSetV4(&ipaddr, &prog_ip);
+        fprintf(RWSCAN_VERBOSE_FH, "progress: %s\n",
+                skipaddrString(ipstr, &ipaddr, 0));
+    }
+}
+
+
+/*
+ *  rwrec = assembler_reserve(as, sip, proto);
+ *
+ *    Return a pointer to the slot for the next flow of the event
+ *    being assembled in 'as' from input that is sorted by sip and
+ *    proto.  When 'sip' or 'proto' differs from that of the current
+ *    event, the current event is dispatched and a new one begun.  The
+ *    caller fills the slot with a record having 'sip' and 'proto'
+ *    and calls assembler_commit().  Return NULL on failure.
+ */
+rwscan_flow_t *
+assembler_reserve(
+    event_assembler_t  *as,
+    uint32_t            sip,
+    uint8_t             proto)
+{
+    event_buf_t *ev = &as->ev;
+
+    /* These are the conditions under which we process the current event
+     * (if applicable) and begin a new one. */
+    if (ev->metrics == NULL || ev->metrics->event_size == 0
+        || sip != as->last_sip
+        || proto != as->last_proto)
+    {
+        /* If we have flows to examine, do so. */
+        if (ev->metrics != NULL && ev->metrics->event_size > 0) {
+            print_progress(as->last_sip, sip);
+            if (event_buf_dispatch(ev, &as->disp)) {
+                return NULL;
+            }
+        }
+
+        /* begin new event */
+        if (event_buf_begin(ev, sip, proto, RWSCAN_GROUP_ALLOC_SIZE)) {
+            return NULL;
+        }
+        /* the flows of a TCP event arrive in order of dip, so the
+         * TRW test may run as they are read */
+        if (options.trw_in_reader && proto == IPPROTO_TCP
+            && options.scan_model != RWSCAN_MODEL_BLR)
+        {
+            ev->trw.state    = TRW_STREAM_TESTING;
+            ev->trw.dip_prev = 0xffffffff;
+        }
+    }
+
+    as->last_sip   = sip;
+    as->last_proto = proto;
+    return event_buf_reserve(ev);
+}
+
+
+/*
+ *  assembler_commit(as);
+ *
+ *    Add the flow in the slot returned by assembler_reserve() to the
+ *    current event of 'as'.
+ */
+void
+assembler_commit(
+    event_assembler_t  *as)
+{
+    event_buf_commit(&as->ev);
+}
+
+
+/*
+ *  status = assembler_add(as, rwrec);
+ *
+ *    Add a copy of 'rwrec' to the event being assembled in 'as'; see
+ *    assembler_reserve().  Return 0 on success or -1 on failure.
+ */
+int
+assembler_add(
+    event_assembler_t  *as,
+    const rwscan_flow_t *rwrec)
+{
+    rwscan_flow_t *slot;
+
+    slot = assembler_reserve(as, flowGetSIPv4(rwrec), flowGetProto(rwrec));
+    if (slot == NULL) {
+        return -1;
+    }
+    memcpy(slot, rwrec, sizeof(rwscan_flow_t));
+    assembler_commit(as);
+    return 0;
 }
 
 
-#ifndef SKTHREAD_UNKNOWN_ID
-/* Create a local copy of the function from libsilk-thrd. */
 /*
- *    Tell the current thread to ignore all signals except those
- *    indicating a failure (e.g., SIGBUS and SIGSEGV).
+ *  status = assembler_finish(as);
+ *
+ *    Dispatch the final event held by 'as', if any, and the events
+ *    not yet queued, and release the assembler's buffers.  Return 0
+ *    on success or -1 on failure.
  */
-static void
-skthread_ignore_signals(
-    void)
+int
+assembler_finish(
+    event_assembler_t  *as)
 {
-    sigset_t sigs;
+    int retval = 0;
 
-    sigfillset(&sigs);
-    sigdelset(&sigs, SIGABRT);
-    sigdelset(&sigs, SIGBUS);
-    sigdelset(&sigs, SIGILL);
-    sigdelset(&sigs, SIGSEGV);
+    if (as->ev.metrics != NULL && as->ev.metrics->event_size > 0) {
+        retval = event_buf_dispatch(&as->ev, &as->disp);
+    }
+    if (retval == 0) {
+        retval = event_dispatch_flush(&as->disp);
+    }
+    assembler_free(as);
+    return retval;
+}
 
-#ifdef SIGEMT
-    sigdelset(&sigs, SIGEMT);
-#endif
-#ifdef SIGIOT
-    sigdelset(&sigs, SIGIOT);
-#endif
-#ifdef SIGSYS
-    sigdelset(&sigs, SIGSYS);
-#endif
 
-    pthread_sigmask(SIG_SETMASK, &sigs, NULL);
+/*
+ *  assembler_free(as);
+ *
+ *    Release the buffers held by 'as' without dispatching its events.
+ */
+void
+assembler_free(
+    event_assembler_t  *as)
+{
+    event_buf_free(&as->ev);
+    event_dispatch_free(&as->disp);
 }
-#endif  /* #ifndef SKTHREAD_UNKNOWN_ID */
 
 
-/*  THREAD ENTRY POINT  */
-void *
-worker_thread(
-    void               *myarg)
+/*
+ *  status = add_unsorted_records(recs, count);
+ *
+ *    Pass the 'count' records in 'recs' to the external sort or to
+ *    the in-memory grouping, depending on the options.
+ */
+static int
+add_unsorted_records(
+    const rwscan_flow_t *recs,
+    size_t              count)
 {
-    work_queue_node_t    *mynode;
-    worker_thread_data_t *mywork;
-    cleanup_node_t       *cleanup_node;
-
-    rwRec           *flows;
-    event_metrics_t *metrics;
-    skipaddr_t       ipaddr;
-    char             ipstr[SKIPADDR_STRLEN];
+    if (options.sort_buffer_size) {
+        return sort_add_records(recs, count);
+    }
+    return group_add_records(recs, count);
+}
 
-    /* ignore all signals */
-    skthread_ignore_signals();
 
-    cleanup_node = (cleanup_node_t *) myarg;
-    pthread_mutex_lock(&work_queue->mutex);
+/*
+ *  rv = source_next(src, &sip, &proto);
+ *
+ *    Move 'src' to its next record and set 'sip' and 'proto' to the
+ *    record's source IP and protocol; the record itself is fetched by
+ *    source_get_record().  Set the source's 'index' to the position of
+ *    the record in the file.  Return SKSTREAM_OK on success, or the
+ *    skstream error code at the end of the input.
+ */
+static int
+source_next(
+    input_source_t     *src,
+    uint32_t           *sip,
+    uint8_t            *proto)
+{
+    int rv;
 
-    while (work_queue->active) {
-        while (workqueue_depth(work_queue) == 0 && work_queue->active) {
-            pthread_cond_wait(&work_queue->cond_posted, &work_queue->mutex);
-        }
-        if (!work_queue->active) {
-            if (options.verbose_progress) {
-                fprintf(RWSCAN_VERBOSE_FH, "work queue no longer active\n");
+    if (src->is_mapped) {
+        while (src->next_index < src->mf.count) {
+            src->index = src->next_index++;
+            if (0 == mapped_file_get_key(&src->mf, src->index, sip, proto)) {
+                return SKSTREAM_OK;
             }
-            break;
         }
-        workqueue_get(work_queue, &mynode);
-        mywork = (worker_thread_data_t *) mynode;
+        return SKSTREAM_ERR_EOF;
+    }
+
+    if (src->dec) {
+        rv = decoder_read_record(src->dec, &src->rwrec);
+    } else {
+        rv = skStreamReadRecord(src->stream, &src->rwrec);
+    }
+    if (rv == SKSTREAM_OK) {
+        src->index = src->next_index++;
+        *sip = rwRecGetSIPv4(&src->rwrec);
+        *proto = rwRecGetProto(&src->rwrec);
+    }
+    return rv;
+}
 
-        flows   = mywork->flows;
-        metrics = mywork->metrics;
 
-        pthread_mutex_unlock(&work_queue->mutex);
+/*
+ *  source_get_record(src, flow);
+ *
+ *    Fill 'flow' with the record at which 'src' is positioned.  For a
+ *    mapped file, the record is decoded from the map directly into
+ *    'flow', which is typically the record's slot in its event.
+ */
+static void
+source_get_record(
+    const input_source_t   *src,
+    rwscan_flow_t          *flow)
+{
+    if (src->is_mapped) {
+        mapped_file_decode(&src->mf, src->index, flow);
+    } else {
+        flow_from_rwrec(flow, &src->rwrec);
+    }
+}
 
-        skipaddrSetV4(&ipaddr, &metrics->sip);
-        skipaddrString(ipstr, &ipaddr, 0);
-        print_verbose_results((RWSCAN_VERBOSE_FH, "%d. %s [%d] (%u) ",
-                               cleanup_node->threadnum, ipstr,
-                               metrics->protocol, metrics->event_size));
 
-        if ((metrics->protocol == IPPROTO_TCP)
-            && (options.scan_model == RWSCAN_MODEL_HYBRID
-                || options.scan_model == RWSCAN_MODEL_TRW))
-        {
-            mywork->counters
-                = (trw_counters_t*)calloc(1, sizeof(trw_counters_t));
-            if (mywork->counters == NULL) {
-                skAppPrintOutOfMemory("TRW counters");
-                return NULL;
+/*
+ *  status = source_seek(src, range, &last_sip, &last_proto);
+ *
+ *    Position 'src' at the first record of 'range'.  For sorted input,
+ *    set 'last_sip' and 'last_proto' to those of the record before
+ *    the range and return 1; the event of that record is finished by
+ *    the reader of the previous range.  Otherwise return 0.  Return
+ *    -1 on error.
+ */
+static int
+source_seek(
+    input_source_t         *src,
+    const input_range_t    *range,
+    uint32_t               *last_sip,
+    uint8_t                *last_proto)
+{
+    uint64_t idx;
+    size_t to_skip;
+    size_t skipped;
+    int rv;
+
+    if (src->is_mapped) {
+        src->next_index = range->start;
+        mapped_file_advise(&src->mf, range->start, range->end);
+        if (options.unsorted_input) {
+            return 0;
+        }
+        for (idx = range->start; idx > 0; --idx) {
+            if (0 == mapped_file_get_key(&src->mf, idx - 1,
+                                         last_sip, last_proto))
+            {
+                return 1;
             }
-            memset(mywork->counters, 0, sizeof(trw_counters_t));
-            invoke_trw_model(mywork);
-        }
-        if ((metrics->event_class != EVENT_SCAN
-             && metrics->event_class != EVENT_FLOOD
-             && metrics->event_class != EVENT_BACKSCATTER)
-            && (options.scan_model == RWSCAN_MODEL_HYBRID
-                || options.scan_model == RWSCAN_MODEL_BLR))
-        {
-            qsort(flows, metrics->event_size, sizeof(rwRec),
-                  rwrec_compare_proto_stime);
-            invoke_blr_model(mywork);
-        }
-        switch (metrics->event_class) {
-          case EVENT_SCAN:
-          {
-              scan_info_t *scan = (scan_info_t*)malloc(sizeof(scan_info_t));
-
-              print_verbose_results((RWSCAN_VERBOSE_FH, "\tscan (%.3f)\n",
-                                     metrics->scan_probability));
-
-              if (scan == NULL) {
-                  skAppPrintOutOfMemory("scan data");
-                  return NULL;
-              }
-
-              /* yup, it's a scan */
-              pthread_mutex_lock(&summary_metrics.mutex);
-              summary_metrics.scanners++;
-              pthread_mutex_unlock(&summary_metrics.mutex);
-              memset(scan, 0, sizeof(scan_info_t));
-              scan->ip        = metrics->sip;
-              scan->model     = metrics->model;
-              scan->stime     = metrics->stime;
-              scan->etime     = metrics->etime;
-              scan->flows     = metrics->event_size;
-              scan->pkts      = metrics->pkts;
-              scan->bytes     = metrics->bytes;
-              scan->proto     = metrics->protocol;
-              scan->scan_prob = metrics->scan_probability;
-
-              assert(scan->scan_prob > 0);
-
-              pthread_mutex_lock(&output_mutex);
-              write_scan_record(scan, out_scans.of_fp, options.no_columns,
-                                options.delimiter,
-                                options.model_fields);
-              pthread_mutex_unlock(&output_mutex);
-              free(scan);
-          }
-            break;
-          case EVENT_BENIGN:
-            print_verbose_results((RWSCAN_VERBOSE_FH, "\tbenign (%.3f)\n",
-                                   metrics->scan_probability));
-            pthread_mutex_lock(&summary_metrics.mutex);
-            summary_metrics.benign++;
-            pthread_mutex_unlock(&summary_metrics.mutex);
-            break;
-          case EVENT_BACKSCATTER:
-            print_verbose_results((RWSCAN_VERBOSE_FH, "\tbackscatter\n"));
-            pthread_mutex_lock(&summary_metrics.mutex);
-            summary_metrics.backscatter++;
-            pthread_mutex_unlock(&summary_metrics.mutex);
-            break;
-          case EVENT_FLOOD:
-            print_verbose_results((RWSCAN_VERBOSE_FH, "\tflood\n"));
-            pthread_mutex_lock(&summary_metrics.mutex);
-            summary_metrics.flooders++;
-            pthread_mutex_unlock(&summary_metrics.mutex);
-            break;
-          case EVENT_UNKNOWN:
-            print_verbose_results((RWSCAN_VERBOSE_FH, "\tunknown (%.3f)\n",
-                                   metrics->scan_probability));
-            pthread_mutex_lock(&summary_metrics.mutex);
-            summary_metrics.unknown++;
-            pthread_mutex_unlock(&summary_metrics.mutex);
-            break;
         }
+        return 0;
+    }
 
-        if (mywork->flows) {
-            free(mywork->flows);
-        }
-        if (mywork->metrics) {
-            free(mywork->metrics);
-        }
-        if (mywork->counters) {
-            free(mywork->counters);
-        }
-        free(mywork);
-        pthread_mutex_lock(&work_queue->mutex);
-        work_queue->pending--;
-        pthread_cond_signal(&work_queue->cond_avail);
+    /* For sorted input, stop one record short of the range and read
+     * that record. */
+    src->next_index = range->start;
+    to_skip = range->start - (options.unsorted_input ? 0 : 1);
+    rv = skStreamSkipRecords(src->stream, to_skip, &skipped);
+    if (rv == SKSTREAM_OK && skipped == to_skip && !options.unsorted_input) {
+        rv = skStreamReadRecord(src->stream, &src->rwrec);
+        *last_sip = rwRecGetSIPv4(&src->rwrec);
+        *last_proto = rwRecGetProto(&src->rwrec);
     }
-    if (options.verbose_progress) {
-        fprintf(RWSCAN_VERBOSE_FH, "work queue deactivated\n");
+    if (rv != SKSTREAM_OK) {
+        skStreamPrintLastErr(src->stream, rv, &skAppPrintErr);
+        return -1;
     }
-
-    pthread_mutex_unlock(&work_queue->mutex);
-    workqueue_put(cleanup_queue, &(cleanup_node->node));
-    pthread_cond_signal(&cleanup_queue->cond_posted);
-
-    if (options.verbose_progress) {
-        fprintf(RWSCAN_VERBOSE_FH, "thread %d shutting down...\n",
-                cleanup_node->threadnum);
+    if (skipped != to_skip) {
+        skAppPrintErr("Unable to skip to record %" PRIu64 " of '%s'",
+                      range->start, range->path);
+        return -1;
     }
-    return NULL;
+    return !options.unsorted_input;
 }
 
 
 int
 process_file(
-    const char         *infile)
-{
-    skstream_t      *in;
-    rwRec           *event_flows = NULL; /* all flows for a given sip/proto */
-    rwRec            rwrec;              /* holds each record read */
-    uint32_t         last_sip   = 0;
-    uint32_t         last_proto = 0;
-    int              done       = 0;
-    event_metrics_t *metrics    = NULL;
-    int              retval     = -1;
-    int              rv;
+    const input_range_t    *range)
+{
+    input_source_t     src;
+    event_assembler_t  as;               /* all flows for a given sip/proto */
+    rwscan_flow_t     *slot;
+    uint32_t           sip;
+    uint8_t            proto;
+    uint32_t           last_sip      = 0;
+    uint8_t            last_proto    = 0;
+    int                same_key;
+    int                in_range;
+    int                skip_boundary = 0;
+    uint32_t           total_flows   = 0;
+    uint32_t           ignored_flows = 0;
+    rwscan_flow_t     *batch         = NULL;
+    size_t             batch_count   = 0;
+    int                retval        = -1;
+    int                rv;
+
+    memset(&as, 0, sizeof(as));
+    memset(&src, 0, sizeof(src));
+
+    /* map the input file if possible; otherwise open it as a stream */
+    rv = mapped_file_open(&src.mf, range->path);
+    if (rv == 0) {
+        src.is_mapped = 1;
+    } else {
+        rv = skStreamOpenSilkFlow(&src.stream, range->path, SK_IO_READ);
+        if (rv) {
+            skStreamPrintLastErr(src.stream, rv, &skAppPrintErr);
+            goto END;
+        }
+        skStreamSetIPv6Policy(src.stream, SK_IPV6POLICY_ASV4);
+#if defined(POSIX_FADV_SEQUENTIAL)
+        /* the file is read front to back; let the kernel read ahead */
+        posix_fadvise(skStreamGetDescriptor(src.stream), 0, 0,
+                      POSIX_FADV_SEQUENTIAL);
+#endif
+    }
 
-    metrics = (event_metrics_t*)calloc(1, sizeof(event_metrics_t));
-    if (metrics == NULL) {
-        skAppPrintOutOfMemory("metrics data");
-        return -1;
+    if (options.unsorted_input) {
+        batch = (rwscan_flow_t*)malloc(RWSCAN_READER_BATCH_SIZE
+                                       * sizeof(rwscan_flow_t));
+        if (batch == NULL) {
+            skAppPrintOutOfMemory("record batch");
+            goto END;
+        }
     }
 
-    RWREC_CLEAR(&rwrec);
-    /* open the input file */
+    if (range->start > 0 || src.is_mapped) {
+        /* Move to the start of the range.  For sorted input, records
+         * at the start of the range that share the sip and proto of
+         * the record before the range are skipped. */
+        skip_boundary = source_seek(&src, range, &last_sip, &last_proto);
+        if (skip_boundary == -1) {
+            goto END;
+        }
+    }
 
-    rv = skStreamOpenSilkFlow(&in, infile, SK_IO_READ);
-    if (rv) {
-        skStreamPrintLastErr(in, rv, &skAppPrintErr);
+    if (!src.is_mapped && options.decode_ahead
+        && decoder_create(&src.dec, src.stream, options.decode_ahead))
+    {
         goto END;
     }
-    skStreamSetIPv6Policy(in, SK_IPV6POLICY_ASV4);
 
     /* The main program runloop. */
-    while (!done) {
-        /* Read in a single RW record. */
-        if (!skStreamReadRecord(in, &rwrec)) {
-            pthread_mutex_lock(&summary_metrics.mutex);
-            summary_metrics.total_flows++;
-            pthread_mutex_unlock(&summary_metrics.mutex);
+    while ((rv = source_next(&src, &sip, &proto)) == SKSTREAM_OK) {
+        same_key = (sip == last_sip && proto == last_proto);
+        last_sip = sip;
+        last_proto = proto;
+
+        if (src.index < range->end) {
+            ++total_flows;
+            in_range = 1;
+        } else if (batch || !same_key) {
+            /* Past the end of the range and any event that spans it;
+             * the reader of the next range begins here. */
+            break;
         } else {
-            done = 1;
+            in_range = 0;
         }
 
         /* If the proto is one we don't care about, read the next record. */
-        if ((rwRecGetProto(&rwrec) != IPPROTO_ICMP)
-            && (rwRecGetProto(&rwrec) != IPPROTO_TCP)
-            && (rwRecGetProto(&rwrec) != IPPROTO_UDP))
+        if ((proto != IPPROTO_ICMP)
+            && (proto != IPPROTO_TCP)
+            && (proto != IPPROTO_UDP))
         {
-            pthread_mutex_lock(&summary_metrics.mutex);
-            summary_metrics.ignored_flows++;
-            pthread_mutex_unlock(&summary_metrics.mutex);
+            ignored_flows += in_range;
             continue;
         }
-        /* These are the conditions under which we process the current event
-         * (if applicable) and begin a new one. */
-        if (rwRecGetSIPv4(&rwrec)!= last_sip
-            || rwRecGetProto(&rwrec) != last_proto || done)
-        {
-            /* If we have flows to examine, do so. */
-            if (metrics->event_size > 0) {
-                worker_thread_data_t *mywork = NULL;
-                uint32_t prog_ip;
-
-                prog_ip = rwRecGetSIPv4(&rwrec) & options.verbose_progress;
-                if ((last_sip & options.verbose_progress) != prog_ip) {
-                    char ipstr[SKIPADDR_STRLEN];
-                    skipaddr_t ipaddr;
-                    skipaddrSetV4(&ipaddr, &prog_ip);
-                    fprintf(RWSCAN_VERBOSE_FH, "progress: %s\n",
-                            skipaddrString(ipstr, &ipaddr, 0));
-                }
-                mywork = ((worker_thread_data_t*)
-                          calloc(1, sizeof(worker_thread_data_t)));
-                if (mywork == NULL) {
-                    skAppPrintOutOfMemory("worker thread data");
-                    goto END;
-                }
-                mywork->flows   = event_flows;
-                mywork->metrics = metrics;
-                workqueue_put(work_queue, &(mywork->node));
-
-                metrics     = NULL;
-                event_flows = NULL;
-                mywork      = NULL;
 
+        if (skip_boundary) {
+            if (same_key) {
+                continue;
             }
+            skip_boundary = 0;
+        }
 
-            /* begin new event */
-            if (event_flows == NULL) {
-                event_flows = (rwRec*)malloc(RWSCAN_ALLOC_SIZE *sizeof(rwRec));
-                if (event_flows == NULL) {
-                    skAppPrintOutOfMemory("event flow data");
-                    goto END;
-                }
-            } else {
-                rwRec *old_event_flows = event_flows;
-                event_flows = (rwRec*)realloc(event_flows,
-                                              (RWSCAN_ALLOC_SIZE
-                                               * sizeof(rwRec)));
-                if (event_flows == NULL) {
-                    skAppPrintOutOfMemory("event flow data");
-                    event_flows = old_event_flows;
+        if (batch) {
+            /* Unsorted input is sorted or grouped by the reader; the
+             * events are dispatched once all input has been read.
+             * Records are handed over in batches since the grouping
+             * is shared by all reader threads. */
+            source_get_record(&src, &batch[batch_count]);
+            if (++batch_count == RWSCAN_READER_BATCH_SIZE) {
+                if (add_unsorted_records(batch, batch_count)) {
                     goto END;
                 }
+                batch_count = 0;
             }
-
-            if (metrics == NULL) {
-                metrics = (event_metrics_t*)malloc(sizeof(event_metrics_t));
-                if (metrics == NULL) {
-                    skAppPrintOutOfMemory("metrics data");
-                    goto END;
-                }
+        } else {
+            /* decode the record directly into its slot in the event */
+            slot = assembler_reserve(&as, sip, proto);
+            if (slot == NULL) {
+                goto END;
             }
+            source_get_record(&src, slot);
+            assembler_commit(&as);
+        }
+    }
+    if (rv != SKSTREAM_OK && rv != SKSTREAM_ERR_EOF) {
+        skStreamPrintLastErr(src.stream, rv, &skAppPrintErr);
+        goto END;
+    }
+
+    if (batch_count && add_unsorted_records(batch, batch_count)) {
+        goto END;
+    }
+
+    /* process the final event */
+    if (assembler_finish(&as)) {
+        goto END;
+    }
+
+    retval = 0;
+
+  END:
+    pthread_mutex_lock(&summary_metrics.mutex);
+    summary_metrics.total_flows   += total_flows;
+    summary_metrics.ignored_flows += ignored_flows;
+    pthread_mutex_unlock(&summary_metrics.mutex);
+
+    decoder_destroy(&src.dec);
+    skStreamDestroy(&src.stream);
+    mapped_file_close(&src.mf);
+    assembler_free(&as);
+    free(batch);
+    return retval;
+}
+
+/*
+ *  status = count_file_records(path, &count);
+ *
+ *    Set 'count' to the number of records in the SiLK Flow file
+ *    'path' when that number can be computed from the size of the
+ *    file; that is, when the file is a seekable, uncompressed file.
+ *    Return 0 when 'count' was set, or -1 when the file cannot be
+ *    split into ranges.
+ */
+static int
+count_file_records(
+    const char         *path,
+    uint64_t           *count)
+{
+    skstream_t *in = NULL;
+    sk_file_header_t *hdr;
+    off_t file_size;
+    size_t hdr_len;
+    size_t rec_len;
+    int retval = -1;
+
+    if (!is_regular_file(path)) {
+        /* do not consume the header of the standard input or a pipe */
+        goto END;
+    }
+    if (skStreamOpenSilkFlow(&in, path, SK_IO_READ)) {
+        /* leave the reporting of the error to process_file() */
+        goto END;
+    }
+    if (!skStreamIsSeekable(in)) {
+        goto END;
+    }
+    hdr = skStreamGetSilkHeader(in);
+    if (skHeaderGetCompressionMethod(hdr) != SK_COMPMETHOD_NONE) {
+        goto END;
+    }
+    hdr_len = skHeaderGetLength(hdr);
+    rec_len = skHeaderGetRecordLength(hdr);
+    file_size = skFileSize(path);
+    if (rec_len == 0 || file_size < (off_t)hdr_len
+        || ((file_size - hdr_len) % rec_len) != 0)
+    {
+        goto END;
+    }
+    *count = (file_size - hdr_len) / rec_len;
+    retval = 0;
+
+  END:
+    skStreamDestroy(&in);
+    return retval;
+}
+
+
+/*
+ *  status = add_input_file(path, pieces);
+ *
+ *    Append 'path' to the list of input ranges, dividing the file
+ *    into as many as 'pieces' ranges of records when it is large
+ *    enough and its record count is known.  The ranges refer to
+ *    'path', which must remain valid while they are read.  Return 0
+ *    on success or -1 on failure.
+ */
+static int
+add_input_file(
+    const char         *path,
+    uint32_t            pieces)
+{
+    static size_t ranges_max = 0;
+    input_range_t *range;
+    uint64_t count = 0;
+    uint64_t per_piece;
+    uint32_t i;
+
+    if (pieces > 1 && count_file_records(path, &count) == 0) {
+        if (count / pieces < RWSCAN_MIN_SPLIT_RECORDS) {
+            pieces = (uint32_t)(count / RWSCAN_MIN_SPLIT_RECORDS);
+        }
+    }
+    if (pieces < 1 || count == 0) {
+        pieces = 1;
+    }
+
+    if (input_ranges_count + pieces > ranges_max) {
+        input_range_t *old_ranges = input_ranges;
+        ranges_max = 2 * ranges_max + pieces + 16;
+        input_ranges = ((input_range_t*)
+                        realloc(input_ranges,
+                                ranges_max * sizeof(input_range_t)));
+        if (input_ranges == NULL) {
+            skAppPrintOutOfMemory("input ranges");
+            input_ranges = old_ranges;
+            return -1;
+        }
+    }
+
+    per_piece = count / pieces;
+    for (i = 0; i < pieces; ++i) {
+        range = &input_ranges[input_ranges_count++];
+        range->path = path;
+        range->start = i * per_piece;
+        range->end = ((i + 1 == pieces) ? UINT64_MAX : (i + 1) * per_piece);
+        range->is_split = (pieces > 1);
+    }
+    return 0;
+}
 
-            memset(metrics, 0, sizeof(event_metrics_t));
-            metrics->protocol = rwRecGetProto(&rwrec) ;
-            metrics->sip      = rwRecGetSIPv4(&rwrec);
-            metrics->stime    = rwRecGetStartSeconds(&rwrec);
-            metrics->etime    = rwRecGetEndSeconds(&rwrec);
 
+/*
+ *  status = next_input_range(&range);
+ *
+ *    Set 'range' to the next input range to read.  Return 0 on
+ *    success or non-zero when there are no more ranges or a reader
+ *    has failed.  May be called by several reader threads.
+ */
+static int
+next_input_range(
+    const input_range_t   **range)
+{
+    size_t next;
+    int rv = -1;
+
+    pthread_mutex_lock(&input_mutex);
+    if (!input_failed && input_ranges_next < input_ranges_count) {
+        *range = &input_ranges[input_ranges_next++];
+        rv = 0;
+    }
+    next = input_ranges_next;
+    pthread_mutex_unlock(&input_mutex);
+    prefetch_advance(next);
+    if (rv == 0 && options.verbose_progress) {
+        if ((*range)->is_split) {
+            fprintf(RWSCAN_VERBOSE_FH, "processing: %s from record %" PRIu64
+                    "\n", (*range)->path, (*range)->start);
         } else {
-            /* No new event, so keep adding flows to the current event. */
-            if (rwRecGetStartSeconds(&rwrec) < metrics->stime) {
-                metrics->stime = rwRecGetStartSeconds(&rwrec);
+            fprintf(RWSCAN_VERBOSE_FH, "processing: %s\n", (*range)->path);
+        }
+    }
+    return rv;
+}
+
+
+/*  THREAD ENTRY POINT  */
+static void *
+reader_thread(
+    void        UNUSED(*myarg))
+{
+    const input_range_t *range;
+
+    /* ignore all signals */
+    skthread_ignore_signals();
+
+    while (next_input_range(&range) == 0) {
+        if (process_file(range)) {
+            pthread_mutex_lock(&input_mutex);
+            input_failed = 1;
+            pthread_mutex_unlock(&input_mutex);
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ *  status = read_input_files();
+ *
+ *    Read every input file named on the command line or selected
+ *    from the repository.  When --reader-threads is greater than one,
+ *    that many threads each take the next unread file until none
+ *    remain.  When there are fewer files than reader threads, each
+ *    file whose records can be counted is divided into ranges so the
+ *    readers share it.  Once a range cannot be read, no more ranges
+ *    are started.  Return 0 on success or -1 on failure.
+ */
+static int
+read_input_files(
+    void)
+{
+    const input_range_t *range;
+    pthread_t *tids;
+    char     **files = NULL;
+    char      *input_file;
+    char       repo_path[PATH_MAX];
+    size_t     files_count = 0;
+    size_t     files_max = 0;
+    uint32_t   pieces = 1;
+    uint32_t   started;
+    size_t     x;
+    int        retval = -1;
+
+    for (;;) {
+        if (options.repo_selection) {
+            if (repo_next_path(repo_path, sizeof(repo_path))) {
+                break;
             }
-            if (rwRecGetStartSeconds(&rwrec) > metrics->etime) {
-                metrics->etime = rwRecGetEndSeconds(&rwrec);
+            input_file = repo_path;
+        } else if (skOptionsCtxNextArgument(optctx, &input_file)) {
+            break;
+        }
+        if (files_count == files_max) {
+            char **old_files = files;
+            files_max = (files_max ? 2 * files_max : 64);
+            files = (char**)realloc(files, files_max * sizeof(char*));
+            if (files == NULL) {
+                skAppPrintOutOfMemory("input file list");
+                files = old_files;
+                goto END;
             }
         }
+        /* the argument may live in a buffer that the next call reuses */
+        files[files_count] = strdup(input_file);
+        if (files[files_count] == NULL) {
+            skAppPrintOutOfMemory("input file name");
+            goto END;
+        }
+        ++files_count;
+    }
+    if (files_count && files_count < options.reader_threads) {
+        pieces = options.reader_threads / files_count;
+    }
+    for (x = 0; x < files_count; ++x) {
+        if (add_input_file(files[x], pieces)) {
+            goto END;
+        }
+    }
+    if (prefetch_start(input_ranges, input_ranges_count)) {
+        goto END;
+    }
 
-        if (!(metrics->event_size % RWSCAN_ALLOC_SIZE)
-            && (metrics->event_size != 0))
-        {
-            rwRec *old_event_flows = event_flows;
-            event_flows
-                = (rwRec*)realloc(event_flows,
-                                  ((metrics->event_size + RWSCAN_ALLOC_SIZE)
-                                   * sizeof(rwRec)));
-            if (event_flows == NULL) {
-                skAppPrintOutOfMemory("event flow data");
-                event_flows = old_event_flows;
+    if (options.reader_threads <= 1 || input_ranges_count <= 1) {
+        while (next_input_range(&range) == 0) {
+            if (process_file(range)) {
                 goto END;
             }
         }
-        metrics->event_size++;
-        memcpy(&(event_flows[metrics->event_size - 1]), &rwrec,
-               sizeof(rwRec));
-
-        last_sip   = rwRecGetSIPv4(&rwrec);
-        last_proto = rwRecGetProto(&rwrec);
+        retval = 0;
+        goto END;
     }
 
+    tids = (pthread_t*)malloc(options.reader_threads * sizeof(pthread_t));
+    if (tids == NULL) {
+        skAppPrintOutOfMemory("reader threads");
+        goto END;
+    }
     retval = 0;
+    for (started = 0; started < options.reader_threads; ++started) {
+        if (pthread_create(&tids[started], NULL, reader_thread, NULL)) {
+            skAppPrintErr("Unable to create reader thread");
+            retval = -1;
+            break;
+        }
+        if (options.verbose_progress) {
+            fprintf(RWSCAN_VERBOSE_FH, "created reader thread %u\n",
+                    started + 1);
+        }
+    }
+    for (x = 0; x < started; ++x) {
+        pthread_join(tids[x], NULL);
+    }
+    free(tids);
+    if (input_failed) {
+        retval = -1;
+    }
 
   END:
-    skStreamDestroy(&in);
-    if (event_flows != NULL) {
-        free(event_flows);
-    }
-    if (metrics != NULL) {
-        free(metrics);
+    prefetch_stop();
+    for (x = 0; x < files_count; ++x) {
+        free(files[x]);
     }
+    free(files);
+    free(input_ranges);
+    input_ranges = NULL;
+    input_ranges_count = 0;
     return retval;
 }
 
+
 int
 create_worker_threads(
     void)
@@ -652,17 +2321,12 @@ join_threads(
     }
 
     while (numthreads) {
-        pthread_mutex_lock(&cleanup_queue->mutex);
-
-        while (workqueue_depth(cleanup_queue) == 0) {
-            pthread_cond_wait(&cleanup_queue->cond_posted,
-                              &cleanup_queue->mutex);
+        if (workqueue_wait_get(cleanup_queue, 0, &mynode)) {
+            skAbort();
         }
-
-        workqueue_get(cleanup_queue, &mynode);
         curnode = (cleanup_node_t *) mynode;
+        workqueue_finish(cleanup_queue, 0);
 
-        pthread_mutex_unlock(&cleanup_queue->mutex);
         pthread_join(curnode->tid, NULL);
         if (options.verbose_progress) {
             fprintf(RWSCAN_VERBOSE_FH, "joined with thread %d\n",
@@ -679,19 +2343,24 @@ int main(
     int    argc,
     char **argv)
 {
-    char *input_file;
     int count;
     int rv = 0;
 
     /* set up for application */
     appSetup(argc, argv);
+    if (pool_setup()) {
+        exit(EXIT_FAILURE);
+    }
     pthread_mutex_init(&output_mutex, NULL);
 
     pthread_mutex_init(&summary_metrics.mutex, NULL);
 
-    cleanup_queue = workqueue_create(options.worker_threads);
+    cleanup_queue = workqueue_create(options.worker_threads, 0, 1);
 
-    work_queue = workqueue_create(options.work_queue_depth);
+    /* one lane per worker thread */
+    work_queue = workqueue_create(options.work_queue_depth,
+                                  options.memory_limit,
+                                  options.worker_threads);
 
     if (!options.no_titles) {
         write_scan_header(out_scans.of_fp, options.no_columns,
@@ -702,29 +2371,54 @@ int main(
         fprintf(RWSCAN_VERBOSE_FH, "Error starting worker threads!\n");
         skAbort();
     }
-    while (skOptionsCtxNextArgument(optctx, &input_file) == 0) {
-        if (options.verbose_progress) {
-            fprintf(RWSCAN_VERBOSE_FH, "processing: %s\n", input_file);
+    if (options.unsorted_input) {
+        if (options.sort_buffer_size) {
+            rv = sort_buffer_create();
+        } else {
+            rv = group_table_create();
+        }
+        if (rv) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (options.merge_inputs) {
+        if (merge_input_files()) {
+            exit(EXIT_FAILURE);
+        }
+        sort_buffer_destroy();
+    } else if (read_input_files()) {
+        exit(EXIT_FAILURE);
+    }
+    if (options.unsorted_input) {
+        if (options.sort_buffer_size) {
+            rv = sort_dispatch_all();
+            sort_buffer_destroy();
+        } else {
+            rv = group_dispatch_all();
+            group_table_destroy();
+        }
+        if (rv) {
+            exit(EXIT_FAILURE);
         }
-        process_file(input_file);
     }
 
-    pthread_mutex_lock(&work_queue->mutex);
-    while ((count = workqueue_depth(work_queue)) > 0) {
+    count = workqueue_depth(work_queue);
+    while (count > 0) {
         if (options.verbose_progress) {
             fprintf(RWSCAN_VERBOSE_FH,
                     "waiting for %d worker thread%s to finish...\n",
                     count, ((count > 1) ? "s" : ""));
         }
-        pthread_cond_wait(&work_queue->cond_avail, &work_queue->mutex);
+        count = workqueue_wait_finish(work_queue, count);
     }
-    pthread_mutex_unlock(&work_queue->mutex);
 
     workqueue_deactivate(work_queue);
     join_threads();
 
     workqueue_destroy(work_queue);
     workqueue_destroy(cleanup_queue);
+    pool_teardown();
+    event_chunks_teardown();
 
     if (options.verbose_progress) {
         fprintf(RWSCAN_VERBOSE_FH, "Read %u flows\n",
@@ -17,6 +17,7 @@ RCSIDENTVAR(rcsID_RWSCAN_H, "$SiLK: rwscan.h 945cf5167607 2019-01-07 18:54:17Z m
 
 #include <silk/iptree.h>
 #include <silk/rwrec.h>
+#include <silk/skheap.h>
 #include <silk/skipaddr.h>
 #include <silk/skipset.h>
 #include <silk/skprefixmap.h>
@@ -25,15 +26,16 @@ RCSIDENTVAR(rcsID_RWSCAN_H, "$SiLK: rwscan.h 945cf5167607 2019-01-07 18:54:17Z m
 #include <silk/utils.h>
 #include "rwscan_workqueue.h"
 
-/* bound on false positives */
-#define TRW_ALPHA   0.01
-/* detection probability */
-#define TRW_BETA    0.99
+/* bound on false positives; see --trw-alpha */
+#define TRW_DEFAULT_ALPHA   0.01
+/* detection probability; see --trw-beta */
+#define TRW_DEFAULT_BETA    0.99
 
-/* lower bound */
-#define TRW_ETA0    ( (1-TRW_BETA)/(1-TRW_ALPHA) )
-/* upper bound */
-#define TRW_ETA1    (TRW_BETA/TRW_ALPHA)
+/*
+ *  The TRW model accepts the hypothesis that a source is benign when
+ *  the likelihood ratio falls below (1 - beta) / (1 - alpha), and
+ *  that it is a scanner when the ratio rises above beta / alpha.
+ */
 
 /*
  *  The values used here require 10 success destination IPs to be valid, with
@@ -94,8 +96,78 @@ RCSIDENTVAR(rcsID_RWSCAN_H, "$SiLK: rwscan.h 945cf5167607 2019-01-07 18:54:17Z m
 /* TRW will give up after hitting this number of flows */
 #define RWSCAN_FLOW_CUTOFF 100000
 
+/* largest event flow buffer kept in the pool; larger events grow by
+ * this number of flows at a time */
 #define RWSCAN_ALLOC_SIZE 65536
 
+/* smallest --memory-limit the user may specify */
+#define RWSCAN_MIN_MEMORY_LIMIT  (1 << 20)
+
+/* smallest --compress-events and --spill-events the user may
+ * specify */
+#define RWSCAN_MIN_COMPRESS_EVENTS  1024
+
+/* smallest --sketch-events the user may specify */
+#define RWSCAN_MIN_SKETCH_EVENTS  1024
+
+/* smallest --event-flow-budget the user may specify */
+#define RWSCAN_MIN_BUDGET_FLOWS  1024
+
+/* number of flows the BLR model samples from an event that exceeds
+ * --event-time-budget when --event-flow-budget is not given */
+#define RWSCAN_BUDGET_SAMPLE_FLOWS  65536
+
+/* smallest --parallel-events the user may specify */
+#define RWSCAN_MIN_PARALLEL_EVENTS  65536
+
+/* fewest flows each thread is given when the flows of one event are
+ * split among several threads */
+#define RWSCAN_MIN_PARTITION_FLOWS  32768
+
+/* smallest --sort-buffer-size the user may specify */
+#define RWSCAN_MIN_SORT_BUFFER_SIZE  (1 << 20)
+
+/* maximum number of temporary files merged at once */
+#define RWSCAN_MAX_MERGE_FILES 256
+
+/* largest number of record batches a decoder thread may hold */
+#define RWSCAN_MAX_DECODE_AHEAD 64
+
+/* largest number of files that may be read ahead of the readers */
+#define RWSCAN_MAX_PREFETCH_FILES 64
+
+/* number of unsorted records a reader collects before passing them to
+ * the shared sort or grouping */
+#define RWSCAN_READER_BATCH_SIZE 1024
+
+/* fewest records a reader thread is given when a single input file is
+ * split among several reader threads */
+#define RWSCAN_MIN_SPLIT_RECORDS (1 << 16)
+
+/* number of flows of a compressed event that the worker threads
+ * decode at once */
+#define RWSCAN_STREAM_BLOCK_SIZE 4096
+
+/* number of flows the BLR kernels take through all of their passes
+ * while the flows' columns are still in the cache */
+#define RWSCAN_KERNEL_TILE 2048
+
+/* initial number of flows allocated for an event; most sources send
+ * only a handful of flows */
+#define RWSCAN_GROUP_ALLOC_SIZE 8
+
+/* largest event, in flows, that the reader packs into a batch with
+ * other small events instead of queueing the event on its own */
+#define RWSCAN_BATCH_MAX_EVENT_FLOWS 64
+
+/* most events and most flows held by one batch of small events */
+#define RWSCAN_BATCH_EVENTS 256
+#define RWSCAN_BATCH_FLOWS 4096
+
+/* number of events and batches each reader holds back so that it can
+ * hand the largest to the worker threads first */
+#define RWSCAN_HOLDBACK_EVENTS 64
+
 #define RWSCAN_MAX_FLAGS 64
 #define RWSCAN_MAX_PORTS 65536
 
@@ -115,6 +187,70 @@ RCSIDENTVAR(rcsID_RWSCAN_H, "$SiLK: rwscan.h 945cf5167607 2019-01-07 18:54:17Z m
 
 #define TCP_FLAGS_STATE (FIN_FLAG | SYN_FLAG | RST_FLAG | ACK_FLAG)
 
+/*
+ *  RWSCAN_KERNEL marks the loops over the columns of an event.  Where
+ *  the compiler and the loader support it, each is compiled for AVX2,
+ *  for SSE4.1, and for the baseline instruction set, and the loader
+ *  picks the version the CPU supports (by CPUID) when rwscan starts.
+ */
+#if defined(__GNUC__) && !defined(__clang__) && (__GNUC__ >= 6)   \
+    && defined(__x86_64__) && defined(__linux__)
+#define RWSCAN_KERNEL                                                \
+    __attribute__((target_clones("avx2", "sse4.1", "default")))
+#else
+#define RWSCAN_KERNEL
+#endif
+
+
+/*
+ *  rwscan_flow_t holds the fields of a flow record that the scan
+ *  models use, in 32 bytes instead of the size of an rwRec.  The
+ *  input records are projected onto this structure as they are read,
+ *  and events, sort buffers, and temporary files hold these.
+ */
+typedef struct rwscan_flow_st {
+    uint32_t    sip;
+    uint32_t    dip;
+    uint32_t    stime;          /* start time, seconds since the epoch */
+    uint32_t    elapsed;        /* duration, milliseconds */
+    uint32_t    pkts;
+    uint32_t    bytes;
+    uint16_t    sport;
+    uint16_t    dport;          /* ICMP type and code for ICMP flows */
+    uint16_t    stime_msec;     /* milliseconds part of the start time */
+    uint8_t     proto;
+    uint8_t     flags;
+} rwscan_flow_t;
+
+#define flowGetSIPv4(f)         ((f)->sip)
+#define flowGetDIPv4(f)         ((f)->dip)
+#define flowGetSPort(f)         ((f)->sport)
+#define flowGetDPort(f)         ((f)->dport)
+#define flowGetProto(f)         ((f)->proto)
+#define flowGetFlags(f)         ((f)->flags)
+#define flowGetPkts(f)          ((f)->pkts)
+#define flowGetBytes(f)         ((f)->bytes)
+#define flowGetIcmpType(f)      ((uint8_t)((f)->dport >> 8))
+#define flowGetIcmpCode(f)      ((uint8_t)((f)->dport & 0xFF))
+#define flowGetStartSeconds(f)  ((f)->stime)
+#define flowGetStartTime(f)                                     \
+    ((sktime_t)(f)->stime * 1000 + (f)->stime_msec)
+#define flowGetEndSeconds(f)                                    \
+    ((uint32_t)((flowGetStartTime(f) + (f)->elapsed) / 1000))
+
+/* the orders in which the flows of an event are sorted; see
+ * flow_sort() */
+typedef enum flow_order_en {
+    /* by dip and, for TCP flows, sport, for the BLR features */
+    FLOW_ORDER_DIP_SPORT,
+    /* by every field, as flow_compare_sip_proto_dip() orders them,
+     * for the flows of unsorted input */
+    FLOW_ORDER_FULL
+} flow_order_t;
+
+/* a qsort() comparison function for flows */
+typedef int (*flow_compare_fn_t)(const void *, const void *);
+
 
 enum EventClassification
 {
@@ -141,7 +277,8 @@ typedef enum field_id {
     RWSCAN_FIELD_PKTS,
     RWSCAN_FIELD_BYTES,
     RWSCAN_FIELD_MODEL,
-    RWSCAN_FIELD_SCAN_PROB
+    RWSCAN_FIELD_SCAN_PROB,
+    RWSCAN_FIELD_SAMPLED
 } field_id_t;
 
 struct field_def_st {
@@ -158,6 +295,9 @@ typedef struct options_st {
     const char  *trw_internal_set_file;
     double       trw_theta0;
     double       trw_theta1;
+    double       trw_alpha;
+    double       trw_beta;
+    uint8_t      trw_in_reader;
     const char  *output_file;
     uint8_t      integer_ips;
     uint8_t      model_fields;
@@ -170,6 +310,26 @@ typedef struct options_st {
     uint32_t     verbose_progress;
     uint32_t     worker_threads;
     uint32_t     work_queue_depth;
+    uint64_t     memory_limit;
+    uint32_t     reader_threads;
+    uint32_t     prefetch_files;
+    uint32_t     decode_ahead;
+    uint8_t      unsorted_input;
+    uint32_t     compress_events;
+    uint32_t     spill_events;
+    uint32_t     sketch_events;
+    uint32_t     budget_flows;
+    uint32_t     budget_msec;
+    uint32_t     parallel_events;
+    uint64_t     sort_buffer_size;
+    uint8_t      merge_inputs;
+    const char  *temp_directory;
+    uint8_t      repo_selection;
+    const char  *start_date;
+    const char  *end_date;
+    const char  *class_name;
+    const char  *type_names;
+    const char  *sensor_names;
 } options_t;
 
 typedef struct summary_metrics_st {
@@ -256,6 +416,7 @@ typedef struct event_metrics_st {
     enum EventClassification event_class;
     double scan_probability;
     enum ScanModel model;
+    uint8_t sampled;            /* BLR ran on a sample of the flows */
 } event_metrics_t;
 
 typedef struct trw_counters_st {
@@ -266,7 +427,7 @@ typedef struct trw_counters_st {
     uint32_t syns;              /* number of SYNs */
     uint32_t bs;                /* number of backscatter flows */
     uint32_t floodresponse;
-    double   likelihood;        /* used in hypothesis testing */
+    double   log_likelihood;    /* used in hypothesis testing */
 } trw_counters_t;
 
 typedef struct trw_data_st {
@@ -274,6 +435,13 @@ typedef struct trw_data_st {
     skipset_t      *existing;
     skIPTree_t     *benign;     /* holds benign sources */
     skIPTree_t     *scanners;   /* holds scanning sources */
+    /* the logs of the factors by which a successful and a failed
+     * connection change the likelihood ratio, and of the bounds at
+     * which the model decides */
+    double          log_hit;
+    double          log_miss;
+    double          log_eta0;
+    double          log_eta1;
 } trw_data_t;
 
 typedef struct scan_info_st {
@@ -288,6 +456,7 @@ typedef struct scan_info_st {
     uint8_t  proto;
     double   scan_prob;
     enum ScanModel model;
+    uint8_t  sampled;
 } scan_info_t;
 
 
@@ -297,12 +466,165 @@ typedef struct cleanup_node_st {
     pthread_t         tid;
 } cleanup_node_t;
 
-typedef struct worker_thread_data_st {
+/* the flows of a large event, compressed and possibly spilled */
+typedef struct event_chunks_st event_chunks_t;
+
+/* an event or a batch of events handed to a worker thread */
+typedef struct worker_thread_data_st worker_thread_data_t;
+
+/* the progress of the TRW test the reader runs on the event being
+ * assembled; see --trw-in-reader */
+typedef enum trw_stream_state_en {
+    TRW_STREAM_OFF = 0,         /* not run or given up; a worker tests */
+    TRW_STREAM_TESTING,
+    TRW_STREAM_DROP             /* decided; later flows are only counted */
+} trw_stream_state_t;
+
+typedef struct trw_stream_st {
+    trw_counters_t      counters;
+    uint32_t            dip_prev;
+    trw_stream_state_t  state;
+} trw_stream_t;
+
+/* an event that is being assembled by the reader */
+typedef struct event_buf_st {
+    rwscan_flow_t   *flows;
+    uint32_t         capacity;  /* number of flows 'flows' can hold */
+    uint32_t         count;     /* number of flows in 'flows' */
+    event_chunks_t  *chunks;    /* the earlier flows of a large event */
+    event_metrics_t *metrics;
+    trw_stream_t     trw;
+} event_buf_t;
+
+/*
+ *  The events a reader has formed but not yet handed to the worker
+ *  threads: the batch of small events being filled, and the events
+ *  and full batches held back so that the largest are queued first.
+ */
+typedef struct event_dispatch_st {
+    worker_thread_data_t *batch;
+    skheap_t             *held;
+} event_dispatch_t;
+
+/* builds events from input that is sorted by sip and proto */
+typedef struct event_assembler_st {
+    event_buf_t      ev;
+    event_dispatch_t disp;
+    uint32_t         last_sip;
+    uint8_t          last_proto;
+} event_assembler_t;
+
+/* an uncompressed SiLK Flow file mapped into memory */
+typedef struct mapped_file_st {
+    void            *map;
+    size_t           map_len;
+    const uint8_t   *recs;      /* the first record */
+    uint64_t         count;     /* number of records */
+    size_t           rec_len;
+    unsigned         is_ipv6 :1;
+} mapped_file_t;
+
+/* decodes the records of a stream on a separate thread */
+typedef struct decoder_st decoder_t;
+
+/* a range of records in one input file, read by a single reader */
+typedef struct input_range_st {
+    const char      *path;
+    uint64_t         start;     /* index of first record in the range */
+    uint64_t         end;       /* index one past the last record */
+    unsigned         is_split :1;
+} input_range_t;
+
+/*
+ *  The flows of an event stored one field per array, holding only the
+ *  fields read by the scan models.  Each worker thread fills one of
+ *  these from the event's flows once they are in the order a model
+ *  needs, so that the loops over the event read densely packed
+ *  values.
+ */
+typedef struct event_columns_st {
+    uint32_t         *dip;
+    uint32_t         *pkts;
+    uint32_t         *bytes;
+    uint16_t         *sport;
+    uint16_t         *dport;    /* ICMP type and code for ICMP flows */
+    uint8_t          *flags;
+    uint32_t          count;    /* number of flows */
+    uint32_t          capacity; /* number of flows the arrays can hold */
+} event_columns_t;
+
+/* fixed-memory estimates of the BLR features of a large event */
+typedef struct event_sketch_st event_sketch_t;
+
+/*
+ *  The state the metric calculations carry from one block of an
+ *  event's flows to the next.  Most events are analyzed as a single
+ *  block; the flows of an event held in an event_chunks_t are read in
+ *  blocks of RWSCAN_STREAM_BLOCK_SIZE flows.
+ */
+typedef struct metric_state_st {
+    /* when not NULL, the features are estimated by the sketches
+     * instead of being calculated exactly */
+    event_sketch_t   *sketch;
+
+    /* when set, the runs of dips of UDP and ICMP events are left to
+     * calculate_udp_dip_runs() and calculate_icmp_dip_runs() */
+    uint8_t          no_dip_runs;
+
+    /* calculate_shared_metrics() */
+    uint32_t         shared_seen;
+    uint32_t         last_dip;
+    uint32_t         last_sp;
+    uint32_t         last_dp;
+
+    /* the UDP and ICMP calculations look at each flow together with
+     * the one that follows it, so they hold back the latest flow */
+    uint32_t         seen;
+    uint32_t         held_dip;
+    uint16_t         held_dport;
+    uint32_t         dip_next;
+    uint32_t         class_c_next;
+
+    union {
+        struct {
+            sk_bitmap_t *low_dp_bitmap;
+            sk_bitmap_t *sp_bitmap;
+            uint32_t     subnet_run;
+            uint32_t     max_subnet_run;
+        } udp;
+        struct {
+            uint8_t      run;
+            uint8_t      max_run_curr;
+            uint32_t     class_c_run;
+            uint32_t     max_class_c_run;
+            uint8_t      class_c_dip_count;
+            uint8_t      max_class_c_dip_count;
+        } icmp;
+    } proto;
+} metric_state_t;
+
+/*
+ *  The work handed to a worker thread: either a single event, or a
+ *  batch of small events whose flows are packed one event after
+ *  another in 'flows'.  For a batch, 'offsets' is not NULL, 'metrics'
+ *  holds 'events' entries, and the flows of event i are those from
+ *  offsets[i] up to offsets[i+1].
+ */
+struct worker_thread_data_st {
     work_queue_node_t node;
-    rwRec            *flows;
+    rwscan_flow_t    *flows;
+    uint32_t          capacity; /* number of flows 'flows' can hold */
+    uint32_t          events;   /* number of events in a batch */
+    uint32_t         *offsets;  /* start of each event in a batch */
+    event_chunks_t   *chunks;   /* the flows of a large event, or NULL */
     event_metrics_t  *metrics;
     trw_counters_t   *counters;
-} worker_thread_data_t;
+    event_columns_t  *columns;  /* the worker thread's column buffer */
+    rwscan_flow_t    *block;    /* the worker thread's buffer for
+                                 * RWSCAN_STREAM_BLOCK_SIZE flows */
+    uint64_t          cpu_start; /* thread CPU msec when the event was
+                                  * taken; see --event-time-budget */
+};
 
 
 extern options_t         options;
@@ -318,6 +640,11 @@ extern int update_stats;
 
 /* utility functions */
 
+void
+flow_from_rwrec(
+    rwscan_flow_t      *flow,
+    const rwRec        *rwrec);
+
 void
 appSetup(
     int                 argc,
@@ -327,6 +654,12 @@ void
 appTeardown(
     void);
 
+#ifndef SKTHREAD_UNKNOWN_ID
+void
+skthread_ignore_signals(
+    void);
+#endif
+
 void *
 worker_thread(
     void               *myarg);
@@ -337,42 +670,332 @@ void
 join_threads(
     void);
 
+/* event assembly */
+int
+event_buf_begin(
+    event_buf_t        *ev,
+    uint32_t            sip,
+    uint8_t             proto,
+    uint32_t            capacity);
+rwscan_flow_t *
+event_buf_reserve(
+    event_buf_t        *ev);
 void
-print_flow(
-    const rwRec        *rwcurr);
+event_buf_commit(
+    event_buf_t        *ev);
+int
+event_buf_add(
+    event_buf_t        *ev,
+    const rwscan_flow_t *rwrec);
+int
+event_buf_dispatch(
+    event_buf_t        *ev,
+    event_dispatch_t   *disp);
+int
+event_dispatch_flush(
+    event_dispatch_t   *disp);
+void
+event_dispatch_free(
+    event_dispatch_t   *disp);
+void
+event_buf_free(
+    event_buf_t        *ev);
+void
+print_progress(
+    uint32_t            last_sip,
+    uint32_t            next_sip);
+rwscan_flow_t *
+assembler_reserve(
+    event_assembler_t  *as,
+    uint32_t            sip,
+    uint8_t             proto);
+void
+assembler_commit(
+    event_assembler_t  *as);
+int
+assembler_add(
+    event_assembler_t  *as,
+    const rwscan_flow_t *rwrec);
+int
+assembler_finish(
+    event_assembler_t  *as);
+void
+assembler_free(
+    event_assembler_t  *as);
 
-/* sort function for the TRW model */
+/* grouping of unsorted input by sip/proto */
 int
-rwrec_compare_dip(
-    const void         *a,
-    const void         *b);
+group_table_create(
+    void);
+int
+group_add_records(
+    const rwscan_flow_t *recs,
+    size_t              count);
+int
+group_dispatch_all(
+    void);
+void
+group_table_destroy(
+    void);
+
+/* external sort of unsorted input and merge of sorted input files */
+int
+sort_buffer_create(
+    void);
+int
+sort_add_records(
+    const rwscan_flow_t *recs,
+    size_t              count);
+int
+sort_dispatch_all(
+    void);
+void
+sort_buffer_destroy(
+    void);
+int
+merge_input_files(
+    void);
 
-/* sort function for the first stage of BLR model */
 int
-rwrec_compare_proto_stime(
+repo_selection_setup(
+    void);
+int
+repo_next_path(
+    char               *path,
+    size_t              path_len);
+void
+repo_selection_teardown(
+    void);
+
+event_chunks_t *
+event_chunks_create(
+    uint32_t            sip,
+    uint8_t             proto);
+int
+event_chunks_add_run(
+    event_chunks_t     *chunks,
+    rwscan_flow_t      *flows,
+    uint32_t            count);
+uint64_t
+event_chunks_count(
+    const event_chunks_t   *chunks);
+size_t
+event_chunks_memory(
+    const event_chunks_t   *chunks);
+int
+event_chunks_rewind(
+    event_chunks_t     *chunks);
+int64_t
+event_chunks_read(
+    event_chunks_t     *chunks,
+    rwscan_flow_t      *flows,
+    uint32_t            max_count);
+void
+event_chunks_destroy(
+    event_chunks_t    **chunks);
+void
+event_chunks_teardown(
+    void);
+
+event_sketch_t *
+event_sketch_create(
+    uint8_t             proto);
+void
+event_sketch_add(
+    event_sketch_t         *sketch,
+    const event_columns_t  *cols,
+    event_metrics_t        *metrics);
+void
+event_sketch_finish(
+    event_sketch_t     *sketch,
+    event_metrics_t    *metrics);
+void
+event_sketch_destroy(
+    event_sketch_t    **sketch);
+
+int
+decoder_create(
+    decoder_t         **dec,
+    skstream_t         *stream,
+    uint32_t            batches);
+int
+decoder_read_record(
+    decoder_t          *dec,
+    rwRec              *rwrec);
+void
+decoder_destroy(
+    decoder_t         **dec);
+
+int
+is_regular_file(
+    const char         *path);
+int
+mapped_file_open(
+    mapped_file_t      *mf,
+    const char         *path);
+void
+mapped_file_advise(
+    const mapped_file_t    *mf,
+    uint64_t                start,
+    uint64_t                end);
+int
+mapped_file_get_key(
+    const mapped_file_t    *mf,
+    uint64_t                idx,
+    uint32_t               *sip,
+    uint8_t                *proto);
+void
+mapped_file_decode(
+    const mapped_file_t    *mf,
+    uint64_t                idx,
+    rwscan_flow_t          *flow);
+void
+mapped_file_close(
+    mapped_file_t      *mf);
+
+void
+parallel_sort(
+    rwscan_flow_t      *flows,
+    uint32_t            count,
+    flow_order_t        order,
+    uint32_t            threads);
+int
+parallel_blr_metrics(
+    worker_thread_data_t   *work,
+    uint32_t                threads);
+
+int
+pool_setup(
+    void);
+void
+pool_teardown(
+    void);
+uint32_t
+pool_flows_capacity(
+    uint32_t            count);
+rwscan_flow_t *
+pool_flows_get(
+    uint32_t            capacity);
+void
+pool_flows_put(
+    rwscan_flow_t      *flows,
+    uint32_t            capacity);
+rwscan_flow_t *
+pool_flows_grow(
+    rwscan_flow_t      *flows,
+    uint32_t            count,
+    uint32_t           *capacity);
+event_metrics_t *
+pool_metrics_get(
+    void);
+void
+pool_metrics_put(
+    event_metrics_t    *metrics);
+worker_thread_data_t *
+pool_work_get(
+    void);
+void
+pool_work_put(
+    worker_thread_data_t   *work);
+worker_thread_data_t *
+pool_batch_get(
+    void);
+void
+pool_batch_put(
+    worker_thread_data_t   *batch);
+
+int
+prefetch_start(
+    const input_range_t    *ranges,
+    size_t                  count);
+void
+prefetch_advance(
+    size_t              reader_next);
+void
+prefetch_stop(
+    void);
+
+void
+print_flow(
+    const rwscan_flow_t *rwcurr);
+
+/* sort function for the external sort of unsorted input and the
+ * merge of sorted inputs; a total order on the fields of a flow */
+int
+flow_compare_sip_proto_dip(
     const void         *a,
     const void         *b);
 
 /* sort function for the second stage of BLR model */
 int
-rwrec_compare_dip_sport(
+flow_compare_dip_sport(
     const void         *a,
     const void         *b);
 
+void
+flow_sort(
+    rwscan_flow_t      *flows,
+    uint32_t            count,
+    flow_order_t        order);
+flow_compare_fn_t
+flow_order_compare(
+    flow_order_t        order);
+uint32_t *
+flow_group(
+    const rwscan_flow_t    *flows,
+    uint32_t                count,
+    flow_order_t            order);
+
+
+int
+event_columns_reserve(
+    event_columns_t        *cols,
+    uint32_t                count);
+void
+event_columns_fill(
+    event_columns_t        *cols,
+    uint32_t                first,
+    const rwscan_flow_t    *flows,
+    uint32_t                count);
+int
+event_columns_load(
+    event_columns_t        *cols,
+    const rwscan_flow_t    *flows,
+    uint32_t                count);
+void
+event_columns_view(
+    event_columns_t        *view,
+    const event_columns_t  *cols,
+    uint32_t                first,
+    uint32_t                count);
+int
+event_columns_gather(
+    event_columns_t        *cols,
+    const rwscan_flow_t    *flows,
+    const uint32_t         *index,
+    uint32_t                count);
+void
+event_columns_free(
+    event_columns_t    *cols);
+
+int
+metric_state_init(
+    metric_state_t     *state,
+    uint8_t             proto);
+void
+metric_state_free(
+    metric_state_t     *state,
+    uint8_t             proto);
 
 void
 calculate_shared_metrics(
-    rwRec              *event_flows,
-    event_metrics_t    *metrics);
+    metric_state_t         *state,
+    const event_columns_t  *cols,
+    event_metrics_t        *metrics);
 
 
 /* helper functions for TCP events */
 void
-add_count(
-    uint32_t           *counts,
-    uint32_t            value,
-    uint32_t            max);
-void
 analyze_tcp_event(
     event_metrics_t    *metrics);
 top_ten_t
@@ -382,13 +1005,19 @@ build_top_ten(
 
 void
 increment_tcp_counters(
-    rwRec              *rwrec,
-    event_metrics_t    *metrics);
+    const event_columns_t  *cols,
+    event_metrics_t        *metrics);
 
 void
 calculate_tcp_metrics(
-    rwRec              *event_flows,
-    event_metrics_t    *metrics);
+    metric_state_t         *state,
+    const event_columns_t  *cols,
+    event_metrics_t        *metrics);
+
+void
+finish_tcp_metrics(
+    metric_state_t         *state,
+    event_metrics_t        *metrics);
 
 void
 calculate_tcp_scan_probability(
@@ -398,13 +1027,32 @@ calculate_tcp_scan_probability(
 /* helper functions for UDP events */
 void
 increment_udp_counters(
-    rwRec              *rwrec,
-    event_metrics_t    *metrics);
+    const event_columns_t  *cols,
+    event_metrics_t        *metrics);
 
 void
 calculate_udp_metrics(
-    rwRec              *event_flows,
-    event_metrics_t    *metrics);
+    metric_state_t         *state,
+    const event_columns_t  *cols,
+    event_metrics_t        *metrics);
+
+void
+calculate_udp_dip_runs(
+    metric_state_t         *state,
+    const event_columns_t  *cols,
+    event_metrics_t        *metrics);
+
+void
+end_udp_partition(
+    metric_state_t     *state,
+    event_metrics_t    *metrics,
+    uint32_t            dip_next,
+    uint16_t            dport_next);
+
+void
+finish_udp_metrics(
+    metric_state_t         *state,
+    event_metrics_t        *metrics);
 
 void
 calculate_udp_scan_probability(
@@ -414,13 +1062,25 @@ calculate_udp_scan_probability(
 /* helper functions for ICMP events */
 void
 increment_icmp_counters(
-    rwRec              *rwrec,
-    event_metrics_t    *metrics);
+    const event_columns_t  *cols,
+    event_metrics_t        *metrics);
 
 void
 calculate_icmp_metrics(
-    rwRec              *event_flows,
-    event_metrics_t    *metrics);
+    metric_state_t         *state,
+    const event_columns_t  *cols,
+    event_metrics_t        *metrics);
+
+void
+calculate_icmp_dip_runs(
+    metric_state_t         *state,
+    const event_columns_t  *cols,
+    event_metrics_t        *metrics);
+
+void
+finish_icmp_metrics(
+    metric_state_t         *state,
+    event_metrics_t        *metrics);
 
 void
 calculate_icmp_scan_probability(
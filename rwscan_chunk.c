@@ -0,0 +1,741 @@
+/*
+** Copyright (C) 2006-2019 by Carnegie Mellon University.
+**
+** @OPENSOURCE_LICENSE_START@
+** See license information in ../../LICENSE.txt
+** @OPENSOURCE_LICENSE_END@
+*/
+
+/*
+ *  rwscan_chunk.c
+ *
+ *    Compressed, and optionally spilled, storage for very large
+ *    events.
+ *
+ *    When --compress-events is given, the reader does not keep every
+ *    flow of a large event in memory.  Each time the event's flow
+ *    buffer holds that many flows, the flows are sorted by dip and
+ *    sport and encoded as a run: each field is written as a variable
+ *    length integer, the dip as the difference from the previous dip
+ *    and the start time as the (zigzag encoded) difference from the
+ *    previous start time.  The sip and protocol are the same for
+ *    every flow of an event and are not stored.
+ *
+ *    When --spill-events is given and an event holds more than that
+ *    many flows, its runs are moved to a temporary file, and later
+ *    runs are appended to that file.
+ *
+ *    The worker thread reads the flows back by merging the runs, so
+ *    it sees the event's flows in dip and sport order while holding
+ *    only a small buffer for each run.
+ */
+
+#include <silk/silk.h>
+
+RCSIDENT("$SiLK: rwscan_chunk.c 945cf5167607 2019-01-07 18:54:17Z mthomas $");
+
+#include <silk/skheap.h>
+#include <silk/sktempfile.h>
+#include "rwscan.h"
+
+
+/* LOCAL DEFINES AND TYPEDEFS */
+
+/* most bytes needed to encode one flow: a 32 bit value needs at most
+ * 5 bytes and a 16 bit value at most 3 */
+#define CHUNK_MAX_FLOW_BYTES  (5 * 5 + 3 * 3 + 1)
+
+/* size of the buffer used to read a spilled run */
+#define CHUNK_READ_SIZE  (1 << 16)
+
+/* one encoded run of flows sorted by dip and sport */
+typedef struct chunk_run_st {
+    uint8_t        *data;       /* the encoded run, or NULL if spilled */
+    uint64_t        offset;     /* offset of the run in the spill file */
+    size_t          len;        /* number of encoded bytes */
+    uint32_t        count;      /* number of flows */
+} chunk_run_t;
+
+/* the position of the merge in one run */
+typedef struct chunk_cursor_st {
+    const chunk_run_t  *run;
+    const uint8_t      *pos;        /* next byte to decode */
+    const uint8_t      *end;        /* end of the bytes available */
+    uint8_t            *buf;        /* read buffer for a spilled run */
+    uint64_t            file_pos;   /* next offset to read */
+    uint64_t            file_end;   /* offset of the end of the run */
+    uint32_t            remaining;  /* flows not yet decoded */
+    rwscan_flow_t       flow;       /* the most recently decoded flow */
+} chunk_cursor_t;
+
+struct event_chunks_st {
+    chunk_run_t        *runs;
+    size_t              runs_count;
+    size_t              runs_max;
+    uint64_t            flow_count; /* number of flows in all runs */
+    size_t              mem_bytes;  /* bytes of the runs held in memory */
+    uint32_t            sip;
+    uint8_t             proto;
+
+    /* the spill file; spill_idx is -1 until the event is spilled */
+    int                 spill_idx;
+    skstream_t         *spill;      /* open while runs are written */
+    uint64_t            spill_len;
+    int                 spill_fd;   /* open while runs are read */
+
+    /* the merge */
+    chunk_cursor_t     *cursors;
+    skheap_t           *heap;
+};
+
+
+/* LOCAL VARIABLE DEFINITIONS */
+
+/* temporary files holding spilled events */
+static sk_tempfilectx_t *chunk_tmpctx = NULL;
+
+/* protects chunk_tmpctx, which all threads share */
+static pthread_mutex_t chunk_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* FUNCTION DEFINITIONS */
+
+/*
+ *  p = chunk_put_varint(p, value);
+ *
+ *    Encode 'value' at 'p' seven bits per byte, least significant
+ *    first, setting the high bit of every byte except the last.
+ *    Return the byte following the encoded value.
+ */
+static uint8_t *
+chunk_put_varint(
+    uint8_t            *p,
+    uint32_t            value)
+{
+    while (value >= 0x80) {
+        *p++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (uint8_t)value;
+    return p;
+}
+
+
+/*
+ *  p = chunk_get_varint(p, &value);
+ *
+ *    Decode the value written by chunk_put_varint() at 'p' into
+ *    'value'.  Return the byte following the encoded value.
+ */
+static const uint8_t *
+chunk_get_varint(
+    const uint8_t      *p,
+    uint32_t           *value)
+{
+    uint32_t v = 0;
+    int shift = 0;
+
+    while (*p & 0x80) {
+        v |= (uint32_t)(*p++ & 0x7F) << shift;
+        shift += 7;
+    }
+    *value = v | ((uint32_t)*p++ << shift);
+    return p;
+}
+
+
+/*
+ *  len = chunk_encode(flows, count, buf);
+ *
+ *    Encode the 'count' flows in 'flows', which must be sorted by dip,
+ *    into 'buf', which must hold CHUNK_MAX_FLOW_BYTES for each flow.
+ *    Return the number of bytes written.
+ */
+static size_t
+chunk_encode(
+    const rwscan_flow_t    *flows,
+    uint32_t                count,
+    uint8_t                *buf)
+{
+    uint8_t *p = buf;
+    uint32_t prev_dip = 0;
+    uint32_t prev_stime = 0;
+    int32_t  delta;
+    uint32_t i;
+
+    for (i = 0; i < count; ++i) {
+        p = chunk_put_varint(p, flows[i].dip - prev_dip);
+        delta = (int32_t)(flows[i].stime - prev_stime);
+        p = chunk_put_varint(p, (((uint32_t)delta << 1)
+                                 ^ (uint32_t)(delta >> 31)));
+        p = chunk_put_varint(p, flows[i].stime_msec);
+        p = chunk_put_varint(p, flows[i].elapsed);
+        p = chunk_put_varint(p, flows[i].pkts);
+        p = chunk_put_varint(p, flows[i].bytes);
+        p = chunk_put_varint(p, flows[i].sport);
+        p = chunk_put_varint(p, flows[i].dport);
+        *p++ = flows[i].flags;
+        prev_dip = flows[i].dip;
+        prev_stime = flows[i].stime;
+    }
+    return (p - buf);
+}
+
+
+/*
+ *  p = chunk_decode(chunks, p, prev, flow);
+ *
+ *    Decode the flow at 'p' into 'flow'.  'prev' is the previous flow
+ *    of the run, whose dip and stime must be 0 for the first flow.
+ *    'flow' and 'prev' may be the same.  Return the byte following
+ *    the flow.
+ */
+static const uint8_t *
+chunk_decode(
+    const event_chunks_t   *chunks,
+    const uint8_t          *p,
+    const rwscan_flow_t    *prev,
+    rwscan_flow_t          *flow)
+{
+    uint32_t v;
+
+    p = chunk_get_varint(p, &v);
+    flow->dip = prev->dip + v;
+    p = chunk_get_varint(p, &v);
+    flow->stime = prev->stime + (uint32_t)((v >> 1) ^ (0 - (v & 1)));
+    p = chunk_get_varint(p, &v);
+    flow->stime_msec = (uint16_t)v;
+    p = chunk_get_varint(p, &flow->elapsed);
+    p = chunk_get_varint(p, &flow->pkts);
+    p = chunk_get_varint(p, &flow->bytes);
+    p = chunk_get_varint(p, &v);
+    flow->sport = (uint16_t)v;
+    p = chunk_get_varint(p, &v);
+    flow->dport = (uint16_t)v;
+    flow->flags = *p++;
+    flow->sip = chunks->sip;
+    flow->proto = chunks->proto;
+    return p;
+}
+
+
+/*
+ *  status = chunk_spill_write(chunks, buf, len);
+ *
+ *    Append the 'len' bytes in 'buf' to the spill file of 'chunks',
+ *    creating the file if needed.  Return 0 on success or -1 on
+ *    failure.
+ */
+static int
+chunk_spill_write(
+    event_chunks_t     *chunks,
+    const uint8_t      *buf,
+    size_t              len)
+{
+    ssize_t rv;
+
+    if (chunks->spill == NULL) {
+        pthread_mutex_lock(&chunk_mutex);
+        if (chunk_tmpctx == NULL
+            && skTempFileInitialize(&chunk_tmpctx, options.temp_directory,
+                                    NULL, &skAppPrintErr))
+        {
+            pthread_mutex_unlock(&chunk_mutex);
+            skAppPrintErr("Unable to initialize temporary files");
+            return -1;
+        }
+        chunks->spill = skTempFileCreateStream(chunk_tmpctx,
+                                               &chunks->spill_idx);
+        pthread_mutex_unlock(&chunk_mutex);
+        if (chunks->spill == NULL) {
+            skAppPrintSyserror("Error creating new temporary file");
+            chunks->spill_idx = -1;
+            return -1;
+        }
+    }
+
+    rv = skStreamWrite(chunks->spill, buf, len);
+    if (rv != (ssize_t)len) {
+        skStreamPrintLastErr(chunks->spill, rv, &skAppPrintErr);
+        return -1;
+    }
+    chunks->spill_len += len;
+    return 0;
+}
+
+
+/*
+ *  status = chunk_spill_all(chunks);
+ *
+ *    Move the runs of 'chunks' that are in memory to its spill file.
+ *    Return 0 on success or -1 on failure.
+ */
+static int
+chunk_spill_all(
+    event_chunks_t     *chunks)
+{
+    chunk_run_t *run;
+    size_t i;
+
+    for (i = 0, run = chunks->runs; i < chunks->runs_count; ++i, ++run) {
+        if (run->data) {
+            run->offset = chunks->spill_len;
+            if (chunk_spill_write(chunks, run->data, run->len)) {
+                return -1;
+            }
+            free(run->data);
+            run->data = NULL;
+            chunks->mem_bytes -= run->len;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ *  chunks = event_chunks_create(sip, proto);
+ *
+ *    Create an empty compressed store for the flows of the event for
+ *    'sip' and 'proto'.  Return NULL on allocation failure.
+ */
+event_chunks_t *
+event_chunks_create(
+    uint32_t            sip,
+    uint8_t             proto)
+{
+    event_chunks_t *chunks;
+
+    chunks = (event_chunks_t*)calloc(1, sizeof(event_chunks_t));
+    if (chunks == NULL) {
+        return NULL;
+    }
+    chunks->sip = sip;
+    chunks->proto = proto;
+    chunks->spill_idx = -1;
+    chunks->spill_fd = -1;
+    return chunks;
+}
+
+
+/*
+ *  status = event_chunks_add_run(chunks, flows, count);
+ *
+ *    Sort the 'count' flows in 'flows' by dip and sport and add them
+ *    to 'chunks' as a new run, spilling the event when it holds more
+ *    than --spill-events flows.  The flows of unsorted input are
+ *    sorted on every field; see event_order_flows().  Return 0 on
+ *    success or -1 on failure.
+ */
+int
+event_chunks_add_run(
+    event_chunks_t     *chunks,
+    rwscan_flow_t      *flows,
+    uint32_t            count)
+{
+    chunk_run_t *run;
+    uint8_t *buf;
+    size_t len;
+
+    if (count == 0) {
+        return 0;
+    }
+    if (chunks->runs_count == chunks->runs_max) {
+        chunk_run_t *old_runs = chunks->runs;
+        size_t new_max = (chunks->runs_max ? 2 * chunks->runs_max : 16);
+
+        chunks->runs = (chunk_run_t*)realloc(chunks->runs,
+                                             new_max * sizeof(chunk_run_t));
+        if (chunks->runs == NULL) {
+            skAppPrintOutOfMemory("event run list");
+            chunks->runs = old_runs;
+            return -1;
+        }
+        chunks->runs_max = new_max;
+    }
+
+    flow_sort(flows, count, (options.unsorted_input
+                             ? FLOW_ORDER_FULL : FLOW_ORDER_DIP_SPORT));
+
+    buf = (uint8_t*)malloc((size_t)count * CHUNK_MAX_FLOW_BYTES);
+    if (buf == NULL) {
+        skAppPrintOutOfMemory("event run");
+        return -1;
+    }
+    len = chunk_encode(flows, count, buf);
+
+    run = &chunks->runs[chunks->runs_count];
+    memset(run, 0, sizeof(chunk_run_t));
+    run->len = len;
+    run->count = count;
+    chunks->flow_count += count;
+
+    if (options.spill_events && chunks->flow_count > options.spill_events) {
+        if (chunk_spill_all(chunks)) {
+            free(buf);
+            return -1;
+        }
+        run->offset = chunks->spill_len;
+        if (chunk_spill_write(chunks, buf, len)) {
+            free(buf);
+            return -1;
+        }
+        free(buf);
+    } else {
+        run->data = (uint8_t*)realloc(buf, len);
+        if (run->data == NULL) {
+            run->data = buf;
+        }
+        chunks->mem_bytes += len;
+    }
+    ++chunks->runs_count;
+
+    return 0;
+}
+
+
+/*
+ *  count = event_chunks_count(chunks);
+ *
+ *    Return the number of flows held by 'chunks'.
+ */
+uint64_t
+event_chunks_count(
+    const event_chunks_t   *chunks)
+{
+    return chunks->flow_count;
+}
+
+
+/*
+ *  bytes = event_chunks_memory(chunks);
+ *
+ *    Return the number of bytes of encoded flows that 'chunks' holds
+ *    in memory.
+ */
+size_t
+event_chunks_memory(
+    const event_chunks_t   *chunks)
+{
+    return chunks->mem_bytes;
+}
+
+
+/*
+ *  status = chunk_cursor_fill(chunks, cursor);
+ *
+ *    Make sure the buffer of the spilled run of 'cursor' holds a whole
+ *    flow, reading more of the spill file of 'chunks' if needed.
+ *    Return 0 on success or -1 on a read error.
+ */
+static int
+chunk_cursor_fill(
+    const event_chunks_t   *chunks,
+    chunk_cursor_t         *cursor)
+{
+    size_t have;
+    size_t want;
+    ssize_t got;
+
+    have = cursor->end - cursor->pos;
+    if (cursor->run->data || have >= CHUNK_MAX_FLOW_BYTES
+        || cursor->file_pos == cursor->file_end)
+    {
+        return 0;
+    }
+
+    memmove(cursor->buf, cursor->pos, have);
+    want = CHUNK_READ_SIZE - have;
+    if (want > cursor->file_end - cursor->file_pos) {
+        want = cursor->file_end - cursor->file_pos;
+    }
+    while (want > 0) {
+        got = pread(chunks->spill_fd, cursor->buf + have, want,
+                    (off_t)cursor->file_pos);
+        if (got <= 0) {
+            if (got == -1 && errno == EINTR) {
+                continue;
+            }
+            skAppPrintSyserror("Error reading temporary file %s",
+                               skTempFileGetName(chunk_tmpctx,
+                                                 chunks->spill_idx));
+            return -1;
+        }
+        have += got;
+        want -= got;
+        cursor->file_pos += got;
+    }
+    cursor->pos = cursor->buf;
+    cursor->end = cursor->buf + have;
+    return 0;
+}
+
+
+/*
+ *  status = chunk_cursor_next(chunks, cursor);
+ *
+ *    Decode the next flow of the run of 'cursor' into its 'flow'
+ *    member.  Return 0 on success, 1 when the run has no more flows,
+ *    or -1 on a read error.
+ */
+static int
+chunk_cursor_next(
+    const event_chunks_t   *chunks,
+    chunk_cursor_t         *cursor)
+{
+    if (cursor->remaining == 0) {
+        return 1;
+    }
+    if (chunk_cursor_fill(chunks, cursor)) {
+        return -1;
+    }
+    cursor->pos = chunk_decode(chunks, cursor->pos, &cursor->flow,
+                               &cursor->flow);
+    --cursor->remaining;
+    return 0;
+}
+
+
+/*
+ *  cmp = chunk_merge_compare(node1, node2, cursors);
+ *
+ *    Compare the current flows of the cursors whose indexes are
+ *    'node1' and 'node2'.  The arguments are reversed since the heap
+ *    keeps the largest node at the top and the merge needs the
+ *    smallest.  Ties go to the cursor with the lower run index.
+ */
+static int
+chunk_merge_compare(
+    const skheapnode_t  node1,
+    const skheapnode_t  node2,
+    void               *v_cursors)
+{
+    chunk_cursor_t *cursors = (chunk_cursor_t*)v_cursors;
+    uint32_t i1 = *(uint32_t*)node1;
+    uint32_t i2 = *(uint32_t*)node2;
+    int cmp;
+
+    if (options.unsorted_input) {
+        cmp = flow_compare_sip_proto_dip(&cursors[i2].flow,
+                                         &cursors[i1].flow);
+    } else {
+        cmp = flow_compare_dip_sport(&cursors[i2].flow, &cursors[i1].flow);
+    }
+    if (cmp == 0 && i1 != i2) {
+        /* runs hold consecutive stretches of the input; take ties
+         * from the earlier run so the merge keeps input order */
+        cmp = (i1 < i2) ? 1 : -1;
+    }
+    return cmp;
+}
+
+
+/*
+ *  chunk_merge_end(chunks);
+ *
+ *    Release the cursors and heap of the merge of 'chunks'.
+ */
+static void
+chunk_merge_end(
+    event_chunks_t     *chunks)
+{
+    size_t i;
+
+    if (chunks->cursors) {
+        for (i = 0; i < chunks->runs_count; ++i) {
+            free(chunks->cursors[i].buf);
+        }
+        free(chunks->cursors);
+        chunks->cursors = NULL;
+    }
+    if (chunks->heap) {
+        skHeapFree(chunks->heap);
+        chunks->heap = NULL;
+    }
+}
+
+
+/*
+ *  status = event_chunks_rewind(chunks);
+ *
+ *    Prepare to read the flows of 'chunks' from the beginning with
+ *    event_chunks_read().  The first call finishes writing the spill
+ *    file, after which no more runs may be added.  Return 0 on success
+ *    or -1 on failure.
+ */
+int
+event_chunks_rewind(
+    event_chunks_t     *chunks)
+{
+    chunk_cursor_t *cursor;
+    uint32_t i;
+    int rv;
+
+    chunk_merge_end(chunks);
+
+    if (chunks->spill) {
+        rv = skStreamClose(chunks->spill);
+        if (rv) {
+            skStreamPrintLastErr(chunks->spill, rv, &skAppPrintErr);
+        }
+        skStreamDestroy(&chunks->spill);
+        if (rv) {
+            return -1;
+        }
+    }
+    if (chunks->spill_idx != -1 && chunks->spill_fd == -1) {
+        chunks->spill_fd = open(skTempFileGetName(chunk_tmpctx,
+                                                  chunks->spill_idx),
+                                O_RDONLY);
+        if (chunks->spill_fd == -1) {
+            skAppPrintSyserror("Unable to open temporary file %s",
+                               skTempFileGetName(chunk_tmpctx,
+                                                 chunks->spill_idx));
+            return -1;
+        }
+    }
+
+    chunks->cursors = (chunk_cursor_t*)calloc(chunks->runs_count,
+                                              sizeof(chunk_cursor_t));
+    chunks->heap = skHeapCreate2(&chunk_merge_compare, chunks->runs_count,
+                                 sizeof(uint32_t), NULL, chunks->cursors);
+    if (chunks->cursors == NULL || chunks->heap == NULL) {
+        skAppPrintOutOfMemory("event run merge");
+        chunk_merge_end(chunks);
+        return -1;
+    }
+
+    for (i = 0; i < chunks->runs_count; ++i) {
+        cursor = &chunks->cursors[i];
+        cursor->run = &chunks->runs[i];
+        cursor->remaining = cursor->run->count;
+        if (cursor->run->data) {
+            cursor->pos = cursor->run->data;
+            cursor->end = cursor->run->data + cursor->run->len;
+        } else {
+            cursor->buf = (uint8_t*)malloc(CHUNK_READ_SIZE);
+            if (cursor->buf == NULL) {
+                skAppPrintOutOfMemory("event run buffer");
+                chunk_merge_end(chunks);
+                return -1;
+            }
+            cursor->pos = cursor->end = cursor->buf;
+            cursor->file_pos = cursor->run->offset;
+            cursor->file_end = cursor->run->offset + cursor->run->len;
+        }
+        rv = chunk_cursor_next(chunks, cursor);
+        if (rv == -1) {
+            chunk_merge_end(chunks);
+            return -1;
+        }
+        if (rv == 0) {
+            skHeapInsert(chunks->heap, &i);
+        }
+    }
+    return 0;
+}
+
+
+/*
+ *  count = event_chunks_read(chunks, flows, max_count);
+ *
+ *    Fill 'flows' with up to 'max_count' of the next flows of
+ *    'chunks', in dip and sport order.  Return the number of flows,
+ *    0 when all the flows have been read, or -1 on a read error.
+ */
+int64_t
+event_chunks_read(
+    event_chunks_t     *chunks,
+    rwscan_flow_t      *flows,
+    uint32_t            max_count)
+{
+    skheapnode_t top_node;
+    chunk_cursor_t *cursor;
+    uint32_t idx;
+    uint32_t count = 0;
+    int rv;
+
+    if (chunks->heap == NULL) {
+        return 0;
+    }
+    while (count < max_count
+           && skHeapPeekTop(chunks->heap, &top_node) == SKHEAP_OK)
+    {
+        idx = *(uint32_t*)top_node;
+        cursor = &chunks->cursors[idx];
+        memcpy(&flows[count++], &cursor->flow, sizeof(rwscan_flow_t));
+        rv = chunk_cursor_next(chunks, cursor);
+        if (rv == -1) {
+            return -1;
+        }
+        if (rv == 1) {
+            skHeapExtractTop(chunks->heap, NULL);
+        } else {
+            skHeapReplaceTop(chunks->heap, &idx, NULL);
+        }
+    }
+    return count;
+}
+
+
+/*
+ *  event_chunks_destroy(&chunks);
+ *
+ *    Free 'chunks' and remove its spill file.  Does nothing if
+ *    'chunks' is NULL.
+ */
+void
+event_chunks_destroy(
+    event_chunks_t    **chunks)
+{
+    event_chunks_t *c;
+    size_t i;
+
+    if (chunks == NULL || *chunks == NULL) {
+        return;
+    }
+    c = *chunks;
+    *chunks = NULL;
+
+    chunk_merge_end(c);
+    for (i = 0; i < c->runs_count; ++i) {
+        free(c->runs[i].data);
+    }
+    free(c->runs);
+    if (c->spill) {
+        skStreamDestroy(&c->spill);
+    }
+    if (c->spill_fd != -1) {
+        close(c->spill_fd);
+    }
+    if (c->spill_idx != -1) {
+        pthread_mutex_lock(&chunk_mutex);
+        skTempFileRemove(chunk_tmpctx, c->spill_idx);
+        pthread_mutex_unlock(&chunk_mutex);
+    }
+    free(c);
+}
+
+
+/*
+ *  event_chunks_teardown();
+ *
+ *    Remove the temporary directory used for spilled events.  Must be
+ *    called after every event has been destroyed.
+ */
+void
+event_chunks_teardown(
+    void)
+{
+    if (chunk_tmpctx) {
+        skTempFileTeardown(&chunk_tmpctx);
+    }
+}
+
+
+/*
+** Local Variables:
+** mode:c
+** indent-tabs-mode:nil
+** c-basic-offset:4
+** End:
+*/
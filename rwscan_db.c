@@ -25,9 +25,35 @@ static field_def_t field_defs[] = {
     {RWSCAN_FIELD_BYTES,     "bytes",      10},
     {RWSCAN_FIELD_MODEL,     "scan_model", 12},
     {RWSCAN_FIELD_SCAN_PROB, "scan_prob",  10},
+    {RWSCAN_FIELD_SAMPLED,   "sampled",     7},
     {(field_id_t)0,          0,             0}
 };
 
+
+/*
+ *  is_hidden = field_is_hidden(id, model_fields);
+ *
+ *    Return true if the field 'id' is not printed.  The model fields
+ *    are printed only when 'model_fields' is set, and the sampled
+ *    field only when an event analysis budget is also given.
+ */
+static int
+field_is_hidden(
+    field_id_t          id,
+    uint8_t             model_fields)
+{
+    switch (id) {
+      case RWSCAN_FIELD_MODEL:
+      case RWSCAN_FIELD_SCAN_PROB:
+        return !model_fields;
+      case RWSCAN_FIELD_SAMPLED:
+        return (!model_fields
+                || (options.budget_flows == 0 && options.budget_msec == 0));
+      default:
+        return 0;
+    }
+}
+
 int
 write_scan_header(
     FILE               *out,
@@ -41,10 +67,7 @@ write_scan_header(
     for (i = 0; field_defs[i].id != 0; ++i) {
         assert(i < RWSCAN_MAX_FIELD_DEFS);
         width = (no_columns) ? 0 : (field_defs[i].width);
-        if ((field_defs[i].id == RWSCAN_FIELD_MODEL
-             || field_defs[i].id == RWSCAN_FIELD_SCAN_PROB)
-            && (!model_fields))
-        {
+        if (field_is_hidden(field_defs[i].id, model_fields)) {
             continue;
         }
         if (i != 0) {
@@ -78,10 +101,7 @@ write_scan_record(
 
     for (i = 0; field_defs[i].id != 0; ++i) {
         assert(i < RWSCAN_MAX_FIELD_DEFS);
-        if ((field_defs[i].id == RWSCAN_FIELD_MODEL
-             || field_defs[i].id == RWSCAN_FIELD_SCAN_PROB)
-            && (!model_fields))
-        {
+        if (field_is_hidden(field_defs[i].id, model_fields)) {
             continue;
         }
         if (i != 0) {
@@ -128,6 +148,9 @@ write_scan_record(
                 fprintf(out, "%*f", width, rec->scan_prob);
             }
             break;
+          case RWSCAN_FIELD_SAMPLED:
+            fprintf(out, "%*u", width, rec->sampled);
+            break;
           default:
             skAbortBadCase(field_defs[i].id); /* NOTREACHED */
         }
@@ -0,0 +1,258 @@
+/*
+** Copyright (C) 2006-2019 by Carnegie Mellon University.
+**
+** @OPENSOURCE_LICENSE_START@
+** See license information in ../../LICENSE.txt
+** @OPENSOURCE_LICENSE_END@
+*/
+
+/*
+ *  rwscan_decode.c
+ *
+ *    Decode input records on a thread separate from event assembly.
+ *
+ *    When --decode-ahead is given, each input stream is read by a
+ *    decoder thread, which decompresses and decodes the records into
+ *    a ring of record batches.  The reader takes the batches in order
+ *    and assembles events from them while the decoder fills the next
+ *    batches, so decompression overlaps with assembly instead of
+ *    running on the same thread.
+ */
+
+#include <silk/silk.h>
+
+RCSIDENT("$SiLK: rwscan_decode.c 945cf5167607 2019-01-07 18:54:17Z mthomas $");
+
+#include "rwscan.h"
+
+
+/* LOCAL DEFINES AND TYPEDEFS */
+
+/* a batch of decoded records */
+typedef struct decoder_batch_st {
+    rwRec          *recs;
+    size_t          count;
+    /* the value skStreamReadRecord() returned that ended the batch,
+     * or SKSTREAM_OK when the batch is full */
+    int             rv;
+} decoder_batch_t;
+
+struct decoder_st {
+    skstream_t         *stream;
+    decoder_batch_t    *batches;
+    uint32_t            batches_count;
+    /* number of batches decoded and not yet released by the reader */
+    uint32_t            full;
+    /* batch the decoder fills next and batch the reader takes next */
+    uint32_t            fill_pos;
+    uint32_t            take_pos;
+    /* position of the next record in the batch the reader holds */
+    decoder_batch_t    *current;
+    size_t              current_pos;
+    unsigned            stopping :1;
+    unsigned            holding  :1;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;
+    pthread_t           tid;
+};
+
+
+/* FUNCTION DEFINITIONS */
+
+/*  THREAD ENTRY POINT  */
+static void *
+decoder_thread(
+    void               *myarg)
+{
+    decoder_t *dec = (decoder_t*)myarg;
+    decoder_batch_t *batch;
+    int rv = SKSTREAM_OK;
+
+    /* ignore all signals */
+    skthread_ignore_signals();
+
+    while (rv == SKSTREAM_OK) {
+        pthread_mutex_lock(&dec->mutex);
+        while (dec->full == dec->batches_count && !dec->stopping) {
+            pthread_cond_wait(&dec->cond, &dec->mutex);
+        }
+        if (dec->stopping) {
+            pthread_mutex_unlock(&dec->mutex);
+            break;
+        }
+        batch = &dec->batches[dec->fill_pos];
+        pthread_mutex_unlock(&dec->mutex);
+
+        batch->count = 0;
+        while (batch->count < RWSCAN_READER_BATCH_SIZE
+               && ((rv = skStreamReadRecord(dec->stream,
+                                            &batch->recs[batch->count]))
+                   == SKSTREAM_OK))
+        {
+            ++batch->count;
+        }
+        batch->rv = rv;
+
+        pthread_mutex_lock(&dec->mutex);
+        dec->fill_pos = (dec->fill_pos + 1) % dec->batches_count;
+        ++dec->full;
+        pthread_cond_broadcast(&dec->cond);
+        pthread_mutex_unlock(&dec->mutex);
+    }
+
+    return NULL;
+}
+
+
+/*
+ *  status = decoder_create(&dec, stream, batches);
+ *
+ *    Create a decoder that reads 'stream' on its own thread, keeping
+ *    as many as 'batches' batches of records decoded ahead of the
+ *    caller.  The caller must not use 'stream' until the decoder is
+ *    destroyed.  Return 0 on success or -1 on failure.
+ */
+int
+decoder_create(
+    decoder_t         **dec_out,
+    skstream_t         *stream,
+    uint32_t            batches)
+{
+    decoder_t *dec;
+    uint32_t i;
+
+    dec = (decoder_t*)calloc(1, sizeof(decoder_t));
+    if (dec == NULL) {
+        skAppPrintOutOfMemory("decoder");
+        return -1;
+    }
+    dec->stream = stream;
+    dec->batches_count = batches;
+    dec->batches = (decoder_batch_t*)calloc(batches, sizeof(decoder_batch_t));
+    if (dec->batches == NULL) {
+        skAppPrintOutOfMemory("decoder batches");
+        free(dec);
+        return -1;
+    }
+    for (i = 0; i < batches; ++i) {
+        dec->batches[i].recs
+            = (rwRec*)malloc(RWSCAN_READER_BATCH_SIZE * sizeof(rwRec));
+        if (dec->batches[i].recs == NULL) {
+            skAppPrintOutOfMemory("decoder batches");
+            goto ERROR;
+        }
+    }
+    pthread_mutex_init(&dec->mutex, NULL);
+    pthread_cond_init(&dec->cond, NULL);
+
+    if (pthread_create(&dec->tid, NULL, decoder_thread, dec)) {
+        skAppPrintErr("Unable to create decoder thread");
+        pthread_mutex_destroy(&dec->mutex);
+        pthread_cond_destroy(&dec->cond);
+        goto ERROR;
+    }
+
+    *dec_out = dec;
+    return 0;
+
+  ERROR:
+    for (i = 0; i < batches; ++i) {
+        free(dec->batches[i].recs);
+    }
+    free(dec->batches);
+    free(dec);
+    return -1;
+}
+
+
+/*
+ *  status = decoder_read_record(dec, rwrec);
+ *
+ *    Fill 'rwrec' with the next record from the stream read by 'dec'.
+ *    Return SKSTREAM_OK on success or the value skStreamReadRecord()
+ *    returned at the end of the stream.
+ */
+int
+decoder_read_record(
+    decoder_t          *dec,
+    rwRec              *rwrec)
+{
+    decoder_batch_t *batch = dec->current;
+
+    if (batch && dec->current_pos < batch->count) {
+        RWREC_COPY(rwrec, &batch->recs[dec->current_pos]);
+        ++dec->current_pos;
+        return SKSTREAM_OK;
+    }
+    if (batch && batch->rv != SKSTREAM_OK) {
+        return batch->rv;
+    }
+
+    pthread_mutex_lock(&dec->mutex);
+    if (dec->holding) {
+        /* release the batch just consumed */
+        dec->holding = 0;
+        dec->take_pos = (dec->take_pos + 1) % dec->batches_count;
+        --dec->full;
+        pthread_cond_broadcast(&dec->cond);
+    }
+    while (dec->full == 0) {
+        pthread_cond_wait(&dec->cond, &dec->mutex);
+    }
+    batch = &dec->batches[dec->take_pos];
+    dec->holding = 1;
+    pthread_mutex_unlock(&dec->mutex);
+
+    dec->current = batch;
+    dec->current_pos = 0;
+    if (batch->count == 0) {
+        return batch->rv;
+    }
+    RWREC_COPY(rwrec, &batch->recs[0]);
+    dec->current_pos = 1;
+    return SKSTREAM_OK;
+}
+
+
+/*
+ *  decoder_destroy(&dec);
+ *
+ *    Stop the decoder thread and release the decoder.  The stream is
+ *    not closed.
+ */
+void
+decoder_destroy(
+    decoder_t         **dec_ptr)
+{
+    decoder_t *dec;
+    uint32_t i;
+
+    if (dec_ptr == NULL || *dec_ptr == NULL) {
+        return;
+    }
+    dec = *dec_ptr;
+    *dec_ptr = NULL;
+
+    pthread_mutex_lock(&dec->mutex);
+    dec->stopping = 1;
+    pthread_cond_broadcast(&dec->cond);
+    pthread_mutex_unlock(&dec->mutex);
+    pthread_join(dec->tid, NULL);
+
+    pthread_mutex_destroy(&dec->mutex);
+    pthread_cond_destroy(&dec->cond);
+    for (i = 0; i < dec->batches_count; ++i) {
+        free(dec->batches[i].recs);
+    }
+    free(dec->batches);
+    free(dec);
+}
+
+
+/*
+** Local Variables:
+** mode:c
+** indent-tabs-mode:nil
+** c-basic-offset:4
+** End:
+*/
@@ -0,0 +1,285 @@
+/*
+** Copyright (C) 2006-2019 by Carnegie Mellon University.
+**
+** @OPENSOURCE_LICENSE_START@
+** See license information in ../../LICENSE.txt
+** @OPENSOURCE_LICENSE_END@
+*/
+
+/*
+ *  rwscan_group.c
+ *
+ *    Group unsorted SiLK Flow records into events in memory.
+ *
+ *    When --unsorted-input is given, records may arrive in any order
+ *    (typically time order, straight from the repository).  Each
+ *    record is added to the event for its (sip, proto) pair, which is
+ *    found in a hash table.  Once all input has been read, the events
+ *    are sorted by sip and protocol and handed to the worker threads.
+ */
+
+#include <silk/silk.h>
+
+RCSIDENT("$SiLK: rwscan_group.c 945cf5167607 2019-01-07 18:54:17Z mthomas $");
+
+#include <silk/hashlib.h>
+#include "rwscan.h"
+
+
+/* LOCAL DEFINES AND TYPEDEFS */
+
+/* initial size of the hash table */
+#define GROUP_TABLE_INITIAL_SIZE  (1 << 20)
+
+/* the key is the source IP followed by the protocol */
+#define GROUP_KEY_SIP_OFFSET    0
+#define GROUP_KEY_PROTO_OFFSET  sizeof(uint32_t)
+#define GROUP_KEY_LEN           (sizeof(uint32_t) + sizeof(uint8_t))
+
+
+/* LOCAL VARIABLE DEFINITIONS */
+
+/* maps the (sip, proto) key to an event_buf_t pointer */
+static HashTable *group_table = NULL;
+
+/* serializes access to the table by the reader threads */
+static pthread_mutex_t group_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* FUNCTION DEFINITIONS */
+
+/*
+ *  cmp = group_compare(a, b);
+ *
+ *    Compare two event_buf_t pointers by source IP and protocol.
+ *    Used to dispatch the grouped events in sorted order.
+ */
+static int
+group_compare(
+    const void         *a,
+    const void         *b)
+{
+    const event_metrics_t *ma = (*(const event_buf_t**)a)->metrics;
+    const event_metrics_t *mb = (*(const event_buf_t**)b)->metrics;
+
+    if (ma->sip != mb->sip) {
+        return ((ma->sip < mb->sip) ? -1 : 1);
+    }
+    if (ma->protocol != mb->protocol) {
+        return ((ma->protocol < mb->protocol) ? -1 : 1);
+    }
+    return 0;
+}
+
+
+/*
+ *  status = group_table_create();
+ *
+ *    Create the hash table used to group unsorted records.  Return 0
+ *    on success or -1 on failure.
+ */
+int
+group_table_create(
+    void)
+{
+    uint8_t no_value[sizeof(event_buf_t*)];
+
+    memset(no_value, 0, sizeof(no_value));
+
+    group_table = hashlib_create_table(GROUP_KEY_LEN, sizeof(event_buf_t*),
+                                       HTT_INPLACE, no_value, NULL, 0,
+                                       GROUP_TABLE_INITIAL_SIZE,
+                                       DEFAULT_LOAD_FACTOR);
+    if (group_table == NULL) {
+        skAppPrintOutOfMemory("event grouping table");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ *  status = group_add_record(rwrec);
+ *
+ *    Add 'rwrec' to the event for its source IP and protocol,
+ *    creating the event if this is the first record for the pair.
+ *    Return 0 on success or -1 on failure.  The caller must hold
+ *    group_mutex.
+ */
+static int
+group_add_record(
+    const rwscan_flow_t *rwrec)
+{
+    uint8_t      key[GROUP_KEY_LEN];
+    uint8_t     *value;
+    uint32_t     sip;
+    uint8_t      proto;
+    event_buf_t *ev;
+    int          rv;
+
+    sip   = flowGetSIPv4(rwrec);
+    proto = flowGetProto(rwrec);
+    memcpy(key + GROUP_KEY_SIP_OFFSET, &sip, sizeof(sip));
+    memcpy(key + GROUP_KEY_PROTO_OFFSET, &proto, sizeof(proto));
+
+    rv = hashlib_insert(group_table, key, &value);
+    switch (rv) {
+      case OK:
+        /* new (sip, proto) pair */
+        ev = (event_buf_t*)calloc(1, sizeof(event_buf_t));
+        if (ev == NULL) {
+            skAppPrintOutOfMemory("event data");
+            return -1;
+        }
+        if (event_buf_begin(ev, sip, proto, RWSCAN_GROUP_ALLOC_SIZE)) {
+            event_buf_free(ev);
+            free(ev);
+            return -1;
+        }
+        memcpy(value, &ev, sizeof(event_buf_t*));
+        break;
+
+      case OK_DUPLICATE:
+        memcpy(&ev, value, sizeof(event_buf_t*));
+        break;
+
+      default:
+        skAppPrintOutOfMemory("event grouping table entry");
+        return -1;
+    }
+
+    return event_buf_add(ev, rwrec);
+}
+
+
+/*
+ *  status = group_add_records(recs, count);
+ *
+ *    Add each of the 'count' records in 'recs' to its event.  Return
+ *    0 on success or -1 on failure.  May be called by several reader
+ *    threads.
+ */
+int
+group_add_records(
+    const rwscan_flow_t *recs,
+    size_t              count)
+{
+    size_t i;
+    int    rv = 0;
+
+    pthread_mutex_lock(&group_mutex);
+    for (i = 0; i < count && rv == 0; ++i) {
+        rv = group_add_record(&recs[i]);
+    }
+    pthread_mutex_unlock(&group_mutex);
+
+    return rv;
+}
+
+
+/*
+ *  status = group_dispatch_all();
+ *
+ *    Hand every grouped event to the worker threads in order of
+ *    source IP and protocol, emptying the hash table.  Return 0 on
+ *    success or -1 on failure.
+ */
+int
+group_dispatch_all(
+    void)
+{
+    HASH_ITER     iter;
+    uint8_t      *key;
+    uint8_t      *value;
+    event_buf_t **events;
+    event_dispatch_t disp;
+    uint64_t      count;
+    uint64_t      i;
+    uint32_t      last_sip = 0;
+    int           retval = 0;
+
+    if (group_table == NULL) {
+        return 0;
+    }
+
+    count = hashlib_count_entries(group_table);
+    if (count == 0) {
+        return 0;
+    }
+    memset(&disp, 0, sizeof(disp));
+    events = (event_buf_t**)malloc(count * sizeof(event_buf_t*));
+    if (events == NULL) {
+        skAppPrintOutOfMemory("event list");
+        return -1;
+    }
+
+    i = 0;
+    iter = hashlib_create_iterator(group_table);
+    while (hashlib_iterate(group_table, &iter, &key, &value) == OK) {
+        memcpy(&events[i], value, sizeof(event_buf_t*));
+        memset(value, 0, sizeof(event_buf_t*));
+        ++i;
+    }
+    assert(i == count);
+
+    qsort(events, count, sizeof(event_buf_t*), group_compare);
+
+    for (i = 0; i < count; ++i) {
+        if (retval == 0) {
+            print_progress(last_sip, events[i]->metrics->sip);
+            last_sip = events[i]->metrics->sip;
+            if (event_buf_dispatch(events[i], &disp)) {
+                retval = -1;
+            }
+        }
+        event_buf_free(events[i]);
+        free(events[i]);
+    }
+    if (retval == 0 && event_dispatch_flush(&disp)) {
+        retval = -1;
+    }
+    event_dispatch_free(&disp);
+    free(events);
+
+    return retval;
+}
+
+
+/*
+ *  group_table_destroy();
+ *
+ *    Free the hash table and any events that were not dispatched.
+ */
+void
+group_table_destroy(
+    void)
+{
+    HASH_ITER    iter;
+    uint8_t     *key;
+    uint8_t     *value;
+    event_buf_t *ev;
+
+    if (group_table == NULL) {
+        return;
+    }
+
+    iter = hashlib_create_iterator(group_table);
+    while (hashlib_iterate(group_table, &iter, &key, &value) == OK) {
+        memcpy(&ev, value, sizeof(event_buf_t*));
+        if (ev) {
+            event_buf_free(ev);
+            free(ev);
+        }
+    }
+    hashlib_free_table(group_table);
+    group_table = NULL;
+}
+
+
+/*
+** Local Variables:
+** mode:c
+** indent-tabs-mode:nil
+** c-basic-offset:4
+** End:
+*/
@@ -13,95 +13,165 @@ RCSIDENT("$SiLK: rwscan_icmp.c 945cf5167607 2019-01-07 18:54:17Z mthomas $");
 #include "rwscan.h"
 
 
+RWSCAN_KERNEL
 void
 increment_icmp_counters(
-    rwRec              *rwrec,
-    event_metrics_t    *metrics)
+    const event_columns_t  *cols,
+    event_metrics_t        *metrics)
 {
-    uint8_t type = 0, code = 0;
-
-    type = rwRecGetIcmpType(rwrec);
-    code = rwRecGetIcmpCode(rwrec);
+    const uint16_t *dport = cols->dport;
+    uint32_t echo = 0;
+    uint32_t i;
 
-    if ((type == 8 || type == 13 || type == 15 || type == 17)
-        && (code == 0))
-    {
-        metrics->flows_icmp_echo++;
+    /* the type is the high byte of the dport and the code the low
+     * byte; echo requests have a code of 0 */
+    for (i = 0; i < cols->count; ++i) {
+        echo += (dport[i] == (8 << 8) || dport[i] == (13 << 8)
+                 || dport[i] == (15 << 8) || dport[i] == (17 << 8));
     }
+    metrics->flows_icmp_echo += echo;
 }
 
 
-void
-calculate_icmp_metrics(
-    rwRec              *event_flows,
-    event_metrics_t    *metrics)
+/*
+ *  icmp_metrics_step(state, metrics, dip_curr, has_next, dip_next);
+ *
+ *    Update the ICMP metrics for the flow to 'dip_curr', which is
+ *    followed by a flow to 'dip_next' when 'has_next' is true.
+ */
+static void
+icmp_metrics_step(
+    metric_state_t     *state,
+    event_metrics_t    *metrics,
+    uint32_t            dip_curr,
+    int                 has_next,
+    uint32_t            dip_next)
 {
-    uint32_t i;
-    uint32_t class_c_next = 0, class_c_curr = 0;
-    uint32_t dip_next     = 0, dip_curr = 0;
+    uint32_t class_c_curr = dip_curr & 0xFFFFFF00;
 
-    uint8_t  run               = 1, max_run_curr = 1;
-    uint32_t class_c_run       = 1, max_class_c_run = 1;
-    uint8_t  class_c_dip_count = 1, max_class_c_dip_count = 1;
+    /* without a next flow, the previous next flow is used */
+    if (has_next) {
+        state->dip_next     = dip_next;
+        state->class_c_next = dip_next & 0xFFFFFF00;
+    }
+    dip_next = state->dip_next;
 
-    rwRec *rwcurr = NULL;
-    rwRec *rwnext = NULL;
+    if (has_next && (class_c_curr == state->class_c_next)) {
+        if (dip_curr != dip_next) {
+            state->proto.icmp.class_c_dip_count++;
+            if (dip_next - dip_curr == 1) {
+                state->proto.icmp.run++;
+            } else {
+                if (state->proto.icmp.run > state->proto.icmp.max_run_curr) {
+                    state->proto.icmp.max_run_curr = state->proto.icmp.run;
+                }
+                state->proto.icmp.run = 1;
+            }
+        }
+    } else {
+        if (((state->class_c_next - class_c_curr) >> 8) == 1) {
+            state->proto.icmp.class_c_run++;
+        } else {
+            if (state->proto.icmp.class_c_run
+                > state->proto.icmp.max_class_c_run)
+            {
+                state->proto.icmp.max_class_c_run
+                    = state->proto.icmp.class_c_run;
+            }
+            state->proto.icmp.class_c_run = 1;
+        }
 
-    calculate_shared_metrics(event_flows, metrics);
+        if (state->proto.icmp.max_run_curr >
+            metrics->proto.icmp.max_class_c_dip_run_length)
+        {
+            metrics->proto.icmp.max_class_c_dip_run_length
+                = state->proto.icmp.max_run_curr;
+        }
 
-    for (i = 0; i < metrics->event_size; i++) {
-        rwcurr = &(event_flows[i]);
-        rwnext =
-            (i + 1 < (metrics->event_size)) ? &(event_flows[i + 1]) : NULL;
+        if (state->proto.icmp.class_c_dip_count
+            > state->proto.icmp.max_class_c_dip_count)
+        {
+            state->proto.icmp.max_class_c_dip_count
+                = state->proto.icmp.class_c_dip_count;
+        }
+        state->proto.icmp.class_c_dip_count = 1;
+    }
+}
 
-        dip_curr     = rwRecGetDIPv4(rwcurr);
-        class_c_curr = dip_curr & 0xFFFFFF00;
 
-        if (rwnext != NULL) {
-            dip_next     = rwRecGetDIPv4(rwnext);
-            class_c_next = dip_next & 0xFFFFFF00;
+void
+calculate_icmp_metrics(
+    metric_state_t         *state,
+    const event_columns_t  *cols,
+    event_metrics_t        *metrics)
+{
+    event_columns_t tile;
+    uint32_t first;
+
+    if (state->sketch) {
+        increment_icmp_counters(cols, metrics);
+        event_sketch_add(state->sketch, cols, metrics);
+        return;
+    }
+    /* make every pass over a tile of the flows while it is cached */
+    for (first = 0; first < cols->count; first += RWSCAN_KERNEL_TILE) {
+        event_columns_view(&tile, cols, first,
+                           ((cols->count - first < RWSCAN_KERNEL_TILE)
+                            ? (cols->count - first) : RWSCAN_KERNEL_TILE));
+        increment_icmp_counters(&tile, metrics);
+        calculate_shared_metrics(state, &tile, metrics);
+        if (!state->no_dip_runs) {
+            calculate_icmp_dip_runs(state, &tile, metrics);
         }
+    }
+}
 
-        if ((rwnext != NULL) && (class_c_curr == class_c_next)) {
-            if (dip_curr != dip_next) {
-                class_c_dip_count++;
-                if (dip_next - dip_curr == 1) {
-                    run++;
-                } else {
-                    if (run > max_run_curr) {
-                        max_run_curr = run;
-                    }
-                    run = 1;
-                }
-            }
-        } else {
-            if (((class_c_next - class_c_curr) >> 8) == 1) {
-                class_c_run++;
-            } else {
-                if (class_c_run > max_class_c_run) {
-                    max_class_c_run = class_c_run;
-                }
-                class_c_run = 1;
-            }
 
-            if (max_run_curr >
-                metrics->proto.icmp.max_class_c_dip_run_length)
-            {
-                metrics->proto.icmp.max_class_c_dip_run_length = max_run_curr;
-            }
+/*
+ *  calculate_icmp_dip_runs(state, cols, metrics);
+ *
+ *    Update the runs of dips and of class C subnets for the flows in
+ *    'cols'.  These depend only on the dips.
+ */
+void
+calculate_icmp_dip_runs(
+    metric_state_t         *state,
+    const event_columns_t  *cols,
+    event_metrics_t        *metrics)
+{
+    const uint32_t *dip = cols->dip;
+    uint32_t i;
 
-            if (class_c_dip_count > max_class_c_dip_count) {
-                max_class_c_dip_count = class_c_dip_count;
-            }
-            class_c_dip_count = 1;
+    /* the held flow is processed once the flow after it is known */
+    for (i = 0; i < cols->count; i++) {
+        if (state->seen) {
+            icmp_metrics_step(state, metrics, state->held_dip, 1, dip[i]);
         }
+        state->held_dip = dip[i];
+        ++state->seen;
     }
+}
 
-    metrics->proto.icmp.max_class_c_subnet_run_length = max_class_c_run;
+
+void
+finish_icmp_metrics(
+    metric_state_t         *state,
+    event_metrics_t        *metrics)
+{
+    if (state->sketch) {
+        event_sketch_finish(state->sketch, metrics);
+    } else {
+        if (state->seen) {
+            icmp_metrics_step(state, metrics, state->held_dip, 0, 0);
+        }
+        metrics->proto.icmp.max_class_c_subnet_run_length
+            = state->proto.icmp.max_class_c_run;
+        metrics->proto.icmp.max_class_c_dip_count
+            = state->proto.icmp.max_class_c_dip_count;
+    }
 
     metrics->proto.icmp.echo_ratio =
         ((double) metrics->flows_icmp_echo / metrics->event_size);
-    metrics->proto.icmp.max_class_c_dip_count = max_class_c_dip_count;
     metrics->proto.icmp.total_dip_count       = metrics->unique_dsts;
 
     print_verbose_results((RWSCAN_VERBOSE_FH, "\ticmp (%u, %u, %u, %u, %.3f)",
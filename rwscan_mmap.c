@@ -0,0 +1,335 @@
+/*
+** Copyright (C) 2006-2019 by Carnegie Mellon University.
+**
+** @OPENSOURCE_LICENSE_START@
+** See license information in ../../LICENSE.txt
+** @OPENSOURCE_LICENSE_END@
+*/
+
+/*
+ *  rwscan_mmap.c
+ *
+ *    Read uncompressed SiLK Flow files through a memory map.
+ *
+ *    skStreamReadRecord() copies each record from its I/O buffer into
+ *    an rwRec, which rwscan then copies into the event.  For local
+ *    uncompressed files in the host's byte order, rwscan instead maps
+ *    the file and decodes each record from the map directly into its
+ *    slot in the event.  The source IP and protocol, which decide the
+ *    event a record belongs to, are read from the map without decoding
+ *    the rest of the record.
+ *
+ *    The formats written by rwfilter and rwsort are supported:
+ *    FT_RWGENERIC version 5 and FT_RWIPV6ROUTING version 1.  Other
+ *    files are read with skstream.
+ */
+
+#include <silk/silk.h>
+
+RCSIDENT("$SiLK: rwscan_mmap.c 945cf5167607 2019-01-07 18:54:17Z mthomas $");
+
+#include "rwscan.h"
+
+
+/* LOCAL DEFINES AND TYPEDEFS */
+
+#if SK_LITTLE_ENDIAN
+#define MAP_NATIVE_BYTE_ORDER  SILK_ENDIAN_LITTLE
+#else
+#define MAP_NATIVE_BYTE_ORDER  SILK_ENDIAN_BIG
+#endif
+
+/* offsets of the fields that the two formats share */
+#define MAP_OFF_STIME           0   /* int64_t, milliseconds */
+#define MAP_OFF_ELAPSED         8   /* uint32_t, milliseconds */
+#define MAP_OFF_SPORT          12   /* uint16_t */
+#define MAP_OFF_DPORT          14   /* uint16_t */
+#define MAP_OFF_PROTO          16   /* uint8_t */
+#define MAP_OFF_FLOWTYPE       17   /* uint8_t */
+#define MAP_OFF_SENSOR         18   /* uint16_t */
+#define MAP_OFF_FLAGS          20   /* uint8_t */
+#define MAP_OFF_INIT_FLAGS     21   /* uint8_t */
+#define MAP_OFF_REST_FLAGS     22   /* uint8_t */
+#define MAP_OFF_TCP_STATE      23   /* uint8_t */
+#define MAP_OFF_APPLICATION    24   /* uint16_t */
+#define MAP_OFF_MEMO           26   /* uint16_t */
+#define MAP_OFF_INPUT          28   /* uint16_t */
+#define MAP_OFF_OUTPUT         30   /* uint16_t */
+#define MAP_OFF_PKTS           32   /* uint32_t */
+#define MAP_OFF_BYTES          36   /* uint32_t */
+#define MAP_OFF_SIP            40
+
+/* FT_RWGENERIC v5 holds IPv4 addresses as uint32_t in file byte order */
+#define MAP_GENERIC_VERSION     5
+#define MAP_GENERIC_RECLEN     52
+#define MAP_GENERIC_OFF_DIP    44
+#define MAP_GENERIC_OFF_NHIP   48
+
+/* FT_RWIPV6ROUTING v1 holds 16-byte addresses in network byte order;
+ * IPv4 addresses are stored as IPv4-mapped IPv6 addresses */
+#define MAP_IPV6_VERSION        1
+#define MAP_IPV6_RECLEN        88
+#define MAP_IPV6_OFF_DIP       56
+#define MAP_IPV6_OFF_NHIP      72
+#define MAP_IPV6_TCP_STATE_V6  0x80
+
+/* read a value of 'type' at offset 'off' of the record at 'rec' */
+#define MAP_GET(type, rec, off, var)                    \
+    memcpy(&(var), (rec) + (off), sizeof(type))
+
+
+/* LOCAL VARIABLE DEFINITIONS */
+
+/* the first 12 bytes of an IPv4-mapped IPv6 address */
+static const uint8_t map_v4inv6[12] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF
+};
+
+
+/* FUNCTION DEFINITIONS */
+
+/*
+ *  ipv4 = map_get_ipv6_as_v4(addr, &ok);
+ *
+ *    Return the IPv4 address held in the IPv4-mapped IPv6 address at
+ *    'addr'.  Set 'ok' to 0 when the address is not IPv4-mapped.
+ */
+static uint32_t
+map_get_ipv6_as_v4(
+    const uint8_t      *addr,
+    int                *ok)
+{
+    uint32_t ipv4;
+
+    if (memcmp(addr, map_v4inv6, sizeof(map_v4inv6)) != 0) {
+        *ok = 0;
+        return 0;
+    }
+    memcpy(&ipv4, addr + sizeof(map_v4inv6), sizeof(ipv4));
+    return ntohl(ipv4);
+}
+
+
+/*
+ *  is_file = is_regular_file(path);
+ *
+ *    Return 1 if 'path' names a regular file, or 0 if it names the
+ *    standard input, a pipe, or another kind of file.
+ */
+int
+is_regular_file(
+    const char         *path)
+{
+    struct stat st;
+
+    if (0 == strcmp(path, "-") || 0 == strcmp(path, "stdin")) {
+        return 0;
+    }
+    return (0 == stat(path, &st) && S_ISREG(st.st_mode));
+}
+
+
+/*
+ *  status = mapped_file_open(mf, path);
+ *
+ *    Map the SiLK Flow file 'path' into memory and fill 'mf'.  Return
+ *    0 when the file was mapped, 1 when the file cannot be read
+ *    through a map and must be read with skstream, or -1 on error.
+ */
+int
+mapped_file_open(
+    mapped_file_t      *mf,
+    const char         *path)
+{
+    skstream_t *in = NULL;
+    sk_file_header_t *hdr;
+    struct stat st;
+    size_t hdr_len;
+    uint8_t format;
+    uint8_t version;
+    int fd = -1;
+    int retval = 1;
+
+    memset(mf, 0, sizeof(mapped_file_t));
+
+    if (!is_regular_file(path)) {
+        /* do not consume the header of the standard input or a pipe */
+        goto END;
+    }
+    if (skStreamOpenSilkFlow(&in, path, SK_IO_READ)) {
+        /* leave the reporting of the error to skstream */
+        goto END;
+    }
+    hdr = skStreamGetSilkHeader(in);
+    format = skHeaderGetFileFormat(hdr);
+    version = skHeaderGetRecordVersion(hdr);
+    mf->rec_len = skHeaderGetRecordLength(hdr);
+    if (skHeaderGetCompressionMethod(hdr) != SK_COMPMETHOD_NONE
+        || skHeaderGetByteOrder(hdr) != MAP_NATIVE_BYTE_ORDER)
+    {
+        goto END;
+    }
+    if (format == FT_RWGENERIC && version == MAP_GENERIC_VERSION
+        && mf->rec_len == MAP_GENERIC_RECLEN)
+    {
+        mf->is_ipv6 = 0;
+    } else if (format == FT_RWIPV6ROUTING && version == MAP_IPV6_VERSION
+               && mf->rec_len == MAP_IPV6_RECLEN)
+    {
+        mf->is_ipv6 = 1;
+    } else {
+        goto END;
+    }
+    hdr_len = skHeaderGetLength(hdr);
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)
+        || (size_t)st.st_size < hdr_len
+        || ((st.st_size - hdr_len) % mf->rec_len) != 0)
+    {
+        goto END;
+    }
+    mf->map_len = st.st_size;
+    mf->count = (st.st_size - hdr_len) / mf->rec_len;
+    if (mf->count == 0) {
+        goto END;
+    }
+    mf->map = mmap(NULL, mf->map_len, PROT_READ, MAP_SHARED, fd, 0);
+    if (mf->map == MAP_FAILED) {
+        mf->map = NULL;
+        goto END;
+    }
+    mf->recs = (const uint8_t*)mf->map + hdr_len;
+    retval = 0;
+
+  END:
+    if (fd != -1) {
+        close(fd);
+    }
+    skStreamDestroy(&in);
+    return retval;
+}
+
+
+/*
+ *  mapped_file_advise(mf, start, end);
+ *
+ *    Tell the kernel that records 'start' up to 'end' of 'mf' are
+ *    about to be read in order.
+ */
+void
+mapped_file_advise(
+    const mapped_file_t    *mf,
+    uint64_t                start,
+    uint64_t                end)
+{
+#if defined(MADV_SEQUENTIAL)
+    uintptr_t page_mask = (uintptr_t)sysconf(_SC_PAGESIZE) - 1;
+    uintptr_t first;
+    uintptr_t last;
+
+    if (end > mf->count) {
+        end = mf->count;
+    }
+    if (start >= end) {
+        return;
+    }
+    first = (uintptr_t)(mf->recs + start * mf->rec_len) & ~page_mask;
+    last = (uintptr_t)(mf->recs + end * mf->rec_len);
+    madvise((void*)first, last - first, MADV_SEQUENTIAL);
+    madvise((void*)first, last - first, MADV_WILLNEED);
+#endif  /* MADV_SEQUENTIAL */
+}
+
+
+/*
+ *  status = mapped_file_get_key(mf, idx, &sip, &proto);
+ *
+ *    Set 'sip' and 'proto' to the source IP and protocol of record
+ *    'idx' of 'mf'.  Return 0 on success, or -1 when the source or
+ *    destination of the record is an IPv6 address that is not
+ *    IPv4-mapped; such records are ignored, as skstream does when
+ *    told to treat IPv6 as IPv4.
+ */
+int
+mapped_file_get_key(
+    const mapped_file_t    *mf,
+    uint64_t                idx,
+    uint32_t               *sip,
+    uint8_t                *proto)
+{
+    const uint8_t *rec = mf->recs + idx * mf->rec_len;
+    int ok = 1;
+
+    *proto = rec[MAP_OFF_PROTO];
+    if (!mf->is_ipv6) {
+        MAP_GET(uint32_t, rec, MAP_OFF_SIP, *sip);
+        return 0;
+    }
+    map_get_ipv6_as_v4(rec + MAP_IPV6_OFF_DIP, &ok);
+    *sip = map_get_ipv6_as_v4(rec + MAP_OFF_SIP, &ok);
+    return (ok ? 0 : -1);
+}
+
+
+/*
+ *  mapped_file_decode(mf, idx, flow);
+ *
+ *    Fill 'flow' from record 'idx' of 'mf', reading only the fields
+ *    the scan models use.  The record must be one for which
+ *    mapped_file_get_key() succeeds.
+ */
+void
+mapped_file_decode(
+    const mapped_file_t    *mf,
+    uint64_t                idx,
+    rwscan_flow_t          *flow)
+{
+    const uint8_t *rec = mf->recs + idx * mf->rec_len;
+    int64_t  i64;
+    int      ok = 1;
+
+    MAP_GET(int64_t, rec, MAP_OFF_STIME, i64);
+    flow->stime = (uint32_t)(i64 / 1000);
+    flow->stime_msec = (uint16_t)(i64 % 1000);
+    MAP_GET(uint32_t, rec, MAP_OFF_ELAPSED, flow->elapsed);
+    MAP_GET(uint16_t, rec, MAP_OFF_SPORT, flow->sport);
+    MAP_GET(uint16_t, rec, MAP_OFF_DPORT, flow->dport);
+    flow->proto = rec[MAP_OFF_PROTO];
+    flow->flags = rec[MAP_OFF_FLAGS];
+    MAP_GET(uint32_t, rec, MAP_OFF_PKTS, flow->pkts);
+    MAP_GET(uint32_t, rec, MAP_OFF_BYTES, flow->bytes);
+
+    if (!mf->is_ipv6) {
+        MAP_GET(uint32_t, rec, MAP_OFF_SIP, flow->sip);
+        MAP_GET(uint32_t, rec, MAP_GENERIC_OFF_DIP, flow->dip);
+    } else {
+        flow->sip = map_get_ipv6_as_v4(rec + MAP_OFF_SIP, &ok);
+        flow->dip = map_get_ipv6_as_v4(rec + MAP_IPV6_OFF_DIP, &ok);
+    }
+}
+
+
+/*
+ *  mapped_file_close(mf);
+ *
+ *    Unmap the file held by 'mf'.
+ */
+void
+mapped_file_close(
+    mapped_file_t      *mf)
+{
+    if (mf->map) {
+        munmap(mf->map, mf->map_len);
+        mf->map = NULL;
+    }
+}
+
+
+/*
+** Local Variables:
+** mode:c
+** indent-tabs-mode:nil
+** c-basic-offset:4
+** End:
+*/
@@ -0,0 +1,491 @@
+/*
+** Copyright (C) 2006-2019 by Carnegie Mellon University.
+**
+** @OPENSOURCE_LICENSE_START@
+** See license information in ../../LICENSE.txt
+** @OPENSOURCE_LICENSE_END@
+*/
+
+/*
+ *  rwscan_parallel.c
+ *
+ *    Analysis of one very large event by several threads.
+ *
+ *    When --parallel-events is given, the worker thread that takes an
+ *    event holding at least that many flows starts helper threads for
+ *    the slow steps of the event:
+ *
+ *    --  each sort of the event's flows sorts one slice per thread
+ *        with flow_sort() and then merges the sorted slices pairwise,
+ *        each merge of a round on its own thread;
+ *
+ *    --  the BLR features are calculated over partitions of the flows
+ *        sorted by dip and sport.  Each partition begins with a new
+ *        dip, so the numbers of dips and of destinations found in the
+ *        partitions add up, the source port count and the low port map
+ *        of a dip are never split between partitions, and the
+ *        counters, sums, maxima, and source port maps of the partitions
+ *        are merged.  The runs of consecutive dips and /24s of UDP and
+ *        ICMP events may cross any boundary; they depend only on the
+ *        dips and are found in one pass over the dip column once the
+ *        partitions have been loaded.
+ *
+ *    The features are therefore the same as those calculated by a
+ *    single thread.
+ */
+
+#include <silk/silk.h>
+
+RCSIDENT("$SiLK: rwscan_parallel.c 945cf5167607 2019-01-07 18:54:17Z mthomas $");
+
+#include "rwscan.h"
+
+
+/* LOCAL DEFINES AND TYPEDEFS */
+
+/* a slice of the flows to sort, or two sorted slices to merge */
+typedef struct sort_task_st {
+    const rwscan_flow_t *src;
+    rwscan_flow_t       *dst;
+    size_t               left;      /* first flow of the first slice */
+    size_t               mid;       /* first flow of the second slice */
+    size_t               right;     /* one past the last flow */
+    flow_order_t         order;
+    flow_compare_fn_t    cmp;
+} sort_task_t;
+
+/* one partition of an event whose BLR features are being calculated */
+typedef struct partition_task_st {
+    const rwscan_flow_t *flows;     /* all flows of the event */
+    event_columns_t     *cols;      /* columns of the whole event */
+    uint32_t             first;     /* index of the first flow */
+    uint32_t             count;     /* number of flows */
+    uint32_t             next;      /* index of the next partition's
+                                     * first flow, or 0 if none */
+    metric_state_t       state;
+    event_metrics_t      metrics;
+} partition_task_t;
+
+
+/* FUNCTION DEFINITIONS */
+
+/*
+ *  run_tasks(fn, tasks, task_size, count);
+ *
+ *    Call 'fn' on each of the 'count' entries of 'task_size' bytes
+ *    in 'tasks', every entry but the first on a thread of its own, and
+ *    wait for them to finish.  An entry whose thread cannot be created
+ *    is run by the calling thread.
+ */
+static void
+run_tasks(
+    void *            (*fn)(void *),
+    void               *tasks,
+    size_t              task_size,
+    uint32_t            count)
+{
+    pthread_t *tids;
+    uint8_t *started;
+    uint32_t i;
+
+    tids = (pthread_t*)malloc(count * (sizeof(pthread_t) + 1));
+    if (tids == NULL) {
+        for (i = 0; i < count; ++i) {
+            fn((uint8_t*)tasks + i * task_size);
+        }
+        return;
+    }
+    started = (uint8_t*)(tids + count);
+
+    for (i = 1; i < count; ++i) {
+        started[i] = (0 == pthread_create(&tids[i], NULL, fn,
+                                          (uint8_t*)tasks + i * task_size));
+    }
+    fn(tasks);
+    for (i = 1; i < count; ++i) {
+        if (started[i]) {
+            pthread_join(tids[i], NULL);
+        } else {
+            fn((uint8_t*)tasks + i * task_size);
+        }
+    }
+    free(tids);
+}
+
+
+/*
+ *  sort_slice(task);
+ *
+ *    Sort the slice of the sort_task_t 'task' in place.
+ */
+static void *
+sort_slice(
+    void               *v_task)
+{
+    sort_task_t *t = (sort_task_t*)v_task;
+
+    flow_sort(t->dst + t->left, t->right - t->left, t->order);
+    return NULL;
+}
+
+
+/*
+ *  merge_slices(task);
+ *
+ *    Merge the two sorted slices of 'src' in the sort_task_t 'task'
+ *    into the same positions of 'dst'.  Equal flows keep their order.
+ */
+static void *
+merge_slices(
+    void               *v_task)
+{
+    sort_task_t *t = (sort_task_t*)v_task;
+    size_t a = t->left;
+    size_t b = t->mid;
+    size_t out = t->left;
+
+    while (a < t->mid && b < t->right) {
+        if (t->cmp(&t->src[b], &t->src[a]) < 0) {
+            t->dst[out++] = t->src[b++];
+        } else {
+            t->dst[out++] = t->src[a++];
+        }
+    }
+    if (a < t->mid) {
+        memcpy(&t->dst[out], &t->src[a], (t->mid - a) * sizeof(rwscan_flow_t));
+    } else if (b < t->right) {
+        memcpy(&t->dst[out], &t->src[b],
+               (t->right - b) * sizeof(rwscan_flow_t));
+    }
+    return NULL;
+}
+
+
+/*
+ *  parallel_sort(flows, count, order, threads);
+ *
+ *    Sort the 'count' flows in 'flows' into 'order' using up to
+ *    'threads' threads, keeping the order of equal flows.  Use one
+ *    thread when 'threads' is less than 2 or the buffer for the
+ *    merges cannot be allocated.
+ */
+void
+parallel_sort(
+    rwscan_flow_t      *flows,
+    uint32_t            count,
+    flow_order_t        order,
+    uint32_t            threads)
+{
+    flow_compare_fn_t cmp = flow_order_compare(order);
+    rwscan_flow_t *scratch = NULL;
+    rwscan_flow_t *src;
+    rwscan_flow_t *dst;
+    rwscan_flow_t *tmp;
+    sort_task_t *tasks = NULL;
+    size_t *bounds = NULL;
+    uint32_t slices;
+    uint32_t i;
+
+    if (threads >= 2) {
+        scratch = (rwscan_flow_t*)malloc((size_t)count
+                                         * sizeof(rwscan_flow_t));
+        tasks = (sort_task_t*)malloc(threads * sizeof(sort_task_t));
+        bounds = (size_t*)malloc((threads + 1) * sizeof(size_t));
+    }
+    if (scratch == NULL || tasks == NULL || bounds == NULL) {
+        free(scratch);
+        free(tasks);
+        free(bounds);
+        flow_sort(flows, count, order);
+        return;
+    }
+
+    /* sort a slice per thread */
+    slices = threads;
+    for (i = 0; i <= slices; ++i) {
+        bounds[i] = (size_t)count * i / slices;
+    }
+    for (i = 0; i < slices; ++i) {
+        tasks[i].src   = flows;
+        tasks[i].dst   = flows;
+        tasks[i].left  = bounds[i];
+        tasks[i].mid   = bounds[i + 1];
+        tasks[i].right = bounds[i + 1];
+        tasks[i].order = order;
+        tasks[i].cmp   = cmp;
+    }
+    run_tasks(&sort_slice, tasks, sizeof(sort_task_t), slices);
+
+    /* merge neighboring slices until one remains, alternating between
+     * the two buffers */
+    src = flows;
+    dst = scratch;
+    while (slices > 1) {
+        for (i = 0; i < (slices + 1) / 2; ++i) {
+            tasks[i].src   = src;
+            tasks[i].dst   = dst;
+            tasks[i].left  = bounds[2 * i];
+            if (2 * i + 1 < slices) {
+                tasks[i].mid   = bounds[2 * i + 1];
+                tasks[i].right = bounds[2 * i + 2];
+            } else {
+                tasks[i].mid   = bounds[2 * i + 1];
+                tasks[i].right = bounds[2 * i + 1];
+            }
+            tasks[i].cmp   = cmp;
+        }
+        run_tasks(&merge_slices, tasks, sizeof(sort_task_t),
+                  (slices + 1) / 2);
+        for (i = 0; i < (slices + 1) / 2; ++i) {
+            bounds[i] = tasks[i].left;
+        }
+        slices = (slices + 1) / 2;
+        bounds[slices] = count;
+
+        tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+    if (src != flows) {
+        memcpy(flows, src, (size_t)count * sizeof(rwscan_flow_t));
+    }
+
+    free(scratch);
+    free(tasks);
+    free(bounds);
+}
+
+
+/*
+ *  count = choose_partitions(flows, count, parts, bounds);
+ *
+ *    Split the 'count' flows in 'flows', which are sorted by dip, into
+ *    at most 'parts' partitions of roughly equal size, each beginning
+ *    with a flow whose dip differs from that of the flow before it.
+ *    Fill 'bounds' with the index of the first flow of each partition
+ *    followed by 'count', and return the number of partitions.
+ */
+static uint32_t
+choose_partitions(
+    const rwscan_flow_t    *flows,
+    uint32_t                count,
+    uint32_t                parts,
+    uint32_t               *bounds)
+{
+    uint32_t found = 1;
+    uint32_t pos;
+    uint32_t i;
+
+    bounds[0] = 0;
+    for (i = 1; i < parts; ++i) {
+        pos = (uint32_t)((uint64_t)count * i / parts);
+        if (pos <= bounds[found - 1]) {
+            pos = bounds[found - 1] + 1;
+        }
+        while (pos < count
+               && flowGetDIPv4(&flows[pos]) == flowGetDIPv4(&flows[pos - 1]))
+        {
+            ++pos;
+        }
+        if (pos >= count) {
+            break;
+        }
+        bounds[found++] = pos;
+    }
+    bounds[found] = count;
+    return found;
+}
+
+
+/*
+ *  measure_partition(task);
+ *
+ *    Load the flows of the partition_task_t 'task' into its columns
+ *    of the event and calculate its features, except the runs of
+ *    dips, into the task's metrics.
+ */
+static void *
+measure_partition(
+    void               *v_task)
+{
+    partition_task_t *t = (partition_task_t*)v_task;
+    event_columns_t view;
+    const rwscan_flow_t *next;
+
+    event_columns_fill(t->cols, t->first, &t->flows[t->first], t->count);
+    event_columns_view(&view, t->cols, t->first, t->count);
+
+    switch (t->metrics.protocol) {
+      case IPPROTO_ICMP:
+        calculate_icmp_metrics(&t->state, &view, &t->metrics);
+        break;
+      case IPPROTO_TCP:
+        calculate_tcp_metrics(&t->state, &view, &t->metrics);
+        break;
+      case IPPROTO_UDP:
+        calculate_udp_metrics(&t->state, &view, &t->metrics);
+        if (t->next) {
+            next = &t->flows[t->next];
+            end_udp_partition(&t->state, &t->metrics,
+                              flowGetDIPv4(next), flowGetDPort(next));
+        }
+        break;
+    }
+    return NULL;
+}
+
+
+/*
+ *  status = parallel_blr_metrics(work, threads);
+ *
+ *    Calculate the BLR features of the event in 'work', whose flows
+ *    are in memory and sorted by dip and sport, using up to 'threads'
+ *    threads, and finish them as the finish_*_metrics() functions do.
+ *    Return 0 on success, or -1 if the event cannot be split or on
+ *    allocation failure, in which case the event's metrics are
+ *    unchanged.
+ */
+int
+parallel_blr_metrics(
+    worker_thread_data_t   *work,
+    uint32_t                threads)
+{
+    event_metrics_t *metrics = work->metrics;
+    const rwscan_flow_t *flows = work->flows;
+    const rwscan_flow_t *prev;
+    partition_task_t *tasks;
+    partition_task_t *last;
+    metric_state_t runs;
+    uint32_t *bounds;
+    uint32_t parts;
+    uint32_t i;
+    uint32_t j;
+    int retval = -1;
+
+    tasks = (partition_task_t*)calloc(threads, sizeof(partition_task_t));
+    bounds = (uint32_t*)malloc((threads + 1) * sizeof(uint32_t));
+    if (tasks == NULL || bounds == NULL) {
+        free(tasks);
+        free(bounds);
+        return -1;
+    }
+    memset(&runs, 0, sizeof(runs));
+
+    parts = choose_partitions(flows, metrics->event_size, threads, bounds);
+    if (parts < 2
+        || event_columns_reserve(work->columns, metrics->event_size))
+    {
+        goto END;
+    }
+
+    for (i = 0; i < parts; ++i) {
+        partition_task_t *t = &tasks[i];
+
+        t->flows = flows;
+        t->cols  = work->columns;
+        t->first = bounds[i];
+        t->count = bounds[i + 1] - bounds[i];
+        t->next  = (i + 1 < parts) ? bounds[i + 1] : 0;
+        t->metrics.protocol = metrics->protocol;
+        if (metric_state_init(&t->state, metrics->protocol)) {
+            goto END;
+        }
+        t->state.no_dip_runs = 1;
+        if (i > 0) {
+            /* continue from the last flow of the previous partition,
+             * whose dip differs from that of this partition's first
+             * flow */
+            prev = &flows[t->first - 1];
+            t->state.shared_seen = t->first;
+            t->state.last_dip    = flowGetDIPv4(prev);
+            t->state.last_sp     = flowGetSPort(prev);
+            t->state.last_dp     = flowGetDPort(prev);
+            t->state.seen        = t->first;
+            t->state.held_dip    = flowGetDIPv4(prev);
+            t->state.held_dport  = flowGetDPort(prev);
+        }
+    }
+    if (metric_state_init(&runs, metrics->protocol)) {
+        goto END;
+    }
+
+    run_tasks(&measure_partition, tasks, sizeof(partition_task_t), parts);
+    work->columns->count = metrics->event_size;
+
+    /* merge the partitions */
+    last = &tasks[parts - 1];
+    metrics->sp_count    = last->metrics.sp_count;
+    metrics->unique_dips = 0;
+    metrics->unique_dsts = 0;
+    for (i = 0; i < parts; ++i) {
+        const event_metrics_t *m = &tasks[i].metrics;
+
+        metrics->unique_dips        += m->unique_dips;
+        metrics->unique_dsts        += m->unique_dsts;
+        metrics->pkts               += m->pkts;
+        metrics->bytes              += m->bytes;
+        metrics->flows_noack        += m->flows_noack;
+        metrics->flows_small        += m->flows_small;
+        metrics->flows_with_payload += m->flows_with_payload;
+        metrics->flows_backscatter  += m->flows_backscatter;
+        metrics->flows_icmp_echo    += m->flows_icmp_echo;
+        for (j = 0; j < RWSCAN_MAX_FLAGS; ++j) {
+            metrics->tcp_flag_counts[j] += m->tcp_flag_counts[j];
+        }
+        if (metrics->protocol == IPPROTO_UDP) {
+            if (m->proto.udp.max_low_dp_hit
+                > metrics->proto.udp.max_low_dp_hit)
+            {
+                metrics->proto.udp.max_low_dp_hit
+                    = m->proto.udp.max_low_dp_hit;
+            }
+            if (m->proto.udp.max_low_port_run_length
+                > metrics->proto.udp.max_low_port_run_length)
+            {
+                metrics->proto.udp.max_low_port_run_length
+                    = m->proto.udp.max_low_port_run_length;
+            }
+            if (&tasks[i] != last) {
+                skBitmapUnion(last->state.proto.udp.sp_bitmap,
+                              tasks[i].state.proto.udp.sp_bitmap);
+            }
+        }
+    }
+
+    /* find the runs of dips and finish the features */
+    switch (metrics->protocol) {
+      case IPPROTO_ICMP:
+        calculate_icmp_dip_runs(&runs, work->columns, metrics);
+        finish_icmp_metrics(&runs, metrics);
+        break;
+      case IPPROTO_TCP:
+        finish_tcp_metrics(&last->state, metrics);
+        break;
+      case IPPROTO_UDP:
+        calculate_udp_dip_runs(&runs, work->columns, metrics);
+        last->state.no_dip_runs = 0;
+        last->state.proto.udp.subnet_run = runs.proto.udp.subnet_run;
+        last->state.proto.udp.max_subnet_run = runs.proto.udp.max_subnet_run;
+        finish_udp_metrics(&last->state, metrics);
+        break;
+    }
+    retval = 0;
+
+  END:
+    for (i = 0; i < threads; ++i) {
+        metric_state_free(&tasks[i].state, metrics->protocol);
+    }
+    metric_state_free(&runs, metrics->protocol);
+    free(tasks);
+    free(bounds);
+    return retval;
+}
+
+
+/*
+** Local Variables:
+** mode:c
+** indent-tabs-mode:nil
+** c-basic-offset:4
+** End:
+*/
@@ -0,0 +1,642 @@
+/*
+** Copyright (C) 2006-2019 by Carnegie Mellon University.
+**
+** @OPENSOURCE_LICENSE_START@
+** See license information in ../../LICENSE.txt
+** @OPENSOURCE_LICENSE_END@
+*/
+
+/*
+ *  rwscan_pool.c
+ *
+ *    Recycle the memory used by events.
+ *
+ *    The reader builds an event for every (sip, proto) pair, and a
+ *    worker thread releases it once the event has been classified.
+ *    Most events hold only a handful of flows, so rather than
+ *    allocating and freeing the buffers for every event, the workers
+ *    return them here and the reader takes them back out.
+ *
+ *    Flow buffers come in size classes of RWSCAN_GROUP_ALLOC_SIZE
+ *    flows doubling up to RWSCAN_ALLOC_SIZE flows, and an event's
+ *    buffer moves up one class at a time as the event grows.  Each
+ *    class keeps a free list, and at most POOL_MAX_CACHED_BYTES are
+ *    held on the lists altogether.  Larger buffers are not pooled.
+ *
+ *    The event_metrics_t and worker_thread_data_t structures are
+ *    allocated by the reader and released by a worker, so each thread
+ *    keeps its own free lists of them and trades batches of entries
+ *    with a shared list when its own lists become empty or too long.
+ *
+ *    A batch of small events is a single allocation holding its
+ *    worker_thread_data_t, the metrics, the flows, and the offsets of
+ *    up to RWSCAN_BATCH_EVENTS events.  Batches are few compared with
+ *    events, so they share one free list.
+ */
+
+#include <silk/silk.h>
+
+RCSIDENT("$SiLK: rwscan_pool.c 945cf5167607 2019-01-07 18:54:17Z mthomas $");
+
+#include "rwscan.h"
+
+
+/* LOCAL DEFINES AND TYPEDEFS */
+
+/* number of flow buffer size classes: RWSCAN_GROUP_ALLOC_SIZE << i
+ * flows for i in [0, POOL_CLASS_COUNT) */
+#define POOL_CLASS_COUNT  14
+
+/* most memory held in free flow buffers */
+#define POOL_MAX_CACHED_BYTES  (64 << 20)
+
+/* number of entries moved between a thread's free list and the
+ * shared list at once; a thread's list never grows beyond twice
+ * this */
+#define POOL_BATCH_SIZE  64
+
+/* most batches of small events held on the free list */
+#define POOL_MAX_CACHED_BATCHES  64
+
+/* bytes in one batch of small events; the flows follow the metrics
+ * and the offsets come last so that every array is aligned */
+#define POOL_BATCH_BYTES                                        \
+    (sizeof(worker_thread_data_t)                               \
+     + RWSCAN_BATCH_EVENTS * sizeof(event_metrics_t)            \
+     + RWSCAN_BATCH_FLOWS * sizeof(rwscan_flow_t)               \
+     + (RWSCAN_BATCH_EVENTS + 1) * sizeof(uint32_t))
+
+/* a free buffer or structure; the link is stored in the memory
+ * itself */
+typedef struct pool_item_st {
+    struct pool_item_st *next;
+} pool_item_t;
+
+/* a list of free structures of one type */
+typedef struct pool_list_st {
+    pool_item_t *head;
+    size_t       count;
+} pool_list_t;
+
+/* the free structures held by one thread */
+typedef struct pool_cache_st {
+    pool_list_t  work;
+    pool_list_t  metrics;
+} pool_cache_t;
+
+
+/* LOCAL VARIABLE DEFINITIONS */
+
+/* free flow buffers by size class, and the bytes they hold */
+static pool_item_t *pool_flows[POOL_CLASS_COUNT];
+static size_t pool_flows_bytes = 0;
+
+/* free structures shared among the threads */
+static pool_cache_t pool_shared;
+
+/* free batches of small events */
+static pool_list_t pool_batches;
+
+/* protects the variables above */
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* the key for each thread's pool_cache_t */
+static pthread_key_t pool_cache_key;
+static int pool_cache_key_valid = 0;
+
+
+/* FUNCTION DEFINITIONS */
+
+/*
+ *  class = pool_class(capacity);
+ *
+ *    Return the size class holding buffers of exactly 'capacity'
+ *    flows, or -1 if 'capacity' is not the size of a class.
+ */
+static int
+pool_class(
+    uint32_t            capacity)
+{
+    uint32_t size = RWSCAN_GROUP_ALLOC_SIZE;
+    int i;
+
+    for (i = 0; i < POOL_CLASS_COUNT; ++i, size <<= 1) {
+        if (size == capacity) {
+            return i;
+        }
+        if (size > capacity) {
+            break;
+        }
+    }
+    return -1;
+}
+
+
+/*
+ *  pool_list_move(dst, src, count);
+ *
+ *    Move up to 'count' entries from the head of 'src' to 'dst'.
+ */
+static void
+pool_list_move(
+    pool_list_t        *dst,
+    pool_list_t        *src,
+    size_t              count)
+{
+    pool_item_t *item;
+
+    while (count > 0 && src->head != NULL) {
+        item = src->head;
+        src->head = item->next;
+        --src->count;
+        item->next = dst->head;
+        dst->head = item;
+        ++dst->count;
+        --count;
+    }
+}
+
+
+/*
+ *  pool_list_free(list);
+ *
+ *    Free every entry on 'list'.
+ */
+static void
+pool_list_free(
+    pool_list_t        *list)
+{
+    pool_item_t *item;
+
+    while (list->head != NULL) {
+        item = list->head;
+        list->head = item->next;
+        free(item);
+    }
+    list->count = 0;
+}
+
+
+/*
+ *  pool_cache_flush(cache);
+ *
+ *    Return every entry in the thread cache 'cache' to the shared
+ *    lists.  Used as the destructor of the thread-specific data.
+ */
+static void
+pool_cache_flush(
+    void               *cache)
+{
+    pool_cache_t *c = (pool_cache_t*)cache;
+
+    pthread_mutex_lock(&pool_mutex);
+    pool_list_move(&pool_shared.work, &c->work, c->work.count);
+    pool_list_move(&pool_shared.metrics, &c->metrics, c->metrics.count);
+    pthread_mutex_unlock(&pool_mutex);
+    free(c);
+}
+
+
+/*
+ *  cache = pool_cache_get();
+ *
+ *    Return the calling thread's cache, creating it if needed.
+ *    Return NULL if the cache cannot be created; the caller then uses
+ *    malloc() and free() directly.
+ */
+static pool_cache_t *
+pool_cache_get(
+    void)
+{
+    pool_cache_t *c;
+
+    if (!pool_cache_key_valid) {
+        return NULL;
+    }
+    c = (pool_cache_t*)pthread_getspecific(pool_cache_key);
+    if (c == NULL) {
+        c = (pool_cache_t*)calloc(1, sizeof(pool_cache_t));
+        if (c == NULL) {
+            return NULL;
+        }
+        if (pthread_setspecific(pool_cache_key, c)) {
+            free(c);
+            return NULL;
+        }
+    }
+    return c;
+}
+
+
+/*
+ *  item = pool_list_get(local, shared, size);
+ *
+ *    Take an entry from the thread list 'local', refilling it with a
+ *    batch from 'shared' when it is empty, or allocate a new entry of
+ *    'size' bytes when both are empty.  Return NULL on allocation
+ *    failure.
+ */
+static void *
+pool_list_get(
+    pool_list_t        *local,
+    pool_list_t        *shared,
+    size_t              size)
+{
+    pool_item_t *item;
+
+    if (local->head == NULL) {
+        pthread_mutex_lock(&pool_mutex);
+        pool_list_move(local, shared, POOL_BATCH_SIZE);
+        pthread_mutex_unlock(&pool_mutex);
+        if (local->head == NULL) {
+            return malloc(size);
+        }
+    }
+    item = local->head;
+    local->head = item->next;
+    --local->count;
+    return item;
+}
+
+
+/*
+ *  pool_list_put(local, shared, ptr);
+ *
+ *    Add 'ptr' to the thread list 'local', moving a batch of entries
+ *    to 'shared' when 'local' becomes too long.
+ */
+static void
+pool_list_put(
+    pool_list_t        *local,
+    pool_list_t        *shared,
+    void               *ptr)
+{
+    pool_item_t *item = (pool_item_t*)ptr;
+
+    item->next = local->head;
+    local->head = item;
+    ++local->count;
+    if (local->count > 2 * POOL_BATCH_SIZE) {
+        pthread_mutex_lock(&pool_mutex);
+        pool_list_move(shared, local, POOL_BATCH_SIZE);
+        pthread_mutex_unlock(&pool_mutex);
+    }
+}
+
+
+/*
+ *  status = pool_setup();
+ *
+ *    Prepare the pool.  Must be called before any threads are
+ *    started.  Return 0 on success or -1 on failure.
+ */
+int
+pool_setup(
+    void)
+{
+    if (pthread_key_create(&pool_cache_key, &pool_cache_flush)) {
+        skAppPrintErr("Unable to create thread-specific data key");
+        return -1;
+    }
+    pool_cache_key_valid = 1;
+    return 0;
+}
+
+
+/*
+ *  pool_teardown();
+ *
+ *    Free all memory held by the pool.  Must be called after all
+ *    other threads have exited.
+ */
+void
+pool_teardown(
+    void)
+{
+    pool_cache_t *c;
+    pool_item_t *item;
+    int i;
+
+    if (pool_cache_key_valid) {
+        c = (pool_cache_t*)pthread_getspecific(pool_cache_key);
+        if (c != NULL) {
+            pthread_setspecific(pool_cache_key, NULL);
+            pool_cache_flush(c);
+        }
+        pthread_key_delete(pool_cache_key);
+        pool_cache_key_valid = 0;
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    for (i = 0; i < POOL_CLASS_COUNT; ++i) {
+        while (pool_flows[i] != NULL) {
+            item = pool_flows[i];
+            pool_flows[i] = item->next;
+            free(item);
+        }
+    }
+    pool_flows_bytes = 0;
+    pool_list_free(&pool_shared.work);
+    pool_list_free(&pool_shared.metrics);
+    pool_list_free(&pool_batches);
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+
+/*
+ *  capacity = pool_flows_capacity(count);
+ *
+ *    Return the number of flows in the smallest buffer that holds
+ *    'count' flows: the smallest size class of at least 'count', or
+ *    'count' rounded up to a multiple of RWSCAN_ALLOC_SIZE when it
+ *    exceeds every class.
+ */
+uint32_t
+pool_flows_capacity(
+    uint32_t            count)
+{
+    uint32_t size = RWSCAN_GROUP_ALLOC_SIZE;
+
+    while (size < count && size < RWSCAN_ALLOC_SIZE) {
+        size <<= 1;
+    }
+    if (size < count) {
+        size = ((count + RWSCAN_ALLOC_SIZE - 1) / RWSCAN_ALLOC_SIZE
+                * RWSCAN_ALLOC_SIZE);
+    }
+    return size;
+}
+
+
+/*
+ *  flows = pool_flows_get(capacity);
+ *
+ *    Return a buffer of 'capacity' flows, which should be a value
+ *    returned by pool_flows_capacity().  Return NULL on allocation
+ *    failure.
+ */
+rwscan_flow_t *
+pool_flows_get(
+    uint32_t            capacity)
+{
+    pool_item_t *item = NULL;
+    int cls;
+
+    cls = pool_class(capacity);
+    if (cls != -1) {
+        pthread_mutex_lock(&pool_mutex);
+        item = pool_flows[cls];
+        if (item != NULL) {
+            pool_flows[cls] = item->next;
+            pool_flows_bytes -= capacity * sizeof(rwscan_flow_t);
+        }
+        pthread_mutex_unlock(&pool_mutex);
+    }
+    if (item == NULL) {
+        return (rwscan_flow_t*)malloc(capacity * sizeof(rwscan_flow_t));
+    }
+    return (rwscan_flow_t*)item;
+}
+
+
+/*
+ *  pool_flows_put(flows, capacity);
+ *
+ *    Return the buffer 'flows' of 'capacity' flows to the pool, or
+ *    free it if it is not in a size class or the pool is full.
+ *    'flows' may be NULL.
+ */
+void
+pool_flows_put(
+    rwscan_flow_t      *flows,
+    uint32_t            capacity)
+{
+    pool_item_t *item = (pool_item_t*)flows;
+    size_t bytes = capacity * sizeof(rwscan_flow_t);
+    int cls;
+
+    if (flows == NULL) {
+        return;
+    }
+    cls = pool_class(capacity);
+    if (cls != -1) {
+        pthread_mutex_lock(&pool_mutex);
+        if (pool_flows_bytes + bytes <= POOL_MAX_CACHED_BYTES) {
+            item->next = pool_flows[cls];
+            pool_flows[cls] = item;
+            pool_flows_bytes += bytes;
+            item = NULL;
+        }
+        pthread_mutex_unlock(&pool_mutex);
+    }
+    free(item);
+}
+
+
+/*
+ *  flows = pool_flows_grow(flows, count, &capacity);
+ *
+ *    Move the 'count' flows in 'flows', a buffer of 'capacity' flows,
+ *    to the next larger buffer and return the old buffer to the pool.
+ *    Update 'capacity' and return the new buffer, or return NULL and
+ *    leave 'flows' unchanged on allocation failure.
+ */
+rwscan_flow_t *
+pool_flows_grow(
+    rwscan_flow_t      *flows,
+    uint32_t            count,
+    uint32_t           *capacity)
+{
+    rwscan_flow_t *new_flows;
+    uint32_t new_capacity;
+
+    new_capacity = pool_flows_capacity(*capacity + 1);
+    if (pool_class(*capacity) == -1 && pool_class(new_capacity) == -1) {
+        /* neither buffer is pooled; let realloc() avoid the copy */
+        new_flows = (rwscan_flow_t*)realloc(
+            flows, new_capacity * sizeof(rwscan_flow_t));
+        if (new_flows != NULL) {
+            *capacity = new_capacity;
+        }
+        return new_flows;
+    }
+
+    new_flows = pool_flows_get(new_capacity);
+    if (new_flows == NULL) {
+        return NULL;
+    }
+    if (count) {
+        memcpy(new_flows, flows, count * sizeof(rwscan_flow_t));
+    }
+    pool_flows_put(flows, *capacity);
+    *capacity = new_capacity;
+    return new_flows;
+}
+
+
+/*
+ *  metrics = pool_metrics_get();
+ *
+ *    Return an event_metrics_t from the calling thread's free list.
+ *    The contents are undefined.  Return NULL on allocation failure.
+ */
+event_metrics_t *
+pool_metrics_get(
+    void)
+{
+    pool_cache_t *c = pool_cache_get();
+
+    if (c == NULL) {
+        return (event_metrics_t*)malloc(sizeof(event_metrics_t));
+    }
+    return (event_metrics_t*)pool_list_get(&c->metrics, &pool_shared.metrics,
+                                           sizeof(event_metrics_t));
+}
+
+
+/*
+ *  pool_metrics_put(metrics);
+ *
+ *    Return 'metrics' to the calling thread's free list.  'metrics'
+ *    may be NULL.
+ */
+void
+pool_metrics_put(
+    event_metrics_t    *metrics)
+{
+    pool_cache_t *c;
+
+    if (metrics == NULL) {
+        return;
+    }
+    c = pool_cache_get();
+    if (c == NULL) {
+        free(metrics);
+        return;
+    }
+    pool_list_put(&c->metrics, &pool_shared.metrics, metrics);
+}
+
+
+/*
+ *  work = pool_work_get();
+ *
+ *    Return a zeroed worker_thread_data_t from the calling thread's
+ *    free list.  Return NULL on allocation failure.
+ */
+worker_thread_data_t *
+pool_work_get(
+    void)
+{
+    pool_cache_t *c = pool_cache_get();
+    worker_thread_data_t *work;
+
+    if (c == NULL) {
+        work = (worker_thread_data_t*)malloc(sizeof(worker_thread_data_t));
+    } else {
+        work = (worker_thread_data_t*)pool_list_get(
+            &c->work, &pool_shared.work, sizeof(worker_thread_data_t));
+    }
+    if (work != NULL) {
+        memset(work, 0, sizeof(worker_thread_data_t));
+    }
+    return work;
+}
+
+
+/*
+ *  pool_work_put(work);
+ *
+ *    Return 'work' to the calling thread's free list.  The buffers it
+ *    references are not released.  'work' may be NULL.
+ */
+void
+pool_work_put(
+    worker_thread_data_t   *work)
+{
+    pool_cache_t *c;
+
+    if (work == NULL) {
+        return;
+    }
+    c = pool_cache_get();
+    if (c == NULL) {
+        free(work);
+        return;
+    }
+    pool_list_put(&c->work, &pool_shared.work, work);
+}
+
+
+/*
+ *  batch = pool_batch_get();
+ *
+ *    Return an empty batch for small events, with its 'flows',
+ *    'metrics', and 'offsets' arrays set and its node size set to the
+ *    bytes the batch holds.  Return NULL on allocation failure.
+ */
+worker_thread_data_t *
+pool_batch_get(
+    void)
+{
+    worker_thread_data_t *batch;
+
+    pthread_mutex_lock(&pool_mutex);
+    batch = (worker_thread_data_t*)pool_batches.head;
+    if (batch != NULL) {
+        pool_batches.head = pool_batches.head->next;
+        --pool_batches.count;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (batch == NULL) {
+        batch = (worker_thread_data_t*)malloc(POOL_BATCH_BYTES);
+        if (batch == NULL) {
+            return NULL;
+        }
+    }
+    memset(batch, 0, sizeof(worker_thread_data_t));
+    batch->metrics  = (event_metrics_t*)(batch + 1);
+    batch->flows    = (rwscan_flow_t*)(batch->metrics + RWSCAN_BATCH_EVENTS);
+    batch->offsets  = (uint32_t*)(batch->flows + RWSCAN_BATCH_FLOWS);
+    batch->capacity = RWSCAN_BATCH_FLOWS;
+    batch->offsets[0] = 0;
+    batch->node.size = POOL_BATCH_BYTES;
+    return batch;
+}
+
+
+/*
+ *  pool_batch_put(batch);
+ *
+ *    Return 'batch' to the free list of batches, or free it when the
+ *    list is full.  'batch' may be NULL.
+ */
+void
+pool_batch_put(
+    worker_thread_data_t   *batch)
+{
+    pool_item_t *item = (pool_item_t*)batch;
+
+    if (batch == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool_mutex);
+    if (pool_batches.count < POOL_MAX_CACHED_BATCHES) {
+        item->next = pool_batches.head;
+        pool_batches.head = item;
+        ++pool_batches.count;
+        item = NULL;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    free(item);
+}
+
+
+/*
+** Local Variables:
+** mode:c
+** indent-tabs-mode:nil
+** c-basic-offset:4
+** End:
+*/
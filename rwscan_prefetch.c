@@ -0,0 +1,249 @@
+/*
+** Copyright (C) 2006-2019 by Carnegie Mellon University.
+**
+** @OPENSOURCE_LICENSE_START@
+** See license information in ../../LICENSE.txt
+** @OPENSOURCE_LICENSE_END@
+*/
+
+/*
+ *  rwscan_prefetch.c
+ *
+ *    Read input files ahead of the reader threads.
+ *
+ *    When --prefetch-files is given, a pool of threads reads the
+ *    input files that the reader threads will open next, in large
+ *    chunks, so that the files are in the page cache by the time
+ *    skstream reads them.  On network file systems this overlaps the
+ *    latency of the reads with the decoding and assembly of the
+ *    current files.  Each prefetch thread works on one file at a time
+ *    and stays at most --prefetch-files files ahead of the readers.
+ */
+
+#include <silk/silk.h>
+
+RCSIDENT("$SiLK: rwscan_prefetch.c 945cf5167607 2019-01-07 18:54:17Z mthomas $");
+
+#include "rwscan.h"
+
+
+/* LOCAL DEFINES AND TYPEDEFS */
+
+/* size of each read made by a prefetch thread */
+#define PREFETCH_CHUNK_SIZE  (1 << 20)
+
+
+/* LOCAL VARIABLE DEFINITIONS */
+
+/* the input ranges to prefetch, shared with the reader threads */
+static const input_range_t *prefetch_ranges = NULL;
+static size_t prefetch_ranges_count = 0;
+
+/* index of the next range to prefetch and of the next range the
+ * readers will take */
+static size_t prefetch_next = 0;
+static size_t prefetch_reader_next = 0;
+
+/* set when the prefetch threads should exit */
+static volatile int prefetch_stopping = 0;
+
+/* protects the indexes above; signaled when the readers advance or
+ * when the threads should stop */
+static pthread_mutex_t prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+
+static pthread_t *prefetch_tids = NULL;
+static uint32_t prefetch_tids_count = 0;
+
+
+/* FUNCTION DEFINITIONS */
+
+/*
+ *  prefetch_file(path, buf);
+ *
+ *    Read the file 'path' into the page cache, using 'buf' of
+ *    PREFETCH_CHUNK_SIZE bytes as scratch space.  Stop early when the
+ *    prefetch threads are stopping.  Errors are ignored; the reader
+ *    reports them when it opens the file.
+ */
+static void
+prefetch_file(
+    const char         *path,
+    uint8_t            *buf)
+{
+    off_t offset = 0;
+    ssize_t len;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+#if defined(POSIX_FADV_WILLNEED)
+    /* ask for the whole file to be read ahead, then read it in large
+     * chunks so that network file systems fetch it now */
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+    while (!prefetch_stopping) {
+        len = pread(fd, buf, PREFETCH_CHUNK_SIZE, offset);
+        if (len <= 0) {
+            if (len == -1 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        offset += len;
+    }
+    close(fd);
+}
+
+
+/*  THREAD ENTRY POINT  */
+static void *
+prefetch_thread(
+    void        UNUSED(*myarg))
+{
+    const input_range_t *range;
+    uint8_t *buf;
+
+    /* ignore all signals */
+    skthread_ignore_signals();
+
+    buf = (uint8_t*)malloc(PREFETCH_CHUNK_SIZE);
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&prefetch_mutex);
+    for (;;) {
+        /* skip ranges the readers have already taken, and split
+         * ranges after the first, since the whole file is read */
+        while (prefetch_next < prefetch_ranges_count
+               && (prefetch_next < prefetch_reader_next
+                   || prefetch_ranges[prefetch_next].start > 0))
+        {
+            ++prefetch_next;
+        }
+        if (prefetch_stopping || prefetch_next >= prefetch_ranges_count) {
+            break;
+        }
+        if (prefetch_next >= prefetch_reader_next + options.prefetch_files) {
+            pthread_cond_wait(&prefetch_cond, &prefetch_mutex);
+            continue;
+        }
+        range = &prefetch_ranges[prefetch_next++];
+        pthread_mutex_unlock(&prefetch_mutex);
+
+        prefetch_file(range->path, buf);
+
+        pthread_mutex_lock(&prefetch_mutex);
+    }
+    pthread_mutex_unlock(&prefetch_mutex);
+
+    free(buf);
+    return NULL;
+}
+
+
+/*
+ *  status = prefetch_start(ranges, count);
+ *
+ *    Start the prefetch threads, which read the files of the 'count'
+ *    input ranges in 'ranges' ahead of the reader threads.  'ranges'
+ *    must remain valid until prefetch_stop() is called.  Return 0 on
+ *    success or -1 on failure.
+ */
+int
+prefetch_start(
+    const input_range_t    *ranges,
+    size_t                  count)
+{
+    uint32_t threads;
+
+    if (options.prefetch_files == 0) {
+        return 0;
+    }
+
+    prefetch_ranges = ranges;
+    prefetch_ranges_count = count;
+    prefetch_next = 0;
+    prefetch_reader_next = 0;
+    prefetch_stopping = 0;
+
+    threads = options.prefetch_files;
+    if (threads > count) {
+        threads = count;
+    }
+    prefetch_tids = (pthread_t*)malloc(threads * sizeof(pthread_t));
+    if (prefetch_tids == NULL) {
+        skAppPrintOutOfMemory("prefetch threads");
+        return -1;
+    }
+    for (prefetch_tids_count = 0; prefetch_tids_count < threads;
+         ++prefetch_tids_count)
+    {
+        if (pthread_create(&prefetch_tids[prefetch_tids_count], NULL,
+                           prefetch_thread, NULL))
+        {
+            skAppPrintErr("Unable to create prefetch thread");
+            prefetch_stop();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ *  prefetch_advance(reader_next);
+ *
+ *    Tell the prefetch threads that the readers have taken every
+ *    range before index 'reader_next'.
+ */
+void
+prefetch_advance(
+    size_t              reader_next)
+{
+    if (prefetch_tids_count == 0) {
+        return;
+    }
+    pthread_mutex_lock(&prefetch_mutex);
+    prefetch_reader_next = reader_next;
+    pthread_cond_broadcast(&prefetch_cond);
+    pthread_mutex_unlock(&prefetch_mutex);
+}
+
+
+/*
+ *  prefetch_stop();
+ *
+ *    Stop and join the prefetch threads.
+ */
+void
+prefetch_stop(
+    void)
+{
+    uint32_t i;
+
+    pthread_mutex_lock(&prefetch_mutex);
+    prefetch_stopping = 1;
+    pthread_cond_broadcast(&prefetch_cond);
+    pthread_mutex_unlock(&prefetch_mutex);
+
+    for (i = 0; i < prefetch_tids_count; ++i) {
+        pthread_join(prefetch_tids[i], NULL);
+    }
+    free(prefetch_tids);
+    prefetch_tids = NULL;
+    prefetch_tids_count = 0;
+}
+
+
+/*
+** Local Variables:
+** mode:c
+** indent-tabs-mode:nil
+** c-basic-offset:4
+** End:
+*/
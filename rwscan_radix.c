@@ -0,0 +1,396 @@
+/*
+** Copyright (C) 2006-2019 by Carnegie Mellon University.
+**
+** @OPENSOURCE_LICENSE_START@
+** See license information in ../../LICENSE.txt
+** @OPENSOURCE_LICENSE_END@
+*/
+
+/*
+ *  rwscan_radix.c
+ *
+ *    Sorting of the flows of an event.
+ *
+ *    Each order used on an event is an unsigned integer key built
+ *    from the fields of a flow, so instead of calling a comparison
+ *    function for every pair qsort() looks at, flow_sort() extracts
+ *    the key of each flow once, next to the flow's index, and sorts
+ *    these pairs with a least significant digit radix sort: one pass
+ *    over the pairs counts every byte of the keys, and each byte that
+ *    is not the same for all flows (most of the high bytes of the dips
+ *    of an event are) takes one more pass.  Small events are sorted
+ *    by insertion.  The flows are then moved into the order of the
+ *    sorted pairs.
+ *
+ *    The sort is stable: flows with the same key keep their order.
+ *
+ *    The order on every field that puts the flows of unsorted input
+ *    in the order of sorted input does not fit a key; flow_sort()
+ *    sorts by it with qsort(), which is safe since no two flows that
+ *    differ compare equal.
+ *
+ *    Many events hold far fewer distinct keys than flows: a source
+ *    that sends thousands of flows to a handful of servers.  For
+ *    these, flow_group() does not move the flows at all.  It counts
+ *    the flows of each key in a hash table, sorts only the distinct
+ *    keys, and lays out an index of the flows in sorted order, giving
+ *    the same sequence as flow_sort().
+ */
+
+#include <silk/silk.h>
+
+RCSIDENT("$SiLK: rwscan_radix.c 945cf5167607 2019-01-07 18:54:17Z mthomas $");
+
+#include "rwscan.h"
+
+
+/* LOCAL DEFINES AND TYPEDEFS */
+
+/* events with fewer flows than this are sorted by insertion */
+#define RADIX_MIN_FLOWS  64
+
+/* the number of bytes in a key */
+#define RADIX_KEY_BYTES  8
+
+/* flow_group() declines an event with more than one distinct key per
+ * this many flows; flow_sort() is faster for those */
+#define GROUP_MIN_FLOWS_PER_KEY  4
+
+/* the sort key of a flow and the flow's position in the event */
+typedef struct radix_pair_st {
+    uint64_t    key;
+    uint32_t    idx;
+} radix_pair_t;
+
+/* an entry in the hash table of flow_group(); 'count' is 0 for an
+ * empty slot */
+typedef struct group_slot_st {
+    uint64_t    key;
+    uint32_t    count;      /* number of flows with the key */
+    uint32_t    next;       /* next position in the index for the key */
+} group_slot_t;
+
+
+/* FUNCTION DEFINITIONS */
+
+/*
+ *  key = flow_order_key(flow, order);
+ *
+ *    Return the key of 'flow' in 'order'.  The keys order the flows
+ *    as the comparison function returned by flow_order_compare()
+ *    does.
+ */
+static uint64_t
+flow_order_key(
+    const rwscan_flow_t    *flow,
+    flow_order_t            order)
+{
+    switch (order) {
+      case FLOW_ORDER_DIP_SPORT:
+        /* the source port only orders TCP flows */
+        return (((uint64_t)flowGetDIPv4(flow) << 16)
+                | ((flowGetProto(flow) == IPPROTO_TCP)
+                   ? flowGetSPort(flow) : 0));
+      case FLOW_ORDER_FULL:
+        /* not a key; see flow_sort() */
+        break;
+    }
+    return 0;
+}
+
+
+/*
+ *  cmp = flow_order_compare(order);
+ *
+ *    Return the qsort() comparison function for 'order'.
+ */
+flow_compare_fn_t
+flow_order_compare(
+    flow_order_t        order)
+{
+    switch (order) {
+      case FLOW_ORDER_DIP_SPORT:
+        return &flow_compare_dip_sport;
+      case FLOW_ORDER_FULL:
+        return &flow_compare_sip_proto_dip;
+    }
+    skAbortBadCase(order);
+}
+
+
+/*
+ *  radix_insertion_sort(pairs, count);
+ *
+ *    Sort the 'count' entries of 'pairs' by key, keeping the order
+ *    of equal keys.
+ */
+static void
+radix_insertion_sort(
+    radix_pair_t       *pairs,
+    uint32_t            count)
+{
+    radix_pair_t tmp;
+    uint32_t i;
+    uint32_t j;
+
+    for (i = 1; i < count; ++i) {
+        tmp = pairs[i];
+        for (j = i; j > 0 && pairs[j - 1].key > tmp.key; --j) {
+            pairs[j] = pairs[j - 1];
+        }
+        pairs[j] = tmp;
+    }
+}
+
+
+/*
+ *  sorted = radix_sort(pairs, scratch, count);
+ *
+ *    Sort the 'count' entries of 'pairs' by key, keeping the order of
+ *    equal keys, using 'scratch', which has room for 'count' entries.
+ *    Return whichever of 'pairs' and 'scratch' holds the result.
+ */
+static radix_pair_t *
+radix_sort(
+    radix_pair_t       *pairs,
+    radix_pair_t       *scratch,
+    uint32_t            count)
+{
+    uint32_t counts[RADIX_KEY_BYTES][256];
+    radix_pair_t *src = pairs;
+    radix_pair_t *dst = scratch;
+    radix_pair_t *tmp;
+    uint32_t offset;
+    uint32_t n;
+    uint32_t i;
+    unsigned int b;
+    unsigned int shift;
+
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < count; ++i) {
+        for (b = 0; b < RADIX_KEY_BYTES; ++b) {
+            ++counts[b][(uint8_t)(pairs[i].key >> (8 * b))];
+        }
+    }
+
+    for (b = 0; b < RADIX_KEY_BYTES; ++b) {
+        shift = 8 * b;
+        /* skip a byte that is the same in every key */
+        if (counts[b][(uint8_t)(pairs[0].key >> shift)] == count) {
+            continue;
+        }
+        /* turn the counts into the first position of each value */
+        offset = 0;
+        for (i = 0; i < 256; ++i) {
+            n = counts[b][i];
+            counts[b][i] = offset;
+            offset += n;
+        }
+        for (i = 0; i < count; ++i) {
+            dst[counts[b][(uint8_t)(src[i].key >> shift)]++] = src[i];
+        }
+        tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+    return src;
+}
+
+
+/*
+ *  radix_permute(flows, pairs, count);
+ *
+ *    Move the 'count' flows in 'flows' into the order given by the
+ *    indexes in 'pairs', following each cycle of the permutation so
+ *    that no second buffer of flows is needed.  The indexes are
+ *    overwritten.
+ */
+static void
+radix_permute(
+    rwscan_flow_t      *flows,
+    radix_pair_t       *pairs,
+    uint32_t            count)
+{
+    rwscan_flow_t tmp;
+    uint32_t i;
+    uint32_t j;
+    uint32_t k;
+
+    for (i = 0; i < count; ++i) {
+        if (pairs[i].idx == i) {
+            continue;
+        }
+        tmp = flows[i];
+        j = i;
+        while ((k = pairs[j].idx) != i) {
+            flows[j] = flows[k];
+            pairs[j].idx = j;
+            j = k;
+        }
+        flows[j] = tmp;
+        pairs[j].idx = j;
+    }
+}
+
+
+/*
+ *  flow_sort(flows, count, order);
+ *
+ *    Sort the 'count' flows in 'flows' into 'order', keeping the
+ *    order of flows that compare equal.  When the memory for the
+ *    sort keys cannot be allocated, the flows are sorted by qsort()
+ *    instead, which may reorder equal flows.  FLOW_ORDER_FULL is
+ *    always sorted by qsort().
+ */
+void
+flow_sort(
+    rwscan_flow_t      *flows,
+    uint32_t            count,
+    flow_order_t        order)
+{
+    radix_pair_t small[RADIX_MIN_FLOWS];
+    radix_pair_t *pairs;
+    radix_pair_t *sorted;
+    uint32_t i;
+
+    if (count < 2) {
+        return;
+    }
+    if (order == FLOW_ORDER_FULL) {
+        qsort(flows, count, sizeof(rwscan_flow_t), flow_order_compare(order));
+        return;
+    }
+    if (count < RADIX_MIN_FLOWS) {
+        for (i = 0; i < count; ++i) {
+            small[i].key = flow_order_key(&flows[i], order);
+            small[i].idx = i;
+        }
+        radix_insertion_sort(small, count);
+        radix_permute(flows, small, count);
+        return;
+    }
+
+    pairs = (radix_pair_t*)malloc(2 * (size_t)count * sizeof(radix_pair_t));
+    if (pairs == NULL) {
+        qsort(flows, count, sizeof(rwscan_flow_t), flow_order_compare(order));
+        return;
+    }
+    for (i = 0; i < count; ++i) {
+        pairs[i].key = flow_order_key(&flows[i], order);
+        pairs[i].idx = i;
+    }
+    sorted = radix_sort(pairs, pairs + count, count);
+    radix_permute(flows, sorted, count);
+    free(pairs);
+}
+
+
+/*
+ *  index = flow_group(flows, count, order);
+ *
+ *    Return an array holding the positions in 'flows' of its 'count'
+ *    flows in 'order', equal flows in the order they appear in
+ *    'flows', without moving the flows.  The caller must free() the
+ *    array.  Return NULL when the event has too many distinct keys for
+ *    grouping to be faster than flow_sort(), or on allocation failure.
+ */
+uint32_t *
+flow_group(
+    const rwscan_flow_t    *flows,
+    uint32_t                count,
+    flow_order_t            order)
+{
+    group_slot_t *table = NULL;
+    radix_pair_t *pairs = NULL;
+    radix_pair_t *sorted;
+    uint32_t *slot_of = NULL;
+    uint32_t *index = NULL;
+    uint32_t max_keys;
+    uint32_t keys = 0;
+    uint32_t offset;
+    uint32_t mask;
+    uint32_t bits;
+    uint32_t h;
+    uint32_t i;
+    uint64_t key;
+
+    max_keys = count / GROUP_MIN_FLOWS_PER_KEY;
+    if (max_keys == 0) {
+        return NULL;
+    }
+    /* keep the table at most half full */
+    for (bits = 1; ((uint32_t)1 << bits) < 2 * max_keys; ++bits)
+        ; /* empty */
+    mask = ((uint32_t)1 << bits) - 1;
+
+    table = (group_slot_t*)calloc((size_t)mask + 1, sizeof(group_slot_t));
+    slot_of = (uint32_t*)malloc((size_t)count * sizeof(uint32_t));
+    if (table == NULL || slot_of == NULL) {
+        goto END;
+    }
+
+    /* count the flows of each key */
+    for (i = 0; i < count; ++i) {
+        key = flow_order_key(&flows[i], order);
+        h = (uint32_t)((key * UINT64_C(0x9E3779B97F4A7C15)) >> (64 - bits));
+        while (table[h].count && table[h].key != key) {
+            h = (h + 1) & mask;
+        }
+        if (table[h].count == 0) {
+            if (keys == max_keys) {
+                goto END;
+            }
+            table[h].key = key;
+            ++keys;
+        }
+        ++table[h].count;
+        slot_of[i] = h;
+    }
+
+    /* sort the distinct keys and give each its range of the index */
+    pairs = (radix_pair_t*)malloc(2 * (size_t)keys * sizeof(radix_pair_t));
+    index = (uint32_t*)malloc((size_t)count * sizeof(uint32_t));
+    if (pairs == NULL || index == NULL) {
+        free(index);
+        index = NULL;
+        goto END;
+    }
+    keys = 0;
+    for (h = 0; h <= mask; ++h) {
+        if (table[h].count) {
+            pairs[keys].key = table[h].key;
+            pairs[keys].idx = h;
+            ++keys;
+        }
+    }
+    if (keys < RADIX_MIN_FLOWS) {
+        radix_insertion_sort(pairs, keys);
+        sorted = pairs;
+    } else {
+        sorted = radix_sort(pairs, pairs + keys, keys);
+    }
+    offset = 0;
+    for (i = 0; i < keys; ++i) {
+        table[sorted[i].idx].next = offset;
+        offset += table[sorted[i].idx].count;
+    }
+
+    /* place each flow, in order, in the range of its key */
+    for (i = 0; i < count; ++i) {
+        index[table[slot_of[i]].next++] = i;
+    }
+
+  END:
+    free(table);
+    free(slot_of);
+    free(pairs);
+    return index;
+}
+
+/*
+** Local Variables:
+** mode:c
+** indent-tabs-mode:nil
+** c-basic-offset:4
+** End:
+*/
@@ -0,0 +1,353 @@
+/*
+** Copyright (C) 2006-2019 by Carnegie Mellon University.
+**
+** @OPENSOURCE_LICENSE_START@
+** See license information in ../../LICENSE.txt
+** @OPENSOURCE_LICENSE_END@
+*/
+
+/*
+ *  rwscan_repo.c
+ *
+ *    Select the input files from the SiLK data repository.
+ *
+ *    When any of --start-date, --end-date, --class, --type, or
+ *    --sensors is given, rwscan reads the hourly files that match the
+ *    selection directly instead of reading records produced by
+ *    rwfilter and rwsort.  The files are in time order, so the
+ *    records are grouped (or sorted) by rwscan as with
+ *    --unsorted-input.
+ */
+
+#include <silk/silk.h>
+
+RCSIDENT("$SiLK: rwscan_repo.c 945cf5167607 2019-01-07 18:54:17Z mthomas $");
+
+#include "rwscan.h"
+
+
+/* LOCAL DEFINES AND TYPEDEFS */
+
+/* milliseconds in an hour and in a day */
+#define REPO_MSEC_HOUR  ((sktime_t)3600 * 1000)
+#define REPO_MSEC_DAY   (24 * REPO_MSEC_HOUR)
+
+
+/* LOCAL VARIABLE DEFINITIONS */
+
+/* the iterator over the selected files */
+static sksite_repo_iter_t *repo_iter = NULL;
+
+
+/* FUNCTION DEFINITIONS */
+
+/*
+ *  status = repo_parse_times(&start_time, &end_time);
+ *
+ *    Set 'start_time' and 'end_time' to the first and last hours to
+ *    read, as given by --start-date and --end-date.  When neither is
+ *    given, every hour of the current day is read.  When a date has
+ *    only day precision, it covers every hour of that day.  Return 0
+ *    on success or -1 on failure.
+ */
+static int
+repo_parse_times(
+    sktime_t           *start_time,
+    sktime_t           *end_time)
+{
+    unsigned int start_precision = SK_PARSED_DATETIME_DAY;
+    unsigned int end_precision;
+    int rv;
+
+    if (options.start_date == NULL) {
+        if (options.end_date) {
+            skAppPrintErr("Cannot use --end-date without --start-date");
+            return -1;
+        }
+        *start_time = sktimeCreate(time(NULL), 0);
+    } else {
+        rv = skStringParseDatetime(start_time, options.start_date,
+                                   &start_precision);
+        if (rv) {
+            skAppPrintErr("Invalid start-date '%s': %s",
+                          options.start_date, skStringParseStrerror(rv));
+            return -1;
+        }
+        start_precision = SK_PARSED_DATETIME_GET_PRECISION(start_precision);
+    }
+
+    if (start_precision == SK_PARSED_DATETIME_DAY) {
+        *start_time -= *start_time % REPO_MSEC_DAY;
+    } else {
+        *start_time -= *start_time % REPO_MSEC_HOUR;
+    }
+
+    if (options.end_date == NULL) {
+        *end_time = *start_time;
+        end_precision = start_precision;
+    } else {
+        rv = skStringParseDatetime(end_time, options.end_date,
+                                   &end_precision);
+        if (rv) {
+            skAppPrintErr("Invalid end-date '%s': %s",
+                          options.end_date, skStringParseStrerror(rv));
+            return -1;
+        }
+        end_precision = SK_PARSED_DATETIME_GET_PRECISION(end_precision);
+    }
+
+    if (end_precision == SK_PARSED_DATETIME_DAY) {
+        *end_time += REPO_MSEC_DAY - 1 - (*end_time % REPO_MSEC_DAY);
+    }
+    *end_time -= *end_time % REPO_MSEC_HOUR;
+
+    if (*end_time < *start_time) {
+        skAppPrintErr("The end-date is earlier than the start-date");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ *  status = repo_parse_flowtypes(flowtypes, &class_id);
+ *
+ *    Append to the vector 'flowtypes' the flowtypes named by --class
+ *    and --type, and set 'class_id' to the class.  The class defaults
+ *    to the site's default class, and the types default to that
+ *    class's default types; the type "all" selects every type in the
+ *    class.  Return 0 on success or -1 on failure.
+ */
+static int
+repo_parse_flowtypes(
+    sk_vector_t        *flowtypes,
+    sk_class_id_t      *class_id)
+{
+    sk_flowtype_iter_t ft_iter;
+    sk_flowtype_id_t ft;
+    char class_name[SK_MAX_STRLEN_FLOWTYPE+1];
+    char *type_list = NULL;
+    char *type_name;
+    char *cp;
+    int retval = -1;
+
+    if (options.class_name) {
+        *class_id = sksiteClassLookup(options.class_name);
+        if (*class_id == SK_INVALID_CLASS) {
+            skAppPrintErr("Invalid class '%s'", options.class_name);
+            return -1;
+        }
+    } else {
+        *class_id = sksiteClassGetDefault();
+        if (*class_id == SK_INVALID_CLASS) {
+            skAppPrintErr("No --class given and site has no default class");
+            return -1;
+        }
+    }
+
+    if (options.type_names == NULL || 0 == strcmp(options.type_names, "all")) {
+        if (options.type_names) {
+            sksiteClassFlowtypeIterator(*class_id, &ft_iter);
+        } else {
+            sksiteClassDefaultFlowtypeIterator(*class_id, &ft_iter);
+        }
+        while (sksiteFlowtypeIteratorNext(&ft_iter, &ft)) {
+            if (skVectorAppendValue(flowtypes, &ft)) {
+                skAppPrintOutOfMemory("flowtype list");
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    sksiteClassGetName(class_name, sizeof(class_name), *class_id);
+    type_list = strdup(options.type_names);
+    if (type_list == NULL) {
+        skAppPrintOutOfMemory("type list");
+        return -1;
+    }
+    cp = type_list;
+    while ((type_name = strsep(&cp, ",")) != NULL) {
+        if ('\0' == *type_name) {
+            continue;
+        }
+        ft = sksiteFlowtypeLookupByClassType(class_name, type_name);
+        if (ft == SK_INVALID_FLOWTYPE) {
+            skAppPrintErr("Invalid type '%s' for class '%s'",
+                          type_name, class_name);
+            goto END;
+        }
+        if (skVectorAppendValue(flowtypes, &ft)) {
+            skAppPrintOutOfMemory("flowtype list");
+            goto END;
+        }
+    }
+    retval = 0;
+
+  END:
+    free(type_list);
+    return retval;
+}
+
+
+/*
+ *  status = repo_parse_sensors(sensors, class_id);
+ *
+ *    Append to the vector 'sensors' the sensors named by --sensors,
+ *    which is a comma separated list of sensor names or numbers that
+ *    must belong to the class 'class_id'.  Return 0 on success or -1
+ *    on failure.
+ */
+static int
+repo_parse_sensors(
+    sk_vector_t        *sensors,
+    sk_class_id_t       class_id)
+{
+    sk_sensor_id_t sid;
+    uint32_t tmp32;
+    char *sensor_list;
+    char *sensor_name;
+    char *cp;
+    int retval = -1;
+
+    sensor_list = strdup(options.sensor_names);
+    if (sensor_list == NULL) {
+        skAppPrintOutOfMemory("sensor list");
+        return -1;
+    }
+    cp = sensor_list;
+    while ((sensor_name = strsep(&cp, ",")) != NULL) {
+        if ('\0' == *sensor_name) {
+            continue;
+        }
+        sid = sksiteSensorLookup(sensor_name);
+        if (sid == SK_INVALID_SENSOR
+            && 0 == skStringParseUint32(&tmp32, sensor_name, 0,
+                                        SK_INVALID_SENSOR - 1)
+            && sksiteSensorExists((sk_sensor_id_t)tmp32))
+        {
+            sid = (sk_sensor_id_t)tmp32;
+        }
+        if (sid == SK_INVALID_SENSOR) {
+            skAppPrintErr("Invalid sensor '%s'", sensor_name);
+            goto END;
+        }
+        if (!sksiteIsSensorInClass(sid, class_id)) {
+            skAppPrintErr("Sensor '%s' is not in the selected class",
+                          sensor_name);
+            goto END;
+        }
+        if (skVectorAppendValue(sensors, &sid)) {
+            skAppPrintOutOfMemory("sensor list");
+            goto END;
+        }
+    }
+    retval = 0;
+
+  END:
+    free(sensor_list);
+    return retval;
+}
+
+
+/*
+ *  status = repo_selection_setup();
+ *
+ *    Parse the file selection switches and create the iterator over
+ *    the repository files they select.  Return 0 on success or -1 on
+ *    failure.
+ */
+int
+repo_selection_setup(
+    void)
+{
+    sk_vector_t *flowtypes = NULL;
+    sk_vector_t *sensors = NULL;
+    sk_class_id_t class_id;
+    sktime_t start_time;
+    sktime_t end_time;
+    int retval = -1;
+
+    if (sksiteConfigure(1)) {
+        return -1;
+    }
+
+    flowtypes = skVectorNew(sizeof(sk_flowtype_id_t));
+    sensors = skVectorNew(sizeof(sk_sensor_id_t));
+    if (flowtypes == NULL || sensors == NULL) {
+        skAppPrintOutOfMemory("file selection");
+        goto END;
+    }
+
+    if (repo_parse_times(&start_time, &end_time)
+        || repo_parse_flowtypes(flowtypes, &class_id)
+        || (options.sensor_names && repo_parse_sensors(sensors, class_id)))
+    {
+        goto END;
+    }
+
+    if (sksiteRepoIteratorCreate(&repo_iter, flowtypes,
+                                 (skVectorGetCount(sensors) ? sensors : NULL),
+                                 start_time, end_time, 0))
+    {
+        skAppPrintErr("Unable to create repository iterator");
+        goto END;
+    }
+    retval = 0;
+
+  END:
+    if (flowtypes) {
+        skVectorDestroy(flowtypes);
+    }
+    if (sensors) {
+        skVectorDestroy(sensors);
+    }
+    return retval;
+}
+
+
+/*
+ *  status = repo_next_path(path, path_len);
+ *
+ *    Fill 'path', a buffer of 'path_len' bytes, with the name of the
+ *    next repository file to read.  Return 0 on success or non-zero
+ *    when there are no more files.
+ */
+int
+repo_next_path(
+    char               *path,
+    size_t              path_len)
+{
+    int is_missing;
+
+    if (repo_iter == NULL) {
+        return -1;
+    }
+    return (SK_ITERATOR_OK != sksiteRepoIteratorNextPath(repo_iter, path,
+                                                         path_len,
+                                                         &is_missing));
+}
+
+
+/*
+ *  repo_selection_teardown();
+ *
+ *    Destroy the iterator over the repository files.
+ */
+void
+repo_selection_teardown(
+    void)
+{
+    if (repo_iter) {
+        sksiteRepoIteratorDestroy(&repo_iter);
+    }
+}
+
+
+/*
+** Local Variables:
+** mode:c
+** indent-tabs-mode:nil
+** c-basic-offset:4
+** End:
+*/
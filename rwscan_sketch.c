@@ -0,0 +1,567 @@
+/*
+** Copyright (C) 2006-2019 by Carnegie Mellon University.
+**
+** @OPENSOURCE_LICENSE_START@
+** See license information in ../../LICENSE.txt
+** @OPENSOURCE_LICENSE_END@
+*/
+
+/*
+ *  rwscan_sketch.c
+ *
+ *    Fixed-memory estimates of the BLR features of very large events.
+ *
+ *    The exact BLR features are found by sorting the event by dip and
+ *    sport and comparing each flow to the next.  When --sketch-events
+ *    is given, an event with at least that many flows is instead read
+ *    once, in any order, into the sketches below, whose size does not
+ *    depend on the size of the event:
+ *
+ *    --  the number of distinct dips and of distinct (dip, dport)
+ *        pairs are estimated with HyperLogLog counters;
+ *
+ *    --  the source ports sent to the largest dip are kept in a
+ *        bitmap, as are all the source ports for UDP;
+ *
+ *    --  the dips of each /24 the source touches are kept in a 256
+ *        bit map, and the low (below 1024) ports of each dip in a 1024
+ *        bit map.  These maps are held in small direct-mapped caches;
+ *        when two /24s or dips want the same slot, the older map is
+ *        folded into the running maxima and replaced;
+ *
+ *    --  for ICMP, the /24s touched are kept in a bitmap of every /24.
+ *
+ *    The estimates are written to the same event_metrics_t members as
+ *    the exact calculations and scored by the existing
+ *    calculate_*_scan_probability() functions.
+ */
+
+#include <silk/silk.h>
+
+RCSIDENT("$SiLK: rwscan_sketch.c 945cf5167607 2019-01-07 18:54:17Z mthomas $");
+
+#include "rwscan.h"
+
+
+/* LOCAL DEFINES AND TYPEDEFS */
+
+/* number of index bits of the HyperLogLog counters; the standard
+ * error of the estimate is about 1.04 / sqrt(1 << SKETCH_HLL_BITS) */
+#define SKETCH_HLL_BITS       14
+#define SKETCH_HLL_REGISTERS  (1 << SKETCH_HLL_BITS)
+
+/* number of slots in the caches of /24 and low port maps */
+#define SKETCH_SUBNET_SLOTS   4096
+#define SKETCH_LOWPORT_SLOTS  1024
+
+/* number of 32 bit words in the dip map of a /24 and in the low port
+ * map of a dip */
+#define SKETCH_SUBNET_WORDS   (256 / 32)
+#define SKETCH_LOWPORT_WORDS  (1024 / 32)
+
+/* the dips of one /24 */
+typedef struct sketch_subnet_st {
+    uint32_t    class_c;
+    uint32_t    in_use;
+    uint32_t    bits[SKETCH_SUBNET_WORDS];
+} sketch_subnet_t;
+
+/* the low destination ports of one dip */
+typedef struct sketch_lowport_st {
+    uint32_t    dip;
+    uint32_t    in_use;
+    uint32_t    bits[SKETCH_LOWPORT_WORDS];
+} sketch_lowport_t;
+
+struct event_sketch_st {
+    uint8_t             proto;
+    uint64_t            flows;
+
+    /* distinct dips and distinct (dip, dport) pairs */
+    uint8_t             hll_dips[SKETCH_HLL_REGISTERS];
+    uint8_t             hll_dsts[SKETCH_HLL_REGISTERS];
+
+    /* the source ports sent to the largest dip seen so far */
+    uint32_t            max_dip;
+    sk_bitmap_t        *max_dip_sports;
+
+    /* UDP: every source port */
+    sk_bitmap_t        *sports;
+
+    /* UDP and ICMP: the dips of each /24 */
+    sketch_subnet_t    *subnets;
+    uint32_t            max_subnet_run;
+    uint32_t            max_subnet_count;
+
+    /* UDP: the low ports of each dip */
+    sketch_lowport_t   *lowports;
+    uint32_t            max_low_dp_hit;
+    uint32_t            max_low_port_run;
+
+    /* ICMP: every /24 */
+    sk_bitmap_t        *class_cs;
+    uint32_t            min_class_c;
+    uint32_t            max_class_c;
+};
+
+
+/* FUNCTION DEFINITIONS */
+
+/*
+ *  hash = sketch_hash(key);
+ *
+ *    Return a 64 bit hash of 'key' whose bits are well mixed.
+ */
+static uint64_t
+sketch_hash(
+    uint64_t            key)
+{
+    key ^= key >> 33;
+    key *= UINT64_C(0xff51afd7ed558ccd);
+    key ^= key >> 33;
+    key *= UINT64_C(0xc4ceb9fe1a85ec53);
+    key ^= key >> 33;
+    return key;
+}
+
+
+/*
+ *  sketch_hll_add(registers, key);
+ *
+ *    Add 'key' to the HyperLogLog counter whose registers are
+ *    'registers'.
+ */
+static void
+sketch_hll_add(
+    uint8_t            *registers,
+    uint64_t            key)
+{
+    uint64_t hash = sketch_hash(key);
+    uint32_t idx = (uint32_t)(hash >> (64 - SKETCH_HLL_BITS));
+    uint8_t rank = 1;
+
+    /* the rank is the position of the first 1 bit after the index */
+    hash <<= SKETCH_HLL_BITS;
+    while (rank <= (64 - SKETCH_HLL_BITS) && !(hash & UINT64_C(1) << 63)) {
+        hash <<= 1;
+        ++rank;
+    }
+    if (rank > registers[idx]) {
+        registers[idx] = rank;
+    }
+}
+
+
+/*
+ *  estimate = sketch_hll_estimate(registers, limit);
+ *
+ *    Return the estimated number of distinct keys added to the
+ *    HyperLogLog counter whose registers are 'registers', but no more
+ *    than 'limit'.
+ */
+static uint32_t
+sketch_hll_estimate(
+    const uint8_t      *registers,
+    uint64_t            limit)
+{
+    const double m = SKETCH_HLL_REGISTERS;
+    double sum = 0.0;
+    double estimate;
+    uint32_t zeros = 0;
+    uint32_t i;
+
+    for (i = 0; i < SKETCH_HLL_REGISTERS; ++i) {
+        sum += ldexp(1.0, -(int)registers[i]);
+        zeros += (registers[i] == 0);
+    }
+    estimate = (0.7213 / (1.0 + 1.079 / m)) * m * m / sum;
+    if (estimate <= 2.5 * m && zeros > 0) {
+        /* use linear counting for small cardinalities */
+        estimate = m * log(m / zeros);
+    }
+    estimate = floor(estimate + 0.5);
+    if (estimate > (double)limit) {
+        return (uint32_t)limit;
+    }
+    if (estimate < 1.0) {
+        return 1;
+    }
+    return (uint32_t)estimate;
+}
+
+
+/*
+ *  count = sketch_bits_count(bits, words);
+ *
+ *    Return the number of bits set in the 'words' words at 'bits'.
+ */
+static uint32_t
+sketch_bits_count(
+    const uint32_t     *bits,
+    uint32_t            words)
+{
+    uint32_t count = 0;
+    uint32_t v;
+    uint32_t i;
+
+    for (i = 0; i < words; ++i) {
+        for (v = bits[i]; v; v &= v - 1) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+
+/*
+ *  run = sketch_bits_longest_run(bits, words);
+ *
+ *    Return the length of the longest run of consecutive bits set in
+ *    the 'words' words at 'bits'.
+ */
+static uint32_t
+sketch_bits_longest_run(
+    const uint32_t     *bits,
+    uint32_t            words)
+{
+    uint32_t run = 0;
+    uint32_t longest = 0;
+    uint32_t i;
+
+    for (i = 0; i < 32 * words; ++i) {
+        if (bits[i >> 5] & (UINT32_C(1) << (i & 0x1F))) {
+            if (++run > longest) {
+                longest = run;
+            }
+        } else {
+            run = 0;
+        }
+    }
+    return longest;
+}
+
+
+/*
+ *  sketch_subnet_fold(sketch, subnet);
+ *
+ *    Add the dips of the /24 in 'subnet' to the maxima in 'sketch'.
+ */
+static void
+sketch_subnet_fold(
+    event_sketch_t         *sketch,
+    const sketch_subnet_t  *subnet)
+{
+    uint32_t v;
+
+    v = sketch_bits_longest_run(subnet->bits, SKETCH_SUBNET_WORDS);
+    if (v > sketch->max_subnet_run) {
+        sketch->max_subnet_run = v;
+    }
+    v = sketch_bits_count(subnet->bits, SKETCH_SUBNET_WORDS);
+    if (v > sketch->max_subnet_count) {
+        sketch->max_subnet_count = v;
+    }
+}
+
+
+/*
+ *  sketch_lowport_fold(sketch, lowport);
+ *
+ *    Add the low ports of the dip in 'lowport' to the maxima in
+ *    'sketch'.
+ */
+static void
+sketch_lowport_fold(
+    event_sketch_t         *sketch,
+    const sketch_lowport_t *lowport)
+{
+    uint32_t v;
+
+    v = sketch_bits_longest_run(lowport->bits, SKETCH_LOWPORT_WORDS);
+    if (v > sketch->max_low_port_run) {
+        sketch->max_low_port_run = v;
+    }
+    v = sketch_bits_count(lowport->bits, SKETCH_LOWPORT_WORDS);
+    if (v > sketch->max_low_dp_hit) {
+        sketch->max_low_dp_hit = v;
+    }
+}
+
+
+/*
+ *  sketch_add_dip(sketch, dip);
+ *
+ *    Note the dip 'dip' in the map of its /24.
+ */
+static void
+sketch_add_dip(
+    event_sketch_t     *sketch,
+    uint32_t            dip)
+{
+    uint32_t class_c = dip >> 8;
+    sketch_subnet_t *subnet;
+
+    subnet = &sketch->subnets[sketch_hash(class_c) % SKETCH_SUBNET_SLOTS];
+    if (!subnet->in_use || subnet->class_c != class_c) {
+        if (subnet->in_use) {
+            sketch_subnet_fold(sketch, subnet);
+        }
+        memset(subnet, 0, sizeof(sketch_subnet_t));
+        subnet->class_c = class_c;
+        subnet->in_use = 1;
+    }
+    subnet->bits[(dip & 0xFF) >> 5] |= UINT32_C(1) << (dip & 0x1F);
+}
+
+
+/*
+ *  sketch_add_lowport(sketch, dip, dport);
+ *
+ *    Note the low port 'dport' in the map of 'dip'.
+ */
+static void
+sketch_add_lowport(
+    event_sketch_t     *sketch,
+    uint32_t            dip,
+    uint16_t            dport)
+{
+    sketch_lowport_t *lowport;
+
+    lowport = &sketch->lowports[sketch_hash(dip) % SKETCH_LOWPORT_SLOTS];
+    if (!lowport->in_use || lowport->dip != dip) {
+        if (lowport->in_use) {
+            sketch_lowport_fold(sketch, lowport);
+        }
+        memset(lowport, 0, sizeof(sketch_lowport_t));
+        lowport->dip = dip;
+        lowport->in_use = 1;
+    }
+    lowport->bits[dport >> 5] |= UINT32_C(1) << (dport & 0x1F);
+}
+
+
+/*
+ *  sketch = event_sketch_create(proto);
+ *
+ *    Create the sketches for an event of protocol 'proto'.  Return
+ *    NULL on allocation failure.
+ */
+event_sketch_t *
+event_sketch_create(
+    uint8_t             proto)
+{
+    event_sketch_t *sketch;
+
+    sketch = (event_sketch_t*)calloc(1, sizeof(event_sketch_t));
+    if (sketch == NULL) {
+        return NULL;
+    }
+    sketch->proto = proto;
+
+    if (skBitmapCreate(&sketch->max_dip_sports, 1 << 16)) {
+        goto ERROR;
+    }
+    switch (proto) {
+      case IPPROTO_UDP:
+        sketch->subnets = (sketch_subnet_t*)calloc(SKETCH_SUBNET_SLOTS,
+                                                   sizeof(sketch_subnet_t));
+        sketch->lowports
+            = (sketch_lowport_t*)calloc(SKETCH_LOWPORT_SLOTS,
+                                        sizeof(sketch_lowport_t));
+        if (sketch->subnets == NULL || sketch->lowports == NULL
+            || skBitmapCreate(&sketch->sports, 1 << 16))
+        {
+            goto ERROR;
+        }
+        break;
+      case IPPROTO_ICMP:
+        sketch->subnets = (sketch_subnet_t*)calloc(SKETCH_SUBNET_SLOTS,
+                                                   sizeof(sketch_subnet_t));
+        if (sketch->subnets == NULL
+            || skBitmapCreate(&sketch->class_cs, 1 << 24))
+        {
+            goto ERROR;
+        }
+        sketch->min_class_c = UINT32_MAX;
+        break;
+      default:
+        break;
+    }
+    return sketch;
+
+  ERROR:
+    event_sketch_destroy(&sketch);
+    return NULL;
+}
+
+
+/*
+ *  event_sketch_add(sketch, cols, metrics);
+ *
+ *    Add the flows in 'cols', which may be in any order, to 'sketch',
+ *    and add their packets and bytes to 'metrics'.
+ */
+void
+event_sketch_add(
+    event_sketch_t         *sketch,
+    const event_columns_t  *cols,
+    event_metrics_t        *metrics)
+{
+    const uint32_t *dip   = cols->dip;
+    const uint16_t *sport = cols->sport;
+    const uint16_t *dport = cols->dport;
+    uint32_t i;
+
+    for (i = 0; i < cols->count; ++i) {
+        metrics->pkts  += cols->pkts[i];
+        metrics->bytes += cols->bytes[i];
+
+        sketch_hll_add(sketch->hll_dips, dip[i]);
+        sketch_hll_add(sketch->hll_dsts,
+                       ((uint64_t)dip[i] << 16) | dport[i]);
+
+        if (sketch->flows == 0 || dip[i] > sketch->max_dip) {
+            sketch->max_dip = dip[i];
+            skBitmapClearAllBits(sketch->max_dip_sports);
+        }
+        if (dip[i] == sketch->max_dip) {
+            skBitmapSetBit(sketch->max_dip_sports, sport[i]);
+        }
+        ++sketch->flows;
+
+        switch (sketch->proto) {
+          case IPPROTO_UDP:
+            skBitmapSetBit(sketch->sports, sport[i]);
+            sketch_add_dip(sketch, dip[i]);
+            if (dport[i] < 1024) {
+                sketch_add_lowport(sketch, dip[i], dport[i]);
+            }
+            break;
+          case IPPROTO_ICMP:
+            sketch_add_dip(sketch, dip[i]);
+            skBitmapSetBit(sketch->class_cs, dip[i] >> 8);
+            if ((dip[i] >> 8) < sketch->min_class_c) {
+                sketch->min_class_c = dip[i] >> 8;
+            }
+            if ((dip[i] >> 8) > sketch->max_class_c) {
+                sketch->max_class_c = dip[i] >> 8;
+            }
+            break;
+          default:
+            break;
+        }
+    }
+}
+
+
+/*
+ *  event_sketch_finish(sketch, metrics);
+ *
+ *    Set the feature members of 'metrics' that the exact calculations
+ *    find by comparing neighboring flows from the estimates in
+ *    'sketch'.  The ratios are computed by the finish_*_metrics()
+ *    functions.
+ */
+void
+event_sketch_finish(
+    event_sketch_t     *sketch,
+    event_metrics_t    *metrics)
+{
+    uint32_t run = 0;
+    uint32_t longest = 0;
+    uint32_t i;
+
+    if (sketch->flows == 0) {
+        return;
+    }
+
+    metrics->unique_dips = sketch_hll_estimate(sketch->hll_dips,
+                                               sketch->flows);
+    metrics->unique_dsts = sketch_hll_estimate(sketch->hll_dsts,
+                                               sketch->flows);
+    if (metrics->unique_dsts < metrics->unique_dips) {
+        metrics->unique_dsts = metrics->unique_dips;
+    }
+    metrics->sp_count = skBitmapGetHighCount(sketch->max_dip_sports);
+
+    switch (sketch->proto) {
+      case IPPROTO_UDP:
+        for (i = 0; i < SKETCH_SUBNET_SLOTS; ++i) {
+            if (sketch->subnets[i].in_use) {
+                sketch_subnet_fold(sketch, &sketch->subnets[i]);
+            }
+        }
+        for (i = 0; i < SKETCH_LOWPORT_SLOTS; ++i) {
+            if (sketch->lowports[i].in_use) {
+                sketch_lowport_fold(sketch, &sketch->lowports[i]);
+            }
+        }
+        metrics->unique_sp_count = skBitmapGetHighCount(sketch->sports);
+        metrics->proto.udp.max_class_c_dip_run_length
+            = sketch->max_subnet_run;
+        metrics->proto.udp.max_low_dp_hit = sketch->max_low_dp_hit;
+        metrics->proto.udp.max_low_port_run_length
+            = sketch->max_low_port_run;
+        break;
+
+      case IPPROTO_ICMP:
+        for (i = 0; i < SKETCH_SUBNET_SLOTS; ++i) {
+            if (sketch->subnets[i].in_use) {
+                sketch_subnet_fold(sketch, &sketch->subnets[i]);
+            }
+        }
+        /* the longest run of consecutive /24s */
+        for (i = sketch->min_class_c; i <= sketch->max_class_c; ++i) {
+            if (skBitmapGetBit(sketch->class_cs, i)) {
+                if (++run > longest) {
+                    longest = run;
+                }
+            } else {
+                run = 0;
+            }
+        }
+        metrics->proto.icmp.max_class_c_subnet_run_length = longest;
+        metrics->proto.icmp.max_class_c_dip_run_length
+            = sketch->max_subnet_run;
+        metrics->proto.icmp.max_class_c_dip_count = sketch->max_subnet_count;
+        break;
+
+      default:
+        break;
+    }
+}
+
+
+/*
+ *  event_sketch_destroy(&sketch);
+ *
+ *    Free 'sketch'.  Does nothing if 'sketch' is NULL.
+ */
+void
+event_sketch_destroy(
+    event_sketch_t    **sketch)
+{
+    event_sketch_t *s;
+
+    if (sketch == NULL || *sketch == NULL) {
+        return;
+    }
+    s = *sketch;
+    *sketch = NULL;
+
+    skBitmapDestroy(&s->max_dip_sports);
+    skBitmapDestroy(&s->sports);
+    skBitmapDestroy(&s->class_cs);
+    free(s->subnets);
+    free(s->lowports);
+    free(s);
+}
+
+
+/*
+** Local Variables:
+** mode:c
+** indent-tabs-mode:nil
+** c-basic-offset:4
+** End:
+*/
@@ -0,0 +1,819 @@
+/*
+** Copyright (C) 2006-2019 by Carnegie Mellon University.
+**
+** @OPENSOURCE_LICENSE_START@
+** See license information in ../../LICENSE.txt
+** @OPENSOURCE_LICENSE_END@
+*/
+
+/*
+ *  rwscan_sort.c
+ *
+ *    External merge sort of unsorted SiLK Flow records.
+ *
+ *    When --unsorted-input and --sort-buffer-size are given, records
+ *    are collected into a buffer of the requested size.  Each time
+ *    the buffer fills, it is sorted by sip, proto, and dip and
+ *    written to a temporary file.  Once all input has been read, the
+ *    temporary files are merged and the merged records are fed to the
+ *    same event assembly used for sorted input.  When more than
+ *    RWSCAN_MAX_MERGE_FILES temporary files exist, groups of them are
+ *    first merged into larger temporary files.
+ *
+ *    The same merge is used by --merge-inputs to combine several input
+ *    files that are each sorted by sip, proto, and dip, so that the
+ *    flows of a source are assembled into one event across all of the
+ *    files.
+ */
+
+#include <silk/silk.h>
+
+RCSIDENT("$SiLK: rwscan_sort.c 945cf5167607 2019-01-07 18:54:17Z mthomas $");
+
+#include <silk/skheap.h>
+#include <silk/sktempfile.h>
+#include "rwscan.h"
+
+
+/* LOCAL DEFINES AND TYPEDEFS */
+
+/* number of records buffered for each input file during --merge-inputs */
+#define MERGE_INPUT_BUFFER_RECS  4096
+
+/* one sorted input to the merge */
+typedef struct merge_input_st {
+    skstream_t *stream;
+    decoder_t  *dec;            /* decodes 'stream' for --decode-ahead */
+    rwscan_flow_t *recs;           /* buffered records */
+    size_t      max_count;      /* number of records 'recs' can hold */
+    size_t      count;          /* number of records in 'recs' */
+    size_t      pos;            /* position of the current record */
+    /* for SiLK Flow input files, the counts of records read and of
+     * records ignored due to their protocol; unused for temp files */
+    uint32_t    total_flows;
+    uint32_t    ignored_flows;
+    unsigned    is_silk_flow :1;
+} merge_input_t;
+
+/* signature of the function that receives the merged records */
+typedef int (*merge_output_fn_t)(
+    const rwscan_flow_t *rwrec,
+    void               *ctx);
+
+
+/* LOCAL VARIABLE DEFINITIONS */
+
+/* buffer of records waiting to be sorted */
+static rwscan_flow_t *sort_buffer = NULL;
+static size_t sort_buffer_max = 0;
+static size_t sort_buffer_count = 0;
+
+/* serializes access to the sort buffer by the reader threads */
+static pthread_mutex_t sort_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* temporary files holding the sorted runs */
+static sk_tempfilectx_t *tmpctx = NULL;
+static int *runs = NULL;
+static size_t runs_count = 0;
+static size_t runs_max = 0;
+
+
+/* FUNCTION DEFINITIONS */
+
+/*
+ *  status = tempfile_init();
+ *
+ *    Initialize the temporary file context if that has not been done.
+ *    Return 0 on success or -1 on failure.
+ */
+static int
+tempfile_init(
+    void)
+{
+    if (tmpctx) {
+        return 0;
+    }
+    if (skTempFileInitialize(&tmpctx, options.temp_directory, NULL,
+                             &skAppPrintErr))
+    {
+        skAppPrintErr("Unable to initialize temporary files");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ *  status = sort_buffer_create();
+ *
+ *    Allocate the sort buffer and initialize the temporary file
+ *    context.  Return 0 on success or -1 on failure.
+ */
+int
+sort_buffer_create(
+    void)
+{
+    sort_buffer_max = options.sort_buffer_size / sizeof(rwscan_flow_t);
+    sort_buffer_count = 0;
+
+    sort_buffer = (rwscan_flow_t*)malloc(sort_buffer_max
+                                         * sizeof(rwscan_flow_t));
+    if (sort_buffer == NULL) {
+        skAppPrintErr("Unable to allocate %" PRIu64 " byte sort buffer",
+                      options.sort_buffer_size);
+        return -1;
+    }
+
+    return tempfile_init();
+}
+
+
+/*
+ *  status = add_run(tmp_idx);
+ *
+ *    Append the temporary file 'tmp_idx' to the list of runs.
+ */
+static int
+add_run(
+    int                 tmp_idx)
+{
+    if (runs_count == runs_max) {
+        int   *old_runs = runs;
+        size_t new_max  = (runs_max ? 2 * runs_max : 64);
+
+        runs = (int*)realloc(runs, new_max * sizeof(int));
+        if (runs == NULL) {
+            skAppPrintOutOfMemory("temporary file list");
+            runs = old_runs;
+            return -1;
+        }
+        runs_max = new_max;
+    }
+    runs[runs_count++] = tmp_idx;
+    return 0;
+}
+
+
+/*
+ *  status = write_run(recs, count);
+ *
+ *    Write the 'count' sorted records in 'recs' to a new temporary
+ *    file and add it to the list of runs.  Return 0 on success or
+ *    -1 on failure.
+ */
+static int
+write_run(
+    const rwscan_flow_t *recs,
+    size_t              count)
+{
+    skstream_t *stream;
+    ssize_t     rv;
+    int         tmp_idx;
+
+    stream = skTempFileCreateStream(tmpctx, &tmp_idx);
+    if (stream == NULL) {
+        skAppPrintSyserror("Error creating new temporary file");
+        return -1;
+    }
+    rv = skStreamWrite(stream, recs, count * sizeof(rwscan_flow_t));
+    if (rv != (ssize_t)(count * sizeof(rwscan_flow_t))) {
+        skStreamPrintLastErr(stream, rv, &skAppPrintErr);
+        skStreamDestroy(&stream);
+        return -1;
+    }
+    rv = skStreamClose(stream);
+    if (rv) {
+        skStreamPrintLastErr(stream, rv, &skAppPrintErr);
+        skStreamDestroy(&stream);
+        return -1;
+    }
+    skStreamDestroy(&stream);
+
+    if (options.verbose_progress) {
+        fprintf(RWSCAN_VERBOSE_FH, "wrote %" SK_PRIuZ " records to %s\n",
+                count, skTempFileGetName(tmpctx, tmp_idx));
+    }
+
+    return add_run(tmp_idx);
+}
+
+
+/*
+ *  status = sort_add_records(recs, count);
+ *
+ *    Add the 'count' records in 'recs' to the sort buffer, spilling
+ *    the buffer to a temporary file each time it fills.  Return 0 on
+ *    success or -1 on failure.  May be called by several reader
+ *    threads.
+ */
+int
+sort_add_records(
+    const rwscan_flow_t *recs,
+    size_t              count)
+{
+    size_t n;
+    int    retval = 0;
+
+    pthread_mutex_lock(&sort_mutex);
+    while (count > 0) {
+        if (sort_buffer_count == sort_buffer_max) {
+            qsort(sort_buffer, sort_buffer_count, sizeof(rwscan_flow_t),
+                  flow_compare_sip_proto_dip);
+            if (write_run(sort_buffer, sort_buffer_count)) {
+                retval = -1;
+                break;
+            }
+            sort_buffer_count = 0;
+        }
+        n = sort_buffer_max - sort_buffer_count;
+        if (n > count) {
+            n = count;
+        }
+        memcpy(&sort_buffer[sort_buffer_count], recs,
+               n * sizeof(rwscan_flow_t));
+        sort_buffer_count += n;
+        recs += n;
+        count -= n;
+    }
+    pthread_mutex_unlock(&sort_mutex);
+
+    return retval;
+}
+
+
+/*
+ *  status = merge_input_fill(input);
+ *
+ *    Refill the record buffer of 'input'.  For SiLK Flow input files,
+ *    records whose protocol is not ICMP, TCP, or UDP are counted and
+ *    skipped.  Return 1 if records were read, 0 at end of file, or -1
+ *    on error.
+ */
+static int
+merge_input_fill(
+    merge_input_t      *input)
+{
+    ssize_t rv;
+
+    input->pos = 0;
+    input->count = 0;
+
+    if (input->is_silk_flow) {
+        rwRec rwrec;
+
+        while (input->count < input->max_count) {
+            if (input->dec) {
+                rv = decoder_read_record(input->dec, &rwrec);
+            } else {
+                rv = skStreamReadRecord(input->stream, &rwrec);
+            }
+            if (rv) {
+                if (rv != SKSTREAM_ERR_EOF) {
+                    skStreamPrintLastErr(input->stream, rv, &skAppPrintErr);
+                    return -1;
+                }
+                break;
+            }
+            ++input->total_flows;
+            if ((rwRecGetProto(&rwrec) != IPPROTO_ICMP)
+                && (rwRecGetProto(&rwrec) != IPPROTO_TCP)
+                && (rwRecGetProto(&rwrec) != IPPROTO_UDP))
+            {
+                ++input->ignored_flows;
+                continue;
+            }
+            flow_from_rwrec(&input->recs[input->count], &rwrec);
+            ++input->count;
+        }
+        return (input->count > 0);
+    }
+
+    rv = skStreamRead(input->stream, input->recs,
+                      input->max_count * sizeof(rwscan_flow_t));
+    if (rv < 0) {
+        skStreamPrintLastErr(input->stream, rv, &skAppPrintErr);
+        return -1;
+    }
+    if (rv % sizeof(rwscan_flow_t)) {
+        skAppPrintErr("Short read from temporary file '%s'",
+                      skStreamGetPathname(input->stream));
+        return -1;
+    }
+    input->count = rv / sizeof(rwscan_flow_t);
+    return (input->count > 0);
+}
+
+
+/*
+ *  cmp = merge_compare(node1, node2, inputs);
+ *
+ *    Compare the current records of the inputs whose indexes are
+ *    'node1' and 'node2'.  The arguments are reversed since the heap
+ *    keeps the largest node at the top and the merge needs the
+ *    smallest.
+ */
+static int
+merge_compare(
+    const skheapnode_t  node1,
+    const skheapnode_t  node2,
+    void               *v_inputs)
+{
+    merge_input_t *inputs = (merge_input_t*)v_inputs;
+    merge_input_t *a = &inputs[*(uint32_t*)node1];
+    merge_input_t *b = &inputs[*(uint32_t*)node2];
+
+    return flow_compare_sip_proto_dip(&b->recs[b->pos], &a->recs[a->pos]);
+}
+
+
+/*
+ *  status = merge_streams(inputs, count, output_fn, ctx);
+ *
+ *    Merge the 'count' opened inputs in 'inputs', passing each record
+ *    in sorted order to 'output_fn' along with 'ctx'.  Each input must
+ *    have its stream and record buffer set.  Return 0 on success or -1
+ *    on failure.
+ */
+static int
+merge_streams(
+    merge_input_t      *inputs,
+    size_t              count,
+    merge_output_fn_t   output_fn,
+    void               *ctx)
+{
+    skheap_t      *heap;
+    skheapnode_t   top_node;
+    merge_input_t *input;
+    uint32_t       idx;
+    size_t         i;
+    int            retval = -1;
+    int            rv;
+
+    heap = skHeapCreate2(&merge_compare, count, sizeof(uint32_t), NULL,
+                         inputs);
+    if (heap == NULL) {
+        skAppPrintOutOfMemory("merge heap");
+        return -1;
+    }
+
+    for (i = 0; i < count; ++i) {
+        rv = merge_input_fill(&inputs[i]);
+        if (rv < 0) {
+            goto END;
+        }
+        if (rv > 0) {
+            idx = (uint32_t)i;
+            skHeapInsert(heap, &idx);
+        }
+    }
+
+    while (skHeapPeekTop(heap, &top_node) == SKHEAP_OK) {
+        idx = *(uint32_t*)top_node;
+        input = &inputs[idx];
+
+        if (output_fn(&input->recs[input->pos], ctx)) {
+            goto END;
+        }
+
+        ++input->pos;
+        if (input->pos == input->count) {
+            rv = merge_input_fill(input);
+            if (rv < 0) {
+                goto END;
+            }
+            if (rv == 0) {
+                skHeapExtractTop(heap, NULL);
+                continue;
+            }
+        }
+        /* the current record of the input has changed; re-sift it */
+        skHeapReplaceTop(heap, &idx, NULL);
+    }
+
+    retval = 0;
+
+  END:
+    skHeapFree(heap);
+    return retval;
+}
+
+
+/*
+ *  status = merge_runs(first, count, output_fn, ctx);
+ *
+ *    Merge the 'count' runs beginning at position 'first' of the run
+ *    list, passing each record in sorted order to 'output_fn' along
+ *    with 'ctx'.  The temporary files are removed once merged.
+ *    Return 0 on success or -1 on failure.
+ */
+static int
+merge_runs(
+    size_t              first,
+    size_t              count,
+    merge_output_fn_t   output_fn,
+    void               *ctx)
+{
+    merge_input_t *inputs;
+    size_t         per_input;
+    size_t         i;
+    int            retval = -1;
+
+    inputs = (merge_input_t*)calloc(count, sizeof(merge_input_t));
+    if (inputs == NULL) {
+        skAppPrintOutOfMemory("merge data");
+        return -1;
+    }
+
+    /* divide the sort buffer's memory among the inputs */
+    if (options.sort_buffer_size) {
+        per_input = options.sort_buffer_size / sizeof(rwscan_flow_t) / count;
+        if (per_input == 0) {
+            per_input = 1;
+        }
+    } else {
+        per_input = MERGE_INPUT_BUFFER_RECS;
+    }
+
+    for (i = 0; i < count; ++i) {
+        inputs[i].stream = skTempFileOpenStream(tmpctx, runs[first + i]);
+        if (inputs[i].stream == NULL) {
+            skAppPrintSyserror("Error opening existing temporary file '%s'",
+                               skTempFileGetName(tmpctx, runs[first + i]));
+            goto END;
+        }
+        inputs[i].max_count = per_input;
+        inputs[i].recs = (rwscan_flow_t*)malloc(per_input
+                                                * sizeof(rwscan_flow_t));
+        if (inputs[i].recs == NULL) {
+            skAppPrintOutOfMemory("merge buffer");
+            goto END;
+        }
+        /* the runs hold raw flows that merge_input_fill() reads from
+         * the stream itself; --decode-ahead only applies to SiLK Flow
+         * inputs */
+    }
+
+    retval = merge_streams(inputs, count, output_fn, ctx);
+
+  END:
+    for (i = 0; i < count; ++i) {
+        decoder_destroy(&inputs[i].dec);
+        skStreamDestroy(&inputs[i].stream);
+        free(inputs[i].recs);
+        skTempFileRemove(tmpctx, runs[first + i]);
+    }
+    free(inputs);
+    return retval;
+}
+
+
+/*
+ *  status = merge_output_run(rwrec, stream);
+ *
+ *    Write 'rwrec' to the temporary file 'stream'.  Callback for
+ *    merge_runs() during an intermediate merge.
+ */
+static int
+merge_output_run(
+    const rwscan_flow_t *rwrec,
+    void               *v_stream)
+{
+    skstream_t *stream = (skstream_t*)v_stream;
+    ssize_t     rv;
+
+    rv = skStreamWrite(stream, rwrec, sizeof(rwscan_flow_t));
+    if (rv != sizeof(rwscan_flow_t)) {
+        skStreamPrintLastErr(stream, rv, &skAppPrintErr);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ *  status = merge_output_event(rwrec, assembler);
+ *
+ *    Add 'rwrec' to the event assembler.  Callback for merge_runs()
+ *    during the final merge.
+ */
+static int
+merge_output_event(
+    const rwscan_flow_t *rwrec,
+    void               *v_assembler)
+{
+    return assembler_add((event_assembler_t*)v_assembler, rwrec);
+}
+
+
+/*
+ *  status = merge_all_runs(as);
+ *
+ *    Merge every run in the run list and feed the records to the
+ *    event assembler 'as'.  When there are too many runs to open at
+ *    once, groups of them are first merged into larger runs.  Return
+ *    0 on success or -1 on failure.
+ */
+static int
+merge_all_runs(
+    event_assembler_t  *as)
+{
+    size_t i;
+
+    for (i = 0; runs_count - i > RWSCAN_MAX_MERGE_FILES;
+         i += RWSCAN_MAX_MERGE_FILES)
+    {
+        skstream_t *stream;
+        int         tmp_idx;
+
+        stream = skTempFileCreateStream(tmpctx, &tmp_idx);
+        if (stream == NULL) {
+            skAppPrintSyserror("Error creating new temporary file");
+            return -1;
+        }
+        if (merge_runs(i, RWSCAN_MAX_MERGE_FILES, &merge_output_run, stream)
+            || skStreamClose(stream))
+        {
+            skStreamDestroy(&stream);
+            return -1;
+        }
+        skStreamDestroy(&stream);
+        if (add_run(tmp_idx)) {
+            return -1;
+        }
+    }
+
+    if (merge_runs(i, runs_count - i, &merge_output_event, as)) {
+        return -1;
+    }
+    runs_count = 0;
+    return 0;
+}
+
+
+/*
+ *  status = sort_dispatch_all();
+ *
+ *    Sort or merge all records that were passed to sort_add_records()
+ *    and hand the resulting events to the worker threads.  Return 0
+ *    on success or -1 on failure.
+ */
+int
+sort_dispatch_all(
+    void)
+{
+    event_assembler_t as;
+    size_t            i;
+    int               retval = -1;
+
+    memset(&as, 0, sizeof(as));
+
+    if (runs_count == 0) {
+        /* everything fit into memory */
+        qsort(sort_buffer, sort_buffer_count, sizeof(rwscan_flow_t),
+              flow_compare_sip_proto_dip);
+        for (i = 0; i < sort_buffer_count; ++i) {
+            if (assembler_add(&as, &sort_buffer[i])) {
+                goto END;
+            }
+        }
+        sort_buffer_count = 0;
+        return assembler_finish(&as);
+    }
+
+    /* spill what remains and release the buffer so the merge can use
+     * its memory */
+    if (sort_buffer_count) {
+        qsort(sort_buffer, sort_buffer_count, sizeof(rwscan_flow_t),
+              flow_compare_sip_proto_dip);
+        if (write_run(sort_buffer, sort_buffer_count)) {
+            goto END;
+        }
+        sort_buffer_count = 0;
+    }
+    free(sort_buffer);
+    sort_buffer = NULL;
+
+    if (merge_all_runs(&as)) {
+        goto END;
+    }
+
+    retval = assembler_finish(&as);
+
+  END:
+    assembler_free(&as);
+    return retval;
+}
+
+
+/*
+ *  status = merge_files(files, count, output_fn, ctx, total, ignored);
+ *
+ *    Open the 'count' SiLK Flow files named in 'files', each sorted
+ *    by sip, proto, and dip, and merge their ICMP, TCP, and UDP
+ *    records, passing each to 'output_fn' along with 'ctx'.  Add the
+ *    number of records read to 'total' and the number skipped because
+ *    of their protocol to 'ignored'.  Return 0 on success or -1 on
+ *    failure.
+ */
+static int
+merge_files(
+    char              **files,
+    size_t              count,
+    merge_output_fn_t   output_fn,
+    void               *ctx,
+    uint32_t           *total,
+    uint32_t           *ignored)
+{
+    merge_input_t *inputs;
+    size_t         i;
+    int            retval = -1;
+    int            rv;
+
+    inputs = (merge_input_t*)calloc(count, sizeof(merge_input_t));
+    if (inputs == NULL) {
+        skAppPrintOutOfMemory("merge data");
+        return -1;
+    }
+
+    for (i = 0; i < count; ++i) {
+        if (options.verbose_progress) {
+            fprintf(RWSCAN_VERBOSE_FH, "processing: %s\n", files[i]);
+        }
+        rv = skStreamOpenSilkFlow(&inputs[i].stream, files[i], SK_IO_READ);
+        if (rv) {
+            skStreamPrintLastErr(inputs[i].stream, rv, &skAppPrintErr);
+            goto END;
+        }
+        skStreamSetIPv6Policy(inputs[i].stream, SK_IPV6POLICY_ASV4);
+        inputs[i].is_silk_flow = 1;
+        inputs[i].max_count = MERGE_INPUT_BUFFER_RECS;
+        inputs[i].recs = (rwscan_flow_t*)malloc(MERGE_INPUT_BUFFER_RECS
+                                        * sizeof(rwscan_flow_t));
+        if (inputs[i].recs == NULL) {
+            skAppPrintOutOfMemory("merge buffer");
+            goto END;
+        }
+        if (options.decode_ahead
+            && decoder_create(&inputs[i].dec, inputs[i].stream,
+                              options.decode_ahead))
+        {
+            goto END;
+        }
+    }
+
+    retval = merge_streams(inputs, count, output_fn, ctx);
+
+  END:
+    for (i = 0; i < count; ++i) {
+        *total += inputs[i].total_flows;
+        *ignored += inputs[i].ignored_flows;
+        decoder_destroy(&inputs[i].dec);
+        skStreamDestroy(&inputs[i].stream);
+        free(inputs[i].recs);
+    }
+    free(inputs);
+    return retval;
+}
+
+
+/*
+ *  status = merge_input_files();
+ *
+ *    Merge all input files named on the command line, each of which
+ *    is sorted by sip, proto, and dip, and hand the resulting events
+ *    to the worker threads.  The flows of a source that are spread
+ *    across several files become a single event.  When there are more
+ *    than RWSCAN_MAX_MERGE_FILES files, groups of files are first
+ *    merged into temporary files.  Return 0 on success or -1 on
+ *    failure.
+ */
+int
+merge_input_files(
+    void)
+{
+    event_assembler_t as;
+    char            **files = NULL;
+    char             *input_file;
+    size_t            files_count = 0;
+    size_t            files_max = 0;
+    uint32_t          total_flows = 0;
+    uint32_t          ignored_flows = 0;
+    size_t            i;
+    int               retval = -1;
+
+    memset(&as, 0, sizeof(as));
+
+    while (skOptionsCtxNextArgument(optctx, &input_file) == 0) {
+        if (files_count == files_max) {
+            char **old_files = files;
+            files_max = (files_max ? 2 * files_max : 64);
+            files = (char**)realloc(files, files_max * sizeof(char*));
+            if (files == NULL) {
+                skAppPrintOutOfMemory("input file list");
+                files = old_files;
+                goto END;
+            }
+        }
+        /* the argument may live in a buffer that the next call reuses */
+        files[files_count] = strdup(input_file);
+        if (files[files_count] == NULL) {
+            skAppPrintOutOfMemory("input file name");
+            goto END;
+        }
+        ++files_count;
+    }
+    if (files_count == 0) {
+        retval = 0;
+        goto END;
+    }
+
+    if (files_count <= RWSCAN_MAX_MERGE_FILES) {
+        if (merge_files(files, files_count, &merge_output_event, &as,
+                        &total_flows, &ignored_flows))
+        {
+            goto END;
+        }
+    } else {
+        /* too many files to open at once; merge groups of them into
+         * temporary files, then merge those */
+        if (tempfile_init()) {
+            goto END;
+        }
+        for (i = 0; i < files_count; i += RWSCAN_MAX_MERGE_FILES) {
+            skstream_t *stream;
+            size_t      count = files_count - i;
+            int         tmp_idx;
+
+            if (count > RWSCAN_MAX_MERGE_FILES) {
+                count = RWSCAN_MAX_MERGE_FILES;
+            }
+            stream = skTempFileCreateStream(tmpctx, &tmp_idx);
+            if (stream == NULL) {
+                skAppPrintSyserror("Error creating new temporary file");
+                goto END;
+            }
+            if (merge_files(&files[i], count, &merge_output_run, stream,
+                            &total_flows, &ignored_flows)
+                || skStreamClose(stream))
+            {
+                skStreamDestroy(&stream);
+                goto END;
+            }
+            skStreamDestroy(&stream);
+            if (add_run(tmp_idx)) {
+                goto END;
+            }
+        }
+        if (merge_all_runs(&as)) {
+            goto END;
+        }
+    }
+
+    retval = assembler_finish(&as);
+
+  END:
+    pthread_mutex_lock(&summary_metrics.mutex);
+    summary_metrics.total_flows   += total_flows;
+    summary_metrics.ignored_flows += ignored_flows;
+    pthread_mutex_unlock(&summary_metrics.mutex);
+
+    assembler_free(&as);
+    for (i = 0; i < files_count; ++i) {
+        free(files[i]);
+    }
+    free(files);
+    return retval;
+}
+
+
+/*
+ *  sort_buffer_destroy();
+ *
+ *    Release the sort buffer and remove any temporary files.
+ */
+void
+sort_buffer_destroy(
+    void)
+{
+    if (sort_buffer) {
+        free(sort_buffer);
+        sort_buffer = NULL;
+    }
+    sort_buffer_count = 0;
+    if (runs) {
+        free(runs);
+        runs = NULL;
+    }
+    runs_count = 0;
+    runs_max = 0;
+    skTempFileTeardown(&tmpctx);
+}
+
+
+/*
+** Local Variables:
+** mode:c
+** indent-tabs-mode:nil
+** c-basic-offset:4
+** End:
+*/
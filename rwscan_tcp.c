@@ -13,54 +13,87 @@ RCSIDENT("$SiLK: rwscan_tcp.c 945cf5167607 2019-01-07 18:54:17Z mthomas $");
 #include "rwscan.h"
 
 
+/*
+ *  increment_tcp_counters(cols, metrics);
+ *
+ *    Add the flows in 'cols' to the TCP counters.  The counters that
+ *    depend only on the flags are found from a histogram of the flags,
+ *    so the loop over the packet and byte counts has no branches.
+ */
+RWSCAN_KERNEL
 void
-add_count(
-    uint32_t           *counts,
-    uint32_t            value,
-    uint32_t            max)
+increment_tcp_counters(
+    const event_columns_t  *cols,
+    event_metrics_t        *metrics)
 {
-    if (value >= max - 1) {
-        counts[max - 1]++;
-    } else {
-        counts[value]++;
+    const uint8_t  *flags = cols->flags;
+    const uint32_t *pkts  = cols->pkts;
+    const uint32_t *bytes = cols->bytes;
+    uint32_t flag_hist[256];
+    uint32_t small = 0, payload = 0, noack = 0;
+    uint32_t i;
+
+    for (i = 0; i < cols->count; ++i) {
+        small += (pkts[i] < SMALL_PKT_CUTOFF);
+        /* bytes / pkts > PACKET_PAYLOAD_CUTOFF, without dividing */
+        payload += ((uint64_t)bytes[i]
+                    >= (uint64_t)(PACKET_PAYLOAD_CUTOFF + 1) * pkts[i]);
+    }
+    metrics->flows_small        += small;
+    metrics->flows_with_payload += payload;
+
+    memset(flag_hist, 0, sizeof(flag_hist));
+    for (i = 0; i < cols->count; ++i) {
+        ++flag_hist[flags[i]];
     }
+    for (i = 0; i < 256; ++i) {
+        if (flag_hist[i]) {
+            if (!(i & ACK_FLAG)) {
+                noack += flag_hist[i];
+            }
+            metrics->tcp_flag_counts[(i < RWSCAN_MAX_FLAGS - 1)
+                                     ? i : (RWSCAN_MAX_FLAGS - 1)]
+                += flag_hist[i];
+        }
+    }
+    metrics->flows_noack       += noack;
+    metrics->flows_backscatter += (flag_hist[RST_FLAG]
+                                   + flag_hist[SYN_FLAG | ACK_FLAG]
+                                   + flag_hist[RST_FLAG | ACK_FLAG]);
 }
 
 void
-increment_tcp_counters(
-    rwRec              *rwrec,
-    event_metrics_t    *metrics)
+calculate_tcp_metrics(
+    metric_state_t         *state,
+    const event_columns_t  *cols,
+    event_metrics_t        *metrics)
 {
-    if (!(rwRecGetFlags(rwrec) & ACK_FLAG)) {
-        metrics->flows_noack++;
-    }
-
-    if (rwRecGetPkts(rwrec) < SMALL_PKT_CUTOFF) {
-        metrics->flows_small++;
-    }
+    event_columns_t tile;
+    uint32_t first;
 
-    if ((rwRecGetBytes(rwrec) / rwRecGetPkts(rwrec)) > PACKET_PAYLOAD_CUTOFF) {
-        metrics->flows_with_payload++;
+    if (state->sketch) {
+        increment_tcp_counters(cols, metrics);
+        event_sketch_add(state->sketch, cols, metrics);
+        return;
     }
-
-    if (rwRecGetFlags(rwrec) == RST_FLAG
-        || rwRecGetFlags(rwrec) == (SYN_FLAG | ACK_FLAG)
-        || rwRecGetFlags(rwrec) == (RST_FLAG | ACK_FLAG))
-    {
-        metrics->flows_backscatter++;
+    /* make every pass over a tile of the flows while it is cached */
+    for (first = 0; first < cols->count; first += RWSCAN_KERNEL_TILE) {
+        event_columns_view(&tile, cols, first,
+                           ((cols->count - first < RWSCAN_KERNEL_TILE)
+                            ? (cols->count - first) : RWSCAN_KERNEL_TILE));
+        increment_tcp_counters(&tile, metrics);
+        calculate_shared_metrics(state, &tile, metrics);
     }
-    add_count(metrics->tcp_flag_counts,
-              rwRecGetFlags(rwrec),
-              RWSCAN_MAX_FLAGS);
-
 }
 
 void
-calculate_tcp_metrics(
-    rwRec              *event_flows,
-    event_metrics_t    *metrics)
+finish_tcp_metrics(
+    metric_state_t         *state,
+    event_metrics_t        *metrics)
 {
-    calculate_shared_metrics(event_flows, metrics);
+    if (state->sketch) {
+        event_sketch_finish(state->sketch, metrics);
+    }
 
     metrics->proto.tcp.noack_ratio =
         ((double) metrics->flows_noack / metrics->event_size);
@@ -13,126 +13,258 @@ RCSIDENT("$SiLK: rwscan_udp.c 945cf5167607 2019-01-07 18:54:17Z mthomas $");
 #include "rwscan.h"
 
 
+RWSCAN_KERNEL
 void
 increment_udp_counters(
-    rwRec              *rwrec,
-    event_metrics_t    *metrics)
+    const event_columns_t  *cols,
+    event_metrics_t        *metrics)
 {
-    if (rwRecGetPkts(rwrec) < SMALL_PKT_CUTOFF) {
-        metrics->flows_small++;
+    const uint32_t *pkts  = cols->pkts;
+    const uint32_t *bytes = cols->bytes;
+    uint32_t small = 0, payload = 0;
+    uint32_t i;
+
+    for (i = 0; i < cols->count; ++i) {
+        small += (pkts[i] < SMALL_PKT_CUTOFF);
+        /* bytes / pkts > PACKET_PAYLOAD_CUTOFF, without dividing */
+        payload += ((uint64_t)bytes[i]
+                    >= (uint64_t)(PACKET_PAYLOAD_CUTOFF + 1) * pkts[i]);
     }
+    metrics->flows_small        += small;
+    metrics->flows_with_payload += payload;
+}
+
+/*
+ *  udp_subnet_step(state, metrics, dip_curr, has_next, dip_next);
+ *
+ *    Update the runs of consecutive dips within a class C for the
+ *    flow to 'dip_curr', which is followed by a flow to 'dip_next'
+ *    when 'has_next' is true.  These depend only on the dips.
+ */
+static void
+udp_subnet_step(
+    metric_state_t     *state,
+    event_metrics_t    *metrics,
+    uint32_t            dip_curr,
+    int                 has_next,
+    uint32_t            dip_next)
+{
+    uint32_t     class_c_curr = dip_curr & 0xFFFFFF00;
+    uint32_t     class_c_next;
+
+    if (!has_next) {
+        class_c_next = class_c_curr - 0x100;
 
-    if ((rwRecGetBytes(rwrec) / rwRecGetPkts(rwrec)) > PACKET_PAYLOAD_CUTOFF) {
-        metrics->flows_with_payload++;
+        if (state->proto.udp.subnet_run > state->proto.udp.max_subnet_run) {
+            state->proto.udp.max_subnet_run = state->proto.udp.subnet_run;
+        }
+    } else {
+        class_c_next = dip_next & 0xFFFFFF00;
+
+        if (dip_curr != dip_next && class_c_curr == class_c_next) {
+            if (dip_next - dip_curr == 1) {
+                ++state->proto.udp.subnet_run;
+            } else if (state->proto.udp.subnet_run
+                       > state->proto.udp.max_subnet_run)
+            {
+                state->proto.udp.max_subnet_run = state->proto.udp.subnet_run;
+                state->proto.udp.subnet_run = 1;
+            }
+        }
     }
 
+    if (class_c_curr != class_c_next) {
+        if (state->proto.udp.max_subnet_run
+            > metrics->proto.udp.max_class_c_dip_run_length)
+        {
+            metrics->proto.udp.max_class_c_dip_run_length
+                = state->proto.udp.max_subnet_run;
+        }
+        state->proto.udp.max_subnet_run = 1;
+    }
 }
 
-void
-calculate_udp_metrics(
-    rwRec              *event_flows,
-    event_metrics_t    *metrics)
+/*
+ *  udp_low_port_step(state, metrics, dip_curr, dport_curr, has_next,
+ *                    dip_next, dport_next);
+ *
+ *    Update the low destination ports seen for the flow to 'dip_curr'
+ *    and 'dport_curr', which is followed by a flow to 'dip_next' and
+ *    'dport_next' when 'has_next' is true.
+ */
+static void
+udp_low_port_step(
+    metric_state_t     *state,
+    event_metrics_t    *metrics,
+    uint32_t            dip_curr,
+    uint16_t            dport_curr,
+    int                 has_next,
+    uint32_t            dip_next,
+    uint16_t            dport_next)
 {
-    uint32_t     i;
-    uint32_t     class_c_next = 0, class_c_curr = 0;
-    uint32_t     dip_next     = 0, dip_curr = 0;
-    sk_bitmap_t *low_dp_bitmap;
+    sk_bitmap_t *low_dp_bitmap = state->proto.udp.low_dp_bitmap;
     uint32_t     low_dp_hit = 0;
 
-    sk_bitmap_t *sp_bitmap;
-
-    uint32_t subnet_run = 1, max_subnet_run = 1;
-    rwRec   *rwcurr     = NULL;
-    rwRec   *rwnext     = NULL;
-
-    skBitmapCreate(&low_dp_bitmap, 1024);
-    skBitmapCreate(&sp_bitmap, UINT16_MAX);
-    if (!low_dp_bitmap || !sp_bitmap) {
-        skAppPrintOutOfMemory("bitmap");
-        skBitmapDestroy(&low_dp_bitmap);
-        skBitmapDestroy(&sp_bitmap);
-        return;
+    if (!has_next) {
+        dip_next = dip_curr - 1;
+    } else if (dip_curr == dip_next) {
+        skBitmapSetBit(low_dp_bitmap, dport_next);
     }
 
-    calculate_shared_metrics(event_flows, metrics);
-
-    rwcurr = event_flows;
-    rwnext = event_flows;
+    if (dip_curr != dip_next) {
+        uint32_t j;
+        uint32_t port_run = 0;
+
+        /* determine longest consecutive run of low ports */
+        for (j = 0; j < 1024; j++) {
+            if (skBitmapGetBit(low_dp_bitmap, j)) {
+                ++port_run;
+            } else if (port_run) {
+                if (port_run > metrics->proto.udp.max_low_port_run_length) {
+                    metrics->proto.udp.max_low_port_run_length = port_run;
+                }
+                port_run = 0;
+            }
+        }
 
-    skBitmapSetBit(low_dp_bitmap, rwRecGetDPort(rwcurr));
-    dip_next     = rwRecGetDIPv4(rwnext);
-    class_c_next = dip_next & 0xFFFFFF00;
+        /* determine number of hits on low ports */
+        low_dp_hit = skBitmapGetHighCount(low_dp_bitmap);
+        if (low_dp_hit > metrics->proto.udp.max_low_dp_hit) {
+            metrics->proto.udp.max_low_dp_hit = low_dp_hit;
+        }
 
-    for (i = 0; i < metrics->event_size; ++i, ++rwcurr) {
-        skBitmapSetBit(sp_bitmap, rwRecGetSPort(rwcurr));
+        /* reset */
+        skBitmapClearAllBits(low_dp_bitmap);
+        skBitmapSetBit(low_dp_bitmap, dport_curr);
+    }
+}
 
-        dip_curr     = dip_next;
-        class_c_curr = class_c_next;
+/*
+ *  udp_port_metrics(state, cols, metrics);
+ *
+ *    Update the source port map, the low port metrics, and the runs
+ *    of dips for the flows in 'cols'.
+ */
+static void
+udp_port_metrics(
+    metric_state_t         *state,
+    const event_columns_t  *cols,
+    event_metrics_t        *metrics)
+{
+    const uint32_t *dip   = cols->dip;
+    const uint16_t *sport = cols->sport;
+    const uint16_t *dport = cols->dport;
+    uint32_t        i;
 
-        if (i + 1 == metrics->event_size) {
-            rwnext = NULL;
-            dip_next = dip_curr - 1;
-            class_c_next = class_c_curr - 0x100;
+    for (i = 0; i < cols->count; ++i) {
+        skBitmapSetBit(state->proto.udp.sp_bitmap, sport[i]);
 
-            if (subnet_run > max_subnet_run) {
-                max_subnet_run = subnet_run;
-            }
+        /* the held flow is processed once the flow after it is known */
+        if (state->seen == 0) {
+            skBitmapSetBit(state->proto.udp.low_dp_bitmap, dport[i]);
         } else {
-            ++rwnext;
-
-            dip_next     = rwRecGetDIPv4(rwnext);
-            class_c_next = dip_next & 0xFFFFFF00;
-
-            if (dip_curr == dip_next) {
-                skBitmapSetBit(low_dp_bitmap, rwRecGetDPort(rwnext));
-            } else if (class_c_curr == class_c_next) {
-                if (dip_next - dip_curr == 1) {
-                    ++subnet_run;
-                } else if (subnet_run > max_subnet_run) {
-                    max_subnet_run = subnet_run;
-                    subnet_run = 1;
-                }
+            if (!state->no_dip_runs) {
+                udp_subnet_step(state, metrics, state->held_dip, 1, dip[i]);
             }
+            udp_low_port_step(state, metrics, state->held_dip,
+                              state->held_dport, 1, dip[i], dport[i]);
         }
+        state->held_dip = dip[i];
+        state->held_dport = dport[i];
+        ++state->seen;
+    }
+}
 
-        if (dip_curr != dip_next) {
-            uint32_t j;
-            uint32_t port_run = 0;
-
-            /* determine longest consecutive run of low ports */
-            for (j = 0; j < 1024; j++) {
-                if (skBitmapGetBit(low_dp_bitmap, j)) {
-                    ++port_run;
-                } else if (port_run) {
-                    if (port_run > metrics->proto.udp.max_low_port_run_length){
-                        metrics->proto.udp.max_low_port_run_length = port_run;
-                    }
-                    port_run = 0;
-                }
-            }
+void
+calculate_udp_metrics(
+    metric_state_t         *state,
+    const event_columns_t  *cols,
+    event_metrics_t        *metrics)
+{
+    event_columns_t tile;
+    uint32_t first;
 
-            /* determine number of hits on low ports */
-            low_dp_hit = skBitmapGetHighCount(low_dp_bitmap);
-            if (low_dp_hit > metrics->proto.udp.max_low_dp_hit) {
-                metrics->proto.udp.max_low_dp_hit = low_dp_hit;
-            }
+    if (state->sketch) {
+        increment_udp_counters(cols, metrics);
+        event_sketch_add(state->sketch, cols, metrics);
+        return;
+    }
+    /* make every pass over a tile of the flows while it is cached */
+    for (first = 0; first < cols->count; first += RWSCAN_KERNEL_TILE) {
+        event_columns_view(&tile, cols, first,
+                           ((cols->count - first < RWSCAN_KERNEL_TILE)
+                            ? (cols->count - first) : RWSCAN_KERNEL_TILE));
+        increment_udp_counters(&tile, metrics);
+        calculate_shared_metrics(state, &tile, metrics);
+        udp_port_metrics(state, &tile, metrics);
+    }
+}
 
-            /* reset */
-            skBitmapClearAllBits(low_dp_bitmap);
-            skBitmapSetBit(low_dp_bitmap, rwRecGetDPort(rwcurr));
+/*
+ *  calculate_udp_dip_runs(state, cols, metrics);
+ *
+ *    Update only the runs of consecutive dips for the flows in
+ *    'cols'; see calculate_udp_metrics().  Used for an event whose
+ *    other metrics are calculated by several threads.
+ */
+void
+calculate_udp_dip_runs(
+    metric_state_t         *state,
+    const event_columns_t  *cols,
+    event_metrics_t        *metrics)
+{
+    const uint32_t *dip = cols->dip;
+    uint32_t        i;
+
+    for (i = 0; i < cols->count; ++i) {
+        if (state->seen) {
+            udp_subnet_step(state, metrics, state->held_dip, 1, dip[i]);
         }
+        state->held_dip = dip[i];
+        ++state->seen;
+    }
+}
 
-        if (class_c_curr != class_c_next) {
-            if (max_subnet_run > metrics->proto.udp.max_class_c_dip_run_length)
-            {
-                metrics->proto.udp.max_class_c_dip_run_length = max_subnet_run;
+/*
+ *  end_udp_partition(state, metrics, dip_next, dport_next);
+ *
+ *    Finish the low port metrics of the last flow of a partition of
+ *    an event, given the first flow of the next partition, to
+ *    'dip_next' and 'dport_next'.  The dips of the two flows must
+ *    differ.
+ */
+void
+end_udp_partition(
+    metric_state_t     *state,
+    event_metrics_t    *metrics,
+    uint32_t            dip_next,
+    uint16_t            dport_next)
+{
+    if (state->seen) {
+        udp_low_port_step(state, metrics, state->held_dip,
+                          state->held_dport, 1, dip_next, dport_next);
+    }
+}
+
+void
+finish_udp_metrics(
+    metric_state_t         *state,
+    event_metrics_t        *metrics)
+{
+    if (state->sketch) {
+        event_sketch_finish(state->sketch, metrics);
+    } else {
+        if (state->seen) {
+            if (!state->no_dip_runs) {
+                udp_subnet_step(state, metrics, state->held_dip, 0, 0);
             }
-            max_subnet_run = 1;
+            udp_low_port_step(state, metrics, state->held_dip,
+                              state->held_dport, 0, 0, 0);
         }
+        metrics->unique_sp_count
+            = skBitmapGetHighCount(state->proto.udp.sp_bitmap);
     }
 
-    metrics->unique_sp_count = skBitmapGetHighCount(sp_bitmap);
-
     metrics->proto.udp.sp_dip_ratio =
         ((double) metrics->sp_count / metrics->unique_dsts);
     metrics->proto.udp.payload_ratio =
@@ -151,9 +283,6 @@ calculate_udp_metrics(
                            metrics->proto.udp.sp_dip_ratio,
                            metrics->proto.udp.payload_ratio,
                            metrics->proto.udp.unique_sp_ratio));
-
-    skBitmapDestroy(&low_dp_bitmap);
-    skBitmapDestroy(&sp_bitmap);
 }
 
 void
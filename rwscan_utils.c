@@ -27,6 +27,9 @@ typedef enum {
     OPT_TRW_INTERNAL_SET,
     OPT_TRW_THETA0,
     OPT_TRW_THETA1,
+    OPT_TRW_ALPHA,
+    OPT_TRW_BETA,
+    OPT_TRW_IN_READER,
     OPT_NO_TITLES,
     OPT_NO_COLUMNS,
     OPT_COLUMN_SEPARATOR,
@@ -37,6 +40,24 @@ typedef enum {
     OPT_SCANDB,
     OPT_WORKER_THREADS,
     OPT_WORK_QUEUE_DEPTH,
+    OPT_MEMORY_LIMIT,
+    OPT_COMPRESS_EVENTS,
+    OPT_SPILL_EVENTS,
+    OPT_SKETCH_EVENTS,
+    OPT_EVENT_FLOW_BUDGET,
+    OPT_EVENT_TIME_BUDGET,
+    OPT_PARALLEL_EVENTS,
+    OPT_READER_THREADS,
+    OPT_PREFETCH_FILES,
+    OPT_DECODE_AHEAD,
+    OPT_UNSORTED_INPUT,
+    OPT_SORT_BUFFER_SIZE,
+    OPT_MERGE_INPUTS,
+    OPT_START_DATE,
+    OPT_END_DATE,
+    OPT_CLASS,
+    OPT_TYPE,
+    OPT_SENSORS,
     OPT_VERBOSE_PROGRESS,
     OPT_VERBOSE_FLOWS,
     OPT_VERBOSE_RESULTS,
@@ -49,6 +70,9 @@ static struct option appOptions[] = {
     {"trw-internal-set",   REQUIRED_ARG, 0, OPT_TRW_INTERNAL_SET  },
     {"trw-theta0",         REQUIRED_ARG, 0, OPT_TRW_THETA0        },
     {"trw-theta1",         REQUIRED_ARG, 0, OPT_TRW_THETA1        },
+    {"trw-alpha",          REQUIRED_ARG, 0, OPT_TRW_ALPHA         },
+    {"trw-beta",           REQUIRED_ARG, 0, OPT_TRW_BETA          },
+    {"trw-in-reader",      NO_ARG,       0, OPT_TRW_IN_READER     },
     {"no-titles",          NO_ARG,       0, OPT_NO_TITLES         },
     {"no-columns",         NO_ARG,       0, OPT_NO_COLUMNS        },
     {"column-separator",   REQUIRED_ARG, 0, OPT_COLUMN_SEPARATOR  },
@@ -59,6 +83,24 @@ static struct option appOptions[] = {
     {"scandb",             NO_ARG,       0, OPT_SCANDB            },
     {"threads",            REQUIRED_ARG, 0, OPT_WORKER_THREADS    },
     {"queue-depth",        REQUIRED_ARG, 0, OPT_WORK_QUEUE_DEPTH  },
+    {"memory-limit",       REQUIRED_ARG, 0, OPT_MEMORY_LIMIT      },
+    {"compress-events",    REQUIRED_ARG, 0, OPT_COMPRESS_EVENTS   },
+    {"spill-events",       REQUIRED_ARG, 0, OPT_SPILL_EVENTS      },
+    {"sketch-events",      REQUIRED_ARG, 0, OPT_SKETCH_EVENTS     },
+    {"event-flow-budget",  REQUIRED_ARG, 0, OPT_EVENT_FLOW_BUDGET },
+    {"event-time-budget",  REQUIRED_ARG, 0, OPT_EVENT_TIME_BUDGET },
+    {"parallel-events",    REQUIRED_ARG, 0, OPT_PARALLEL_EVENTS   },
+    {"reader-threads",     REQUIRED_ARG, 0, OPT_READER_THREADS    },
+    {"prefetch-files",     REQUIRED_ARG, 0, OPT_PREFETCH_FILES    },
+    {"decode-ahead",       REQUIRED_ARG, 0, OPT_DECODE_AHEAD      },
+    {"unsorted-input",     NO_ARG,       0, OPT_UNSORTED_INPUT    },
+    {"sort-buffer-size",   REQUIRED_ARG, 0, OPT_SORT_BUFFER_SIZE  },
+    {"merge-inputs",       NO_ARG,       0, OPT_MERGE_INPUTS      },
+    {"start-date",         REQUIRED_ARG, 0, OPT_START_DATE        },
+    {"end-date",           REQUIRED_ARG, 0, OPT_END_DATE          },
+    {"class",              REQUIRED_ARG, 0, OPT_CLASS             },
+    {"type",               REQUIRED_ARG, 0, OPT_TYPE              },
+    {"sensors",            REQUIRED_ARG, 0, OPT_SENSORS           },
     {"verbose-progress",   REQUIRED_ARG, 0, OPT_VERBOSE_PROGRESS  },
     {"verbose-flows",      NO_ARG,       0, OPT_VERBOSE_FLOWS     },
     {"verbose-results",    OPTIONAL_ARG, 0, OPT_VERBOSE_RESULTS   },
@@ -77,6 +119,11 @@ static const char *appHelp[] = {
      "\tIP addresses. The TRW model requires a list of targeted IPs."),
      NULL, /* generate dynamically */
      NULL, /* generate dynamically */
+     NULL, /* generate dynamically */
+     NULL, /* generate dynamically */
+    ("Run the TRW test on each TCP event as it is read,\n"
+     "\tkeeping no more flows of a source once its verdict needs none.\n"
+     "\tDef. Test each event once it has been read"),
     "Do not print column headers. Def. Print titles.",
     "Disable fixed-width columnar output. Def. Columnar",
     "Use specified character between columns. Def. '|'",
@@ -89,6 +136,48 @@ static const char *appHelp[] = {
      "\t--no-final-delimiter)"),
     "Set number of worker threads to specified value. Def. 1",
     "Set the work queue depth to the specified value",
+    ("Stop reading input while the events waiting for\n"
+     "\tor being analyzed by the worker threads hold this many bytes.\n"
+     "\tDef. No limit"),
+    ("Compress the flows of an event, this many at a\n"
+     "\ttime, once it holds this many flows. Def. Keep flows as read"),
+    ("Move the compressed flows of an event that holds\n"
+     "\tmore than this many flows to a temporary file.  Implies\n"
+     "\t--compress-events. Def. Keep compressed flows in memory"),
+    ("Estimate the BLR features of an event that holds\n"
+     "\tat least this many flows in fixed memory instead of sorting it.\n"
+     "\tDef. Compute all features exactly"),
+    ("Run the BLR model on a sample of this many flows\n"
+     "\tof an event that holds more flows. Def. Use every flow"),
+    ("Run the BLR model on a sample of the flows of an\n"
+     "\tevent that has used this many milliseconds of CPU time.\n"
+     "\tDef. No limit"),
+    ("Sort and measure an event that holds at least\n"
+     "\tthis many flows using up to --threads threads. Def. One thread\n"
+     "\tper event"),
+    ("Set number of threads that read input files, each\n"
+     "\ttaking the next unread file. Def. 1"),
+    ("Read this many upcoming input files ahead of the\n"
+     "\treader threads, each in its own thread. Def. 0"),
+    ("Decode each input on its own thread, holding up\n"
+     "\tto this many batches of records ahead of the reader. Def. 0"),
+    ("Accept input in any order and group the records by\n"
+     "\tsip and proto in memory. Def. Input is sorted by sip, proto, dip"),
+    ("Sort unsorted input using a buffer of this many\n"
+     "\tbytes, spilling to temporary files when it fills.  Implies\n"
+     "\t--unsorted-input. Def. Group all records in memory"),
+    ("Merge the input files, each sorted by sip, proto,\n"
+     "\tand dip, so a source's flows form one event across all files.\n"
+     "\tDef. Process each file separately"),
+    ("Read repository files starting with this hour,\n"
+     "\tYYYY/MM/DD[:HH]; the time is in UTC. Def. Start of today"),
+    ("Read repository files ending with this hour,\n"
+     "\tYYYY/MM/DD[:HH]. Def. The start-date"),
+    ("Read repository files of this class. Def. Site's default class"),
+    ("Read repository files of these comma separated\n"
+     "\ttypes within the class, or 'all'. Def. Class's default types"),
+    ("Read repository files from these comma separated\n"
+     "\tsensor names or numbers. Def. All sensors in the class"),
     ("Report detailed progress, including a message\n"
      "\tas rwscan processes each CIDR block of the specified size. Def. No"),
     ("Write individual flows for events.  This produces\n"
@@ -118,7 +207,8 @@ appUsageLong(
      "\tDetects scanning activity in SiLK Flow records.  The output\n"  \
      "\tis a pipe-delimited textual file suitable for loading into a\n" \
      "\trelational database.  The input records should be pre-sorted\n" \
-     "\twith rwsort(1) by sip, proto, and dip.\n")
+     "\twith rwsort(1) by sip, proto, and dip unless --unsorted-input\n" \
+     "\tis given.\n")
 
     FILE *fh = USAGE_FH;
     unsigned int i;
@@ -144,6 +234,21 @@ appUsageLong(
                 "\tthat a connection succeeds given the hypothesis that the\n"
                 "\tremote source is benign.  Def. %.6f", TRW_DEFAULT_THETA1);
             break;
+          case OPT_TRW_ALPHA:
+            fprintf(
+                fh,
+                "Set alpha for the TRW model, the highest rate of\n"
+                "\tbenign sources that may be reported as scanners.\n"
+                "\tDef. %.6f",
+                TRW_DEFAULT_ALPHA);
+            break;
+          case OPT_TRW_BETA:
+            fprintf(
+                fh,
+                "Set beta for the TRW model, the lowest rate of\n"
+                "\tscanners that must be detected.  Def. %.6f",
+                TRW_DEFAULT_BETA);
+            break;
           default:
             fprintf(fh, "%s", appHelp[i]);
             break;
@@ -151,6 +256,7 @@ appUsageLong(
         fprintf(fh, "\n");
     }
     skOptionsCtxOptionsUsage(optctx, fh);
+    skOptionsTempDirUsage(fh);
     sksiteOptionsUsage(fh);
 }
 
@@ -213,6 +319,24 @@ appOptionsHandler(
         }
         break;
 
+      case OPT_TRW_ALPHA:
+        rv = skStringParseDouble(&options.trw_alpha, opt_arg, 0, 1);
+        if (rv) {
+            goto PARSE_ERROR;
+        }
+        break;
+
+      case OPT_TRW_BETA:
+        rv = skStringParseDouble(&options.trw_beta, opt_arg, 0, 1);
+        if (rv) {
+            goto PARSE_ERROR;
+        }
+        break;
+
+      case OPT_TRW_IN_READER:
+        options.trw_in_reader = 1;
+        break;
+
       case OPT_OUTPUT_PATH:
         if (options.output_file) {
             skAppPrintErr("Invalid %s: Switch used multiple times",
@@ -305,6 +429,138 @@ appOptionsHandler(
             goto PARSE_ERROR;
         }
         break;
+
+      case OPT_READER_THREADS:
+        rv = skStringParseUint32(&options.reader_threads, opt_arg, 1, 0);
+        if (rv) {
+            goto PARSE_ERROR;
+        }
+        break;
+
+      case OPT_PREFETCH_FILES:
+        rv = skStringParseUint32(&options.prefetch_files, opt_arg, 0,
+                                 RWSCAN_MAX_PREFETCH_FILES);
+        if (rv) {
+            goto PARSE_ERROR;
+        }
+        break;
+
+      case OPT_DECODE_AHEAD:
+        rv = skStringParseUint32(&options.decode_ahead, opt_arg, 2,
+                                 RWSCAN_MAX_DECODE_AHEAD);
+        if (rv) {
+            goto PARSE_ERROR;
+        }
+        break;
+
+      case OPT_UNSORTED_INPUT:
+        options.unsorted_input = 1;
+        break;
+
+      case OPT_MEMORY_LIMIT:
+        rv = skStringParseHumanUint64(&options.memory_limit, opt_arg,
+                                      SK_HUMAN_NORMAL);
+        if (rv) {
+            goto PARSE_ERROR;
+        }
+        if (options.memory_limit < RWSCAN_MIN_MEMORY_LIMIT) {
+            skAppPrintErr(("Invalid %s '%s': Value must be at least %d"),
+                          appOptions[opt_index].name, opt_arg,
+                          RWSCAN_MIN_MEMORY_LIMIT);
+            return 1;
+        }
+        break;
+
+      case OPT_COMPRESS_EVENTS:
+        rv = skStringParseUint32(&options.compress_events, opt_arg,
+                                 RWSCAN_MIN_COMPRESS_EVENTS, 0);
+        if (rv) {
+            goto PARSE_ERROR;
+        }
+        break;
+
+      case OPT_SPILL_EVENTS:
+        rv = skStringParseUint32(&options.spill_events, opt_arg,
+                                 RWSCAN_MIN_COMPRESS_EVENTS, 0);
+        if (rv) {
+            goto PARSE_ERROR;
+        }
+        break;
+
+      case OPT_SKETCH_EVENTS:
+        rv = skStringParseUint32(&options.sketch_events, opt_arg,
+                                 RWSCAN_MIN_SKETCH_EVENTS, 0);
+        if (rv) {
+            goto PARSE_ERROR;
+        }
+        break;
+
+      case OPT_EVENT_FLOW_BUDGET:
+        rv = skStringParseUint32(&options.budget_flows, opt_arg,
+                                 RWSCAN_MIN_BUDGET_FLOWS, 0);
+        if (rv) {
+            goto PARSE_ERROR;
+        }
+        break;
+
+      case OPT_EVENT_TIME_BUDGET:
+        rv = skStringParseUint32(&options.budget_msec, opt_arg, 1, 0);
+        if (rv) {
+            goto PARSE_ERROR;
+        }
+        break;
+
+      case OPT_PARALLEL_EVENTS:
+        rv = skStringParseUint32(&options.parallel_events, opt_arg,
+                                 RWSCAN_MIN_PARALLEL_EVENTS, 0);
+        if (rv) {
+            goto PARSE_ERROR;
+        }
+        break;
+
+      case OPT_SORT_BUFFER_SIZE:
+        rv = skStringParseHumanUint64(&options.sort_buffer_size, opt_arg,
+                                      SK_HUMAN_NORMAL);
+        if (rv) {
+            goto PARSE_ERROR;
+        }
+        if (options.sort_buffer_size < RWSCAN_MIN_SORT_BUFFER_SIZE) {
+            skAppPrintErr(("Invalid %s '%s': Value must be at least %d"),
+                          appOptions[opt_index].name, opt_arg,
+                          RWSCAN_MIN_SORT_BUFFER_SIZE);
+            return 1;
+        }
+        options.unsorted_input = 1;
+        break;
+
+      case OPT_MERGE_INPUTS:
+        options.merge_inputs = 1;
+        break;
+
+      case OPT_START_DATE:
+        options.start_date = opt_arg;
+        options.repo_selection = 1;
+        break;
+
+      case OPT_END_DATE:
+        options.end_date = opt_arg;
+        options.repo_selection = 1;
+        break;
+
+      case OPT_CLASS:
+        options.class_name = opt_arg;
+        options.repo_selection = 1;
+        break;
+
+      case OPT_TYPE:
+        options.type_names = opt_arg;
+        options.repo_selection = 1;
+        break;
+
+      case OPT_SENSORS:
+        options.sensor_names = opt_arg;
+        options.repo_selection = 1;
+        break;
     }
 
     return 0;                                    /* OK */
@@ -362,6 +618,8 @@ appSetup(
     options.delimiter               = '|';
     options.trw_theta0              = TRW_DEFAULT_THETA0;
     options.trw_theta1              = TRW_DEFAULT_THETA1;
+    options.trw_alpha               = TRW_DEFAULT_ALPHA;
+    options.trw_beta                = TRW_DEFAULT_BETA;
 
     memset(&trw_data, 0, sizeof(trw_data_t));
     pthread_mutex_init(&trw_data.mutex, NULL);
@@ -372,6 +630,7 @@ appSetup(
     if (skOptionsCtxCreate(&optctx, optctx_flags)
         || skOptionsCtxOptionsRegister(optctx)
         || skOptionsRegister(appOptions, &appOptionsHandler, NULL)
+        || skOptionsTempDirRegister(&options.temp_directory)
         || sksiteOptionsRegister(SK_SITE_FLAG_CONFIG_FILE))
     {
         skAppPrintErr("Unable to register options");
@@ -391,6 +650,50 @@ appSetup(
         skAppUsage();
     }
 
+    if (options.repo_selection) {
+        /* the repository files are in time order, so the records must
+         * be grouped by sip and proto as for unsorted input */
+        if (options.merge_inputs) {
+            skAppPrintErr("Cannot use --%s with the repository file"
+                          " selection switches",
+                          appOptions[OPT_MERGE_INPUTS].name);
+            skAppUsage();
+        }
+        if (skOptionsCtxCountArgs(optctx) > 0) {
+            skAppPrintErr("Cannot name input files when using the"
+                          " repository file selection switches");
+            skAppUsage();
+        }
+        if (repo_selection_setup()) {
+            exit(EXIT_FAILURE);
+        }
+        options.unsorted_input = 1;
+    }
+
+    if (options.merge_inputs && options.unsorted_input) {
+        skAppPrintErr("Cannot use --%s with --%s or --%s",
+                      appOptions[OPT_MERGE_INPUTS].name,
+                      appOptions[OPT_UNSORTED_INPUT].name,
+                      appOptions[OPT_SORT_BUFFER_SIZE].name);
+        skAppUsage();
+    }
+    if (options.spill_events) {
+        if (options.compress_events == 0) {
+            options.compress_events = options.spill_events;
+        } else if (options.spill_events < options.compress_events) {
+            skAppPrintErr("The --%s value must not be less than --%s",
+                          appOptions[OPT_SPILL_EVENTS].name,
+                          appOptions[OPT_COMPRESS_EVENTS].name);
+            skAppUsage();
+        }
+    }
+    if (options.merge_inputs && options.reader_threads > 1) {
+        skAppPrintErr("Cannot use --%s with --%s",
+                      appOptions[OPT_MERGE_INPUTS].name,
+                      appOptions[OPT_READER_THREADS].name);
+        skAppUsage();
+    }
+
     if (options.worker_threads == 0) {
         /* if no thread options were specified, use defaults */
         options.worker_threads   = 1;
@@ -432,6 +735,24 @@ appSetup(
         skStreamDestroy(&stream);
         skIPTreeCreate(&(trw_data.benign));
         skIPTreeCreate(&(trw_data.scanners));
+
+        if (options.trw_alpha <= 0.0 || options.trw_beta >= 1.0
+            || options.trw_alpha >= options.trw_beta)
+        {
+            skAppPrintErr(("Invalid --%s and --%s: Must have"
+                           " 0 < alpha < beta < 1"),
+                          appOptions[OPT_TRW_ALPHA].name,
+                          appOptions[OPT_TRW_BETA].name);
+            exit(EXIT_FAILURE);
+        }
+        /* the TRW model keeps the log of the likelihood ratio, so each
+         * connection adds one of these */
+        trw_data.log_hit  = log(options.trw_theta1 / options.trw_theta0);
+        trw_data.log_miss = log((1.0 - options.trw_theta1)
+                                / (1.0 - options.trw_theta0));
+        trw_data.log_eta0 = log((1.0 - options.trw_beta)
+                                / (1.0 - options.trw_alpha));
+        trw_data.log_eta1 = log(options.trw_beta / options.trw_alpha);
     }
 
     if ((options.worker_threads > 1) && options.verbose_results) {
@@ -490,74 +811,110 @@ appTeardown(
         skIPSetDestroy(&(trw_data.existing));
     }
 
+    repo_selection_teardown();
     skOptionsCtxDestroy(&optctx);
     skAppUnregister();
 }
 
+
+/*
+ *  flow_from_rwrec(flow, rwrec);
+ *
+ *    Fill 'flow' with the fields of 'rwrec' that the scan models use.
+ */
+void
+flow_from_rwrec(
+    rwscan_flow_t      *flow,
+    const rwRec        *rwrec)
+{
+    sktime_t stime = rwRecGetStartTime(rwrec);
+
+    flow->sip        = rwRecGetSIPv4(rwrec);
+    flow->dip        = rwRecGetDIPv4(rwrec);
+    flow->stime      = (uint32_t)(stime / 1000);
+    flow->stime_msec = (uint16_t)(stime % 1000);
+    flow->elapsed    = rwRecGetElapsed(rwrec);
+    flow->pkts       = rwRecGetPkts(rwrec);
+    flow->bytes      = rwRecGetBytes(rwrec);
+    flow->sport      = rwRecGetSPort(rwrec);
+    flow->dport      = rwRecGetDPort(rwrec);
+    flow->proto      = rwRecGetProto(rwrec);
+    flow->flags      = rwRecGetFlags(rwrec);
+}
+
+
 int
-rwrec_compare_proto_stime(
+flow_compare_sip_proto_dip(
     const void         *a,
     const void         *b)
 {
-    rwRec *pa = (rwRec *) a;
-    rwRec *pb = (rwRec *) b;
+    rwscan_flow_t *pa = (rwscan_flow_t *) a;
+    rwscan_flow_t *pb = (rwscan_flow_t *) b;
 
-    if (rwRecGetProto(pa) > rwRecGetProto(pb)) {
+    if (flowGetSIPv4(pa) > flowGetSIPv4(pb)) {
         return 1;
-    } else if (rwRecGetProto(pa) < rwRecGetProto(pb)) {
+    } else if (flowGetSIPv4(pa) < flowGetSIPv4(pb)) {
         return -1;
-    } else if (rwRecGetStartTime(pa) > rwRecGetStartTime(pb)) {
+    } else if (flowGetProto(pa) > flowGetProto(pb)) {
         return 1;
-    } else if (rwRecGetStartTime(pa) < rwRecGetStartTime(pb)) {
+    } else if (flowGetProto(pa) < flowGetProto(pb)) {
         return -1;
-    } else {
-        return 0;
-    }
-}
-
-int
-rwrec_compare_dip(
-    const void         *a,
-    const void         *b)
-{
-    rwRec *pa = (rwRec *) a;
-    rwRec *pb = (rwRec *) b;
-
-    /*
-     * TODOjds:  we could (should) use the comparator here
-     */
-
-    if (rwRecGetDIPv4(pa) > rwRecGetDIPv4(pb)) {
+    } else if (flowGetDIPv4(pa) > flowGetDIPv4(pb)) {
         return 1;
-    } else if (rwRecGetDIPv4(pa) < rwRecGetDIPv4(pb)) {
+    } else if (flowGetDIPv4(pa) < flowGetDIPv4(pb)) {
         return -1;
-    } else {
-        return 0;
     }
+
+    /* The order of the flows to a dip decides the TRW model's view of
+     * the dip and the event's end time, so break ties on every other
+     * field; the events then do not depend on the order of the input,
+     * and match those of input sorted by rwsort(1) with
+     * --fields=sip,proto,dip,sport,dport,stime,duration,packets,bytes,flags */
+    if (flowGetSPort(pa) != flowGetSPort(pb)) {
+        return (flowGetSPort(pa) > flowGetSPort(pb)) ? 1 : -1;
+    }
+    if (flowGetDPort(pa) != flowGetDPort(pb)) {
+        return (flowGetDPort(pa) > flowGetDPort(pb)) ? 1 : -1;
+    }
+    if (flowGetStartTime(pa) != flowGetStartTime(pb)) {
+        return (flowGetStartTime(pa) > flowGetStartTime(pb)) ? 1 : -1;
+    }
+    if (pa->elapsed != pb->elapsed) {
+        return (pa->elapsed > pb->elapsed) ? 1 : -1;
+    }
+    if (flowGetPkts(pa) != flowGetPkts(pb)) {
+        return (flowGetPkts(pa) > flowGetPkts(pb)) ? 1 : -1;
+    }
+    if (flowGetBytes(pa) != flowGetBytes(pb)) {
+        return (flowGetBytes(pa) > flowGetBytes(pb)) ? 1 : -1;
+    }
+    if (flowGetFlags(pa) != flowGetFlags(pb)) {
+        return (flowGetFlags(pa) > flowGetFlags(pb)) ? 1 : -1;
+    }
+    return 0;
 }
 
 int
-rwrec_compare_dip_sport(
+flow_compare_dip_sport(
     const void         *a,
     const void         *b)
 {
-    rwRec *pa = (rwRec *) a;
-    rwRec *pb = (rwRec *) b;
+    rwscan_flow_t *pa = (rwscan_flow_t *) a;
+    rwscan_flow_t *pb = (rwscan_flow_t *) b;
 
-    /*
-     * TODOjds:  comparator
-     */
-    if (rwRecGetDIPv4(pa) > rwRecGetDIPv4(pb)) {
+    /* the qsort() fallback of flow_sort() and the reference order
+     * of flow_order_key() */
+    if (flowGetDIPv4(pa) > flowGetDIPv4(pb)) {
         return 1;
-    } else if (rwRecGetDIPv4(pa) < rwRecGetDIPv4(pb)) {
+    } else if (flowGetDIPv4(pa) < flowGetDIPv4(pb)) {
         return -1;
-    } else if (!(rwRecGetProto(pa) == IPPROTO_TCP)
-               || (rwRecGetProto(pa) == IPPROTO_UDP))
+    } else if (!(flowGetProto(pa) == IPPROTO_TCP)
+               || (flowGetProto(pa) == IPPROTO_UDP))
     {
         return 0;
-    } else if (rwRecGetSPort(pa) > rwRecGetSPort(pb)) {
+    } else if (flowGetSPort(pa) > flowGetSPort(pb)) {
         return 1;
-    } else if (rwRecGetSPort(pa) < rwRecGetSPort(pb)) {
+    } else if (flowGetSPort(pa) < flowGetSPort(pb)) {
         return -1;
     } else {
         return 0;
@@ -566,56 +923,314 @@ rwrec_compare_dip_sport(
 
 
 
+/*
+ *  status = event_columns_reserve(cols, count);
+ *
+ *    Grow the arrays of 'cols' as needed to hold 'count' flows.  The
+ *    contents of the columns are not preserved when they grow.
+ *    Return 0 on success or -1 on allocation failure.
+ */
+int
+event_columns_reserve(
+    event_columns_t        *cols,
+    uint32_t                count)
+{
+    if (count > cols->capacity) {
+        uint8_t *buf;
+        uint32_t capacity = cols->capacity ? cols->capacity : 1024;
+
+        while (capacity < count) {
+            capacity *= 2;
+        }
+        /* one allocation holds every column; the widest come first so
+         * that each column is aligned */
+        buf = (uint8_t*)malloc((size_t)capacity
+                               * (3 * sizeof(uint32_t) + 2 * sizeof(uint16_t)
+                                  + sizeof(uint8_t)));
+        if (buf == NULL) {
+            return -1;
+        }
+        free(cols->dip);
+        cols->dip      = (uint32_t*)buf;
+        cols->pkts     = cols->dip + capacity;
+        cols->bytes    = cols->pkts + capacity;
+        cols->sport    = (uint16_t*)(cols->bytes + capacity);
+        cols->dport    = cols->sport + capacity;
+        cols->flags    = (uint8_t*)(cols->dport + capacity);
+        cols->capacity = capacity;
+    }
+    return 0;
+}
+
+
+/*
+ *  event_columns_fill(cols, first, flows, count);
+ *
+ *    Fill the columns of 'cols' from index 'first' with the 'count'
+ *    flows in 'flows'.  The columns must have room for them; see
+ *    event_columns_reserve().  The count of 'cols' is not changed.
+ */
 void
-calculate_shared_metrics(
-    rwRec              *event_flows,
-    event_metrics_t    *metrics)
+event_columns_fill(
+    event_columns_t        *cols,
+    uint32_t                first,
+    const rwscan_flow_t    *flows,
+    uint32_t                count)
 {
-    uint32_t last_dip;
-    uint32_t last_sp;
-    uint32_t last_dp  = 0xffffffff;
     uint32_t i;
-    rwRec   *rwcurr   = NULL;
 
-    metrics->sp_count    = 1;
-    metrics->unique_dips = 1;
-    metrics->unique_dsts = 0;
+    for (i = 0; i < count; ++i) {
+        cols->dip[first + i]   = flowGetDIPv4(&flows[i]);
+        cols->pkts[first + i]  = flowGetPkts(&flows[i]);
+        cols->bytes[first + i] = flowGetBytes(&flows[i]);
+        cols->sport[first + i] = flowGetSPort(&flows[i]);
+        cols->dport[first + i] = flowGetDPort(&flows[i]);
+        cols->flags[first + i] = flowGetFlags(&flows[i]);
+    }
+}
+
+
+/*
+ *  status = event_columns_load(cols, flows, count);
+ *
+ *    Fill the columns of 'cols' from the 'count' flows in 'flows',
+ *    growing the arrays as needed.  Return 0 on success or -1 on
+ *    allocation failure.
+ */
+int
+event_columns_load(
+    event_columns_t        *cols,
+    const rwscan_flow_t    *flows,
+    uint32_t                count)
+{
+    if (event_columns_reserve(cols, count)) {
+        return -1;
+    }
+    event_columns_fill(cols, 0, flows, count);
+    cols->count = count;
+
+    return 0;
+}
 
-    last_dip = rwRecGetDIPv4(&event_flows[0]);
-    last_sp  = rwRecGetSPort(&event_flows[0]);
 
-    for (i = 0; i < metrics->event_size; i++) {
-        rwcurr = &(event_flows[i]);
+/*
+ *  event_columns_view(view, cols, first, count);
+ *
+ *    Make 'view' refer to the 'count' flows of 'cols' from index
+ *    'first' without copying them.
+ */
+void
+event_columns_view(
+    event_columns_t        *view,
+    const event_columns_t  *cols,
+    uint32_t                first,
+    uint32_t                count)
+{
+    view->dip      = cols->dip + first;
+    view->pkts     = cols->pkts + first;
+    view->bytes    = cols->bytes + first;
+    view->sport    = cols->sport + first;
+    view->dport    = cols->dport + first;
+    view->flags    = cols->flags + first;
+    view->count    = count;
+    view->capacity = count;
+}
 
-        metrics->pkts  += rwRecGetPkts(rwcurr);
-        metrics->bytes += rwRecGetBytes(rwcurr);
 
-        if (rwRecGetDIPv4(rwcurr)== last_dip) {
-            if ((rwRecGetSPort(rwcurr) != last_sp)) {
-                metrics->sp_count++;
-            }
-        } else {
-            metrics->sp_count = 1;
-            metrics->unique_dips++;
-        }
-        /* FIXME: should "unique_dsts be unique dips, or unique dip+dport ? */
-        if ((rwRecGetDIPv4(rwcurr) != last_dip)
-            || (rwRecGetDPort(rwcurr) != last_dp))
-        {
-            metrics->unique_dsts++;
+/*
+ *  status = event_columns_gather(cols, flows, index, count);
+ *
+ *    Fill the columns of 'cols' with the 'count' flows of 'flows'
+ *    whose positions are listed in 'index', in that order, growing the
+ *    arrays as needed.  Return 0 on success or -1 on allocation
+ *    failure.
+ */
+int
+event_columns_gather(
+    event_columns_t        *cols,
+    const rwscan_flow_t    *flows,
+    const uint32_t         *index,
+    uint32_t                count)
+{
+    const rwscan_flow_t *flow;
+    uint32_t i;
+
+    if (event_columns_reserve(cols, count)) {
+        return -1;
+    }
+    for (i = 0; i < count; ++i) {
+        flow = &flows[index[i]];
+        cols->dip[i]   = flowGetDIPv4(flow);
+        cols->pkts[i]  = flowGetPkts(flow);
+        cols->bytes[i] = flowGetBytes(flow);
+        cols->sport[i] = flowGetSPort(flow);
+        cols->dport[i] = flowGetDPort(flow);
+        cols->flags[i] = flowGetFlags(flow);
+    }
+    cols->count = count;
+
+    return 0;
+}
+
+
+/*
+ *  event_columns_free(cols);
+ *
+ *    Release the arrays held by 'cols'.
+ */
+void
+event_columns_free(
+    event_columns_t    *cols)
+{
+    free(cols->dip);
+    memset(cols, 0, sizeof(event_columns_t));
+}
+
+
+/*
+ *  status = metric_state_init(state, proto);
+ *
+ *    Prepare 'state' for the metric calculations of an event of
+ *    protocol 'proto'.  Return 0 on success or -1 on allocation
+ *    failure.
+ */
+int
+metric_state_init(
+    metric_state_t     *state,
+    uint8_t             proto)
+{
+    memset(state, 0, sizeof(metric_state_t));
+
+    switch (proto) {
+      case IPPROTO_UDP:
+        skBitmapCreate(&state->proto.udp.low_dp_bitmap, 1024);
+        skBitmapCreate(&state->proto.udp.sp_bitmap, UINT16_MAX);
+        if (!state->proto.udp.low_dp_bitmap || !state->proto.udp.sp_bitmap) {
+            skAppPrintOutOfMemory("bitmap");
+            metric_state_free(state, proto);
+            return -1;
         }
+        state->proto.udp.subnet_run = 1;
+        state->proto.udp.max_subnet_run = 1;
+        break;
+      case IPPROTO_ICMP:
+        state->proto.icmp.run = 1;
+        state->proto.icmp.max_run_curr = 1;
+        state->proto.icmp.class_c_run = 1;
+        state->proto.icmp.max_class_c_run = 1;
+        state->proto.icmp.class_c_dip_count = 1;
+        state->proto.icmp.max_class_c_dip_count = 1;
+        break;
+      default:
+        break;
+    }
+    return 0;
+}
+
+
+/*
+ *  metric_state_free(state, proto);
+ *
+ *    Release the memory held by 'state', which was initialized for
+ *    protocol 'proto', including its sketches.
+ */
+void
+metric_state_free(
+    metric_state_t     *state,
+    uint8_t             proto)
+{
+    event_sketch_destroy(&state->sketch);
+    if (proto == IPPROTO_UDP) {
+        skBitmapDestroy(&state->proto.udp.low_dp_bitmap);
+        skBitmapDestroy(&state->proto.udp.sp_bitmap);
+    }
+}
+
 
-        last_sp  = rwRecGetSPort(rwcurr);
-        last_dp  = rwRecGetDPort(rwcurr);
-        last_dip = rwRecGetDIPv4(rwcurr);
+/*
+ *  calculate_shared_metrics(state, cols, metrics);
+ *
+ *    Add the flows in 'cols' to the packet and byte sums and to the
+ *    counts of dips, destinations, and source ports shared by the
+ *    protocols.  Each flow is compared only with the one before it,
+ *    so the main loop carries no state from one flow to the next and
+ *    can be vectorized; the source ports are then counted over the
+ *    flows to the last dip only.
+ */
+RWSCAN_KERNEL
+void
+calculate_shared_metrics(
+    metric_state_t         *state,
+    const event_columns_t  *cols,
+    event_metrics_t        *metrics)
+{
+    const uint32_t *dip   = cols->dip;
+    const uint16_t *sport = cols->sport;
+    const uint16_t *dport = cols->dport;
+    uint32_t pkts;
+    uint32_t bytes;
+    uint32_t dips;
+    uint32_t dsts;
+    uint32_t dip_change;
+    uint32_t last_group;        /* one more than the index of the
+                                 * last flow to a new dip, or 0 */
+    uint32_t sp_count;
+    uint32_t i;
+
+    if (cols->count == 0) {
+        return;
+    }
+    if (state->shared_seen == 0) {
+        metrics->sp_count    = 1;
+        metrics->unique_dips = 1;
+        metrics->unique_dsts = 0;
+        state->last_dip = dip[0];
+        state->last_sp  = sport[0];
+        state->last_dp  = 0xffffffff;
+    }
+    state->shared_seen += cols->count;
+
+    /* FIXME: should "unique_dsts be unique dips, or unique dip+dport ? */
+    pkts  = cols->pkts[0];
+    bytes = cols->bytes[0];
+    dips  = (dip[0] != state->last_dip);
+    dsts  = (dips | (dport[0] != state->last_dp));
+    last_group = dips;
+    for (i = 1; i < cols->count; i++) {
+        pkts  += cols->pkts[i];
+        bytes += cols->bytes[i];
+        dip_change = (dip[i] != dip[i - 1]);
+        dips += dip_change;
+        dsts += (dip_change | (dport[i] != dport[i - 1]));
+        last_group = (dip_change ? i + 1 : last_group);
+    }
+    metrics->pkts        += pkts;
+    metrics->bytes       += bytes;
+    metrics->unique_dips += dips;
+    metrics->unique_dsts += dsts;
+
+    /* the source port count restarts at each new dip */
+    if (last_group) {
+        sp_count = 1;
+        i = last_group;
+    } else {
+        sp_count = metrics->sp_count + (sport[0] != state->last_sp);
+        i = 1;
+    }
+    for ( ; i < cols->count; i++) {
+        sp_count += (sport[i] != sport[i - 1]);
     }
+    metrics->sp_count = sp_count;
 
+    state->last_dip = dip[cols->count - 1];
+    state->last_sp  = sport[cols->count - 1];
+    state->last_dp  = dport[cols->count - 1];
 }
 
 
 void
 print_flow(
-    const rwRec        *rwcurr)
+    const rwscan_flow_t *rwcurr)
 {
     char sipstr[SKIPADDR_STRLEN];
     char dipstr[SKIPADDR_STRLEN];
@@ -623,25 +1238,25 @@ print_flow(
     char flag_string[SK_TCPFLAGS_STRLEN];
     skipaddr_t ipaddr;
 
-    rwRecMemGetSIP(rwcurr, &ipaddr);
+    skipaddrSetV4(&ipaddr, &rwcurr->sip);
     skipaddrString(sipstr, &ipaddr, 0);
-    rwRecMemGetDIP(rwcurr, &ipaddr);
+    skipaddrSetV4(&ipaddr, &rwcurr->dip);
     skipaddrString(dipstr, &ipaddr, 0);
-    sktimestamp_r(timestr, rwRecGetStartTime(rwcurr), 0);
-    switch (rwRecGetProto(rwcurr)) {
+    sktimestamp_r(timestr, flowGetStartTime(rwcurr), 0);
+    switch (flowGetProto(rwcurr)) {
       case IPPROTO_ICMP:
       {
           uint8_t type = 0, code = 0;
 
-          type = rwRecGetIcmpType(rwcurr);
-          code = rwRecGetIcmpCode(rwcurr);
+          type = flowGetIcmpType(rwcurr);
+          code = flowGetIcmpCode(rwcurr);
 
           fprintf(RWSCAN_VERBOSE_FH,
                   "%-4d %16s -> %16s icmp(%03u,%03u) %-24s %6u %3u %6u %8s\n",
-                  rwRecGetProto(rwcurr), sipstr, dipstr, type, code, timestr,
-                  rwRecGetBytes(rwcurr), rwRecGetPkts(rwcurr),
-                  (rwRecGetBytes(rwcurr) / rwRecGetPkts(rwcurr)),
-                  skTCPFlagsString(rwRecGetFlags(rwcurr), flag_string,
+                  flowGetProto(rwcurr), sipstr, dipstr, type, code, timestr,
+                  flowGetBytes(rwcurr), flowGetPkts(rwcurr),
+                  (flowGetBytes(rwcurr) / flowGetPkts(rwcurr)),
+                  skTCPFlagsString(flowGetFlags(rwcurr), flag_string,
                                    SK_PADDED_FLAGS));
       }
         break;
@@ -650,11 +1265,11 @@ print_flow(
       case IPPROTO_UDP:
         fprintf(RWSCAN_VERBOSE_FH,
                 "%-4d %16s:%5d -> %16s:%5d %-24s %6u %3u %6u %8s\n",
-                rwRecGetProto(rwcurr), sipstr, rwRecGetSPort(rwcurr),
-                dipstr, rwRecGetDPort(rwcurr), timestr,
-                rwRecGetBytes(rwcurr), rwRecGetPkts(rwcurr),
-                (rwRecGetBytes(rwcurr) / rwRecGetPkts(rwcurr)),
-                skTCPFlagsString(rwRecGetFlags(rwcurr), flag_string,
+                flowGetProto(rwcurr), sipstr, flowGetSPort(rwcurr),
+                dipstr, flowGetDPort(rwcurr), timestr,
+                flowGetBytes(rwcurr), flowGetPkts(rwcurr),
+                (flowGetBytes(rwcurr) / flowGetPkts(rwcurr)),
+                skTCPFlagsString(flowGetFlags(rwcurr), flag_string,
                                  SK_PADDED_FLAGS));
         break;
 
@@ -13,12 +13,249 @@ RCSIDENT("$SiLK: rwscan_workqueue.c 945cf5167607 2019-01-07 18:54:17Z mthomas $"
 #include "rwscan_workqueue.h"
 
 
+/* number of cells in the ring of a queue created without a maximum
+ * depth; such a queue holds at most this many items */
+#define WORKQUEUE_DEFAULT_CELLS  1024
 
+/* number of times a consumer looks for an item before parking */
+#define WORKQUEUE_SPIN_COUNT  64
+
+#define ATOMIC_LOAD(p)        __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define ATOMIC_STORE(p, v)    __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define ATOMIC_ADD(p, v)      __atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define ATOMIC_SUB(p, v)      __atomic_sub_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define ATOMIC_CAS(p, e, v)                                     \
+    __atomic_compare_exchange_n((p), (e), (v), 1,               \
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#define ATOMIC_FENCE()        __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/* what reserve() counts against the limits of a queue */
+#define RESERVE_SLOT   1
+#define RESERVE_BYTES  2
+#define RESERVE_ALL    (RESERVE_SLOT | RESERVE_BYTES)
+
+
+/*
+ *  status = ring_push(q, node);
+ *
+ *    Add 'node' to the ring 'q'.  Return 0 on success or -1 if the
+ *    ring is full.
+ */
+static int
+ring_push(
+    work_queue_lane_t  *q,
+    work_queue_node_t  *node)
+{
+    work_queue_cell_t *cell;
+    size_t pos;
+    size_t seq;
+
+    pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        cell = &q->cells[pos & q->mask];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        } else if ((ssize_t)(seq - pos) < 0) {
+            /* the cell still holds the item from the previous lap */
+            return -1;
+        } else {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+    cell->node = node;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+/*
+ *  node = ring_pop(q);
+ *
+ *    Remove and return the oldest node in the ring 'q', or return
+ *    NULL if the ring is empty.
+ */
+static work_queue_node_t *
+ring_pop(
+    work_queue_lane_t  *q)
+{
+    work_queue_cell_t *cell;
+    work_queue_node_t *node;
+    size_t pos;
+    size_t seq;
+
+    pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    for (;;) {
+        cell = &q->cells[pos & q->mask];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos + 1) {
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        } else if ((ssize_t)(seq - (pos + 1)) < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
+    }
+    node = cell->node;
+    __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    return node;
+}
+
+
+/*
+ *  node = take(q, lane);
+ *
+ *    Remove and return a node from lane 'lane' of 'q', or when that
+ *    lane is empty, from the next lane that holds one.  Return NULL if
+ *    every lane is empty.
+ */
+static work_queue_node_t *
+take(
+    work_queue_t       *q,
+    uint32_t            lane)
+{
+    work_queue_node_t *node;
+    uint32_t i;
+
+    for (i = 0; i < q->lane_count; ++i) {
+        node = ring_pop(&q->lanes[(lane + i) % q->lane_count]);
+        if (node != NULL) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ *  wake_waiters(q, cond, waiters, broadcast);
+ *
+ *    Wake the threads parked on 'cond' of 'q', or one of them when
+ *    'broadcast' is false.  Does nothing when the count of parked
+ *    threads at 'waiters' is zero, so that the mutex is only taken
+ *    when some thread is parked.
+ */
+static void
+wake_waiters(
+    work_queue_t       *q,
+    pthread_cond_t     *cond,
+    int                *waiters,
+    int                 broadcast)
+{
+    ATOMIC_FENCE();
+    if (ATOMIC_LOAD(waiters) == 0) {
+        return;
+    }
+    pthread_mutex_lock(&q->mutex);
+    if (broadcast) {
+        pthread_cond_broadcast(cond);
+    } else {
+        pthread_cond_signal(cond);
+    }
+    pthread_mutex_unlock(&q->mutex);
+}
+
+
+/*
+ *  ok = reserve(q, size, what);
+ *
+ *    Count a new item of 'size' bytes against the depth limit of 'q'
+ *    when 'what' includes RESERVE_SLOT and against its byte limit
+ *    when 'what' includes RESERVE_BYTES.  Return 1 on success, or 0
+ *    if the item does not fit.  An item larger than the byte limit
+ *    fits once the queue holds no bytes.
+ */
+static int
+reserve(
+    work_queue_t       *q,
+    size_t              size,
+    int                 what)
+{
+    int inflight;
+    uint64_t bytes;
+
+    if (what & RESERVE_SLOT) {
+        inflight = ATOMIC_LOAD(&q->inflight);
+        do {
+            if (q->maxdepth > 0 && inflight >= q->maxdepth) {
+                return 0;
+            }
+        } while (!ATOMIC_CAS(&q->inflight, &inflight, inflight + 1));
+    }
+
+    if (what & RESERVE_BYTES) {
+        bytes = ATOMIC_LOAD(&q->bytes);
+        do {
+            if (q->maxbytes > 0 && bytes > 0 && bytes + size > q->maxbytes) {
+                /* give back the slot.  A producer that found no slot
+                 * because of it is woken when the bytes are
+                 * released. */
+                if (what & RESERVE_SLOT) {
+                    ATOMIC_SUB(&q->inflight, 1);
+                }
+                return 0;
+            }
+        } while (!ATOMIC_CAS(&q->bytes, &bytes, bytes + size));
+    }
+
+    return 1;
+}
+
+
+/*
+ *  wait_reserve(q, size, what);
+ *
+ *    Count a new item as reserve() does, parking until it fits.
+ */
+static void
+wait_reserve(
+    work_queue_t       *q,
+    size_t              size,
+    int                 what)
+{
+    if (reserve(q, size, what)) {
+        return;
+    }
+    /* queue is full - park until a slot has become open.  A node
+     * larger than maxbytes is accepted once the queue is empty. */
+    pthread_mutex_lock(&q->mutex);
+    ATOMIC_ADD(&q->avail_waiters, 1);
+    ATOMIC_FENCE();
+    while (!reserve(q, size, what)) {
+        pthread_cond_wait(&q->cond_avail, &q->mutex);
+    }
+    ATOMIC_SUB(&q->avail_waiters, 1);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+
+/*
+ * Create a queue holding at most 'maxdepth' nodes, and with nodes
+ * totalling at most 'maxbytes' bytes queued or being processed unless
+ * 'maxbytes' is 0, that has 'lanes' lanes.  Every lane can hold the
+ * whole queue, so a producer never finds its lane full.
+ */
 work_queue_t *
 workqueue_create(
-    uint32_t            maxdepth)
+    uint32_t            maxdepth,
+    uint64_t            maxbytes,
+    uint32_t            lanes)
 {
     work_queue_t *q;
+    work_queue_lane_t *lane;
+    size_t cells;
+    size_t i;
+    uint32_t j;
 
     q = (work_queue_t *) calloc(1, sizeof(work_queue_t));
     if (q == NULL) {
@@ -29,7 +266,36 @@ workqueue_create(
     pthread_cond_init(&q->cond_posted, NULL);
     pthread_cond_init(&q->cond_avail, NULL);
 
+    if (maxdepth == 0) {
+        maxdepth = WORKQUEUE_DEFAULT_CELLS;
+    }
+    if (lanes == 0) {
+        lanes = 1;
+    }
+    for (cells = 1; cells < maxdepth; cells <<= 1)
+        ;                       /* empty */
+    q->lanes = (work_queue_lane_t *) calloc(lanes, sizeof(work_queue_lane_t));
+    if (q->lanes == NULL) {
+        workqueue_destroy(q);
+        return (work_queue_t *) NULL;
+    }
+    q->lane_count = lanes;
+    for (j = 0; j < lanes; ++j) {
+        lane = &q->lanes[j];
+        lane->cells = (work_queue_cell_t *) calloc(cells,
+                                                   sizeof(work_queue_cell_t));
+        if (lane->cells == NULL) {
+            workqueue_destroy(q);
+            return (work_queue_t *) NULL;
+        }
+        for (i = 0; i < cells; ++i) {
+            lane->cells[i].seq = i;
+        }
+        lane->mask = cells - 1;
+    }
+
     q->maxdepth = maxdepth;
+    q->maxbytes = maxbytes;
     q->active   = 1;
 
     return q;
@@ -39,12 +305,12 @@ int
 workqueue_activate(
     work_queue_t       *q)
 {
+    ATOMIC_STORE(&q->active, 1);
     if (pthread_mutex_lock(&q->mutex)) {
         return 0;
     }
-    q->active = 1;
-    pthread_mutex_unlock(&q->mutex);
     pthread_cond_broadcast(&q->cond_posted);
+    pthread_mutex_unlock(&q->mutex);
     return 1;
 }
 
@@ -52,12 +318,12 @@ int
 workqueue_deactivate(
     work_queue_t       *q)
 {
+    ATOMIC_STORE(&q->active, 0);
     if (pthread_mutex_lock(&q->mutex)) {
         return 0;
     }
-    q->active = 0;
-    pthread_mutex_unlock(&q->mutex);
     pthread_cond_broadcast(&q->cond_posted);
+    pthread_mutex_unlock(&q->mutex);
     return 1;
 }
 
@@ -67,6 +333,8 @@ void
 workqueue_destroy(
     work_queue_t       *q)
 {
+    uint32_t i;
+
     if (q == NULL) {
         return;
     }
@@ -74,10 +342,53 @@ workqueue_destroy(
     pthread_mutex_destroy(&q->mutex);
     pthread_cond_destroy(&q->cond_posted);
     pthread_cond_destroy(&q->cond_avail);
+    if (q->lanes) {
+        for (i = 0; i < q->lane_count; ++i) {
+            free(q->lanes[i].cells);
+        }
+        free(q->lanes);
+    }
     free(q);
 }
 
 
+/*
+ *  depth = push(q, newnode);
+ *
+ *    Add 'newnode', whose slot and bytes have been counted, to a lane
+ *    of 'q' and wake a parked consumer.  Return the queue depth.
+ */
+static int
+push(
+    work_queue_t       *q,
+    work_queue_node_t  *newnode)
+{
+    uint32_t lane;
+    int depth;
+
+    /* spread the nodes over the lanes */
+    lane = ATOMIC_ADD(&q->next_lane, 1) % q->lane_count;
+    depth = ATOMIC_ADD(&q->depth, 1);
+    while (ring_push(&q->lanes[lane], newnode)) {
+        /* a consumer has claimed the cell but not yet released it */
+    }
+
+    /* signal a parked consumer that an item is ready */
+    wake_waiters(q, &q->cond_posted, &q->posted_waiters, 0);
+
+#ifdef RWSCN_WORKQUEUE_DEBUG
+    /* update the peak depth, if needed */
+    if (depth > q->peakdepth) {
+        q->peakdepth = depth;
+    }
+
+    ATOMIC_ADD(&q->produced, 1);
+#endif
+
+    return depth;
+}
+
+
 int
 workqueue_put(
     work_queue_t       *q,
@@ -86,89 +397,205 @@ workqueue_put(
     if (newnode == NULL || q == NULL) {
         return -1;
     }
+    wait_reserve(q, newnode->size, RESERVE_ALL);
+    return push(q, newnode);
+}
 
-    pthread_mutex_lock(&q->mutex);
+/*
+ * Count 'size' bytes against the byte limit of the queue for a node
+ * the producer holds before queueing it with workqueue_put_reserved().
+ * Return 0 on success, or -1 without waiting when the bytes do not
+ * fit.
+ */
+int
+workqueue_try_reserve(
+    work_queue_t       *q,
+    size_t              size)
+{
+    return reserve(q, size, RESERVE_BYTES) ? 0 : -1;
+}
 
-    while ((q->maxdepth > 0) && (q->depth + q->pending >= q->maxdepth)) {
-        /* queue is full - wait on cond var for notification that a slot has
-         * become open */
-        pthread_cond_wait(&q->cond_avail, &q->mutex);
-    }
+/*
+ * Count 'size' bytes as workqueue_try_reserve() does, parking until
+ * they fit.
+ */
+void
+workqueue_reserve(
+    work_queue_t       *q,
+    size_t              size)
+{
+    wait_reserve(q, size, RESERVE_BYTES);
+}
 
-    if (q->tail == NULL) {
-        q->tail = q->head = newnode;
-    } else {
-        q->tail->next = newnode;
-        q->tail       = newnode;
+/*
+ * Queue a node whose bytes were counted by workqueue_reserve(),
+ * parking while the queue is at its maximum depth.  Return the queue
+ * depth, or -1 on error.
+ */
+int
+workqueue_put_reserved(
+    work_queue_t       *q,
+    work_queue_node_t  *newnode)
+{
+    if (newnode == NULL || q == NULL) {
+        return -1;
     }
+    wait_reserve(q, 0, RESERVE_SLOT);
+    return push(q, newnode);
+}
 
-    newnode->next = NULL;
-
-    q->depth++;
+/*
+ * Give back 'size' bytes counted by workqueue_reserve() for a node
+ * that will not be queued, and wake the waiting producers.
+ */
+void
+workqueue_release(
+    work_queue_t       *q,
+    size_t              size)
+{
+    ATOMIC_SUB(&q->bytes, size);
+    wake_waiters(q, &q->cond_avail, &q->avail_waiters, 1);
+}
 
-    /* release queue mutex and signal consumer that an item is ready */
-    pthread_mutex_unlock(&q->mutex);
-    pthread_cond_signal(&q->cond_posted);
 
+/*
+ *  status = take_counted(q, lane, retnode);
+ *
+ *    Take a node as take() does, and count it as pending.  Return 0
+ *    and set 'retnode' on success, or return -1 if the queue is empty.
+ */
+static int
+take_counted(
+    work_queue_t       *q,
+    uint32_t            lane,
+    work_queue_node_t **retnode)
+{
+    work_queue_node_t *node;
 
-#ifdef RWSCN_WORKQUEUE_DEBUG
-    /* update the peak depth, if needed */
-    if (q->depth > q->peakdepth) {
-        q->peakdepth = q->depth;
+    node = take(q, lane);
+    if (node == NULL) {
+        return -1;
     }
+    *retnode = node;
+
+    ATOMIC_SUB(&q->depth, 1);
+    ATOMIC_ADD(&q->pending, 1);
 
-    q->produced++;
+#ifdef RWSCN_WORKQUEUE_DEBUG
+    ATOMIC_ADD(&q->consumed, 1);
 #endif
 
-    return q->depth;
+    return 0;
 }
 
-
+/*
+ * Take a node from the queue without waiting.  Return 0 and set
+ * 'retnode' on success, or return -1 if the queue is empty.
+ */
 int
 workqueue_get(
     work_queue_t       *q,
     work_queue_node_t **retnode)
 {
-    work_queue_node_t *node;
+    return take_counted(q, 0, retnode);
+}
 
-    if (q->head == NULL || q->depth == 0) {
-        retnode = NULL;
-        return -1;
+/*
+ * Take a node from lane 'lane' of the queue, or steal one from
+ * another lane when that lane is empty, parking until a node is
+ * posted.  Return 0 and set 'retnode' on success, or return -1 once
+ * the queue has been deactivated; any nodes still queued are left in
+ * place.
+ */
+int
+workqueue_wait_get(
+    work_queue_t       *q,
+    uint32_t            lane,
+    work_queue_node_t **retnode)
+{
+    int rv = -1;
+    int i;
+
+    lane %= q->lane_count;
+    for (i = 0; i < WORKQUEUE_SPIN_COUNT; ++i) {
+        if (!ATOMIC_LOAD(&q->active)) {
+            return -1;
+        }
+        if (take_counted(q, lane, retnode) == 0) {
+            return 0;
+        }
     }
 
-    node = q->head;
-    if (node->next) {
-        q->head = node->next;
-    } else {
-        q->head = NULL;
-        q->tail = q->head = NULL;
+    pthread_mutex_lock(&q->mutex);
+    ATOMIC_ADD(&q->posted_waiters, 1);
+    ATOMIC_FENCE();
+    while (ATOMIC_LOAD(&q->active)) {
+        if (take_counted(q, lane, retnode) == 0) {
+            rv = 0;
+            break;
+        }
+        pthread_cond_wait(&q->cond_posted, &q->mutex);
     }
+    ATOMIC_SUB(&q->posted_waiters, 1);
+    pthread_mutex_unlock(&q->mutex);
 
-    node->next = NULL;
-    *retnode   = node;
+    return rv;
+}
 
-    q->depth--;
-    q->pending++;
+/*
+ * Mark a node taken by workqueue_get() as processed, releasing its
+ * slot and its 'size' bytes, and wake the waiting producers.
+ */
+void
+workqueue_finish(
+    work_queue_t       *q,
+    size_t              size)
+{
+    ATOMIC_SUB(&q->pending, 1);
+    ATOMIC_SUB(&q->bytes, size);
+    ATOMIC_SUB(&q->inflight, 1);
+    wake_waiters(q, &q->cond_avail, &q->avail_waiters, 1);
+}
 
-#ifdef RWSCN_WORKQUEUE_DEBUG
-    q->consumed++;
-#endif
+/*
+ * Park until the number of nodes waiting in the queue to be taken is
+ * no longer 'depth', which the caller read with workqueue_depth(),
+ * and return the new number.  The number is tested under the mutex
+ * before each wait, and each node taken is later marked by
+ * workqueue_finish(), which wakes this thread, so a node taken and
+ * finished before the wait cannot leave this thread parked.
+ */
+int
+workqueue_wait_finish(
+    work_queue_t       *q,
+    int                 depth)
+{
+    int rv;
 
-    return 0;
+    pthread_mutex_lock(&q->mutex);
+    ATOMIC_ADD(&q->avail_waiters, 1);
+    ATOMIC_FENCE();
+    while ((rv = ATOMIC_LOAD(&q->depth)) == depth) {
+        pthread_cond_wait(&q->cond_avail, &q->mutex);
+    }
+    ATOMIC_SUB(&q->avail_waiters, 1);
+    pthread_mutex_unlock(&q->mutex);
+
+    return rv;
 }
 
 int
 workqueue_depth(
     work_queue_t       *q)
 {
-    return q->depth;
+    return ATOMIC_LOAD(&q->depth);
 }
 
 int
 workqueue_pending(
     work_queue_t       *q)
 {
-    return q->pending;
+    return ATOMIC_LOAD(&q->pending);
 }
 
 
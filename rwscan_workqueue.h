@@ -17,31 +17,65 @@ RCSIDENTVAR(rcsID_RWSCAN_WORKQUEUE_H, "$SiLK: rwscan_workqueue.h 945cf5167607 20
 
 
 typedef struct work_queue_node_st {
-    struct work_queue_node_st *next;       /* next request in queue */
+    size_t                     size;       /* bytes held by the request */
 } work_queue_node_t;
 
+/* one slot of the ring; 'seq' tells producers and consumers whose
+ * turn it is to use the slot */
+typedef struct work_queue_cell_st {
+    size_t                     seq;
+    work_queue_node_t         *node;
+} work_queue_cell_t;
+
+/* a bounded ring of nodes; a queue has one lane per consumer */
+typedef struct work_queue_lane_st {
+    work_queue_cell_t         *cells;
+    size_t                     mask;       /* number of cells, less one */
+    size_t                     head;       /* position of the next get */
+    size_t                     tail;       /* position of the next put */
+} work_queue_lane_t;
+
 /*
  * This threaded queue structure is specialized for a
  * producer/consumer design in two ways.  First, queues can be created
  * with a maximum queue depth parameter, which governs how large the
- * queue can grow in size.  Second, the queue can be "deactivated" to
- * shut down producer threads when the program exits.
+ * queue can grow in size, and with a maximum number of bytes, which
+ * limits the total size of the nodes that are queued or being
+ * processed.  Second, the queue can be "deactivated" to shut down
+ * producer threads when the program exits.
+ *
+ * The nodes are held in bounded rings that many threads may add to
+ * and take from at once without a lock.  A queue may have several
+ * rings, or lanes, usually one per consumer.  Producers spread the
+ * nodes over the lanes, and a consumer takes from its own lane first
+ * and steals from the other lanes when its own is empty, so that no
+ * consumer sits idle while any node is queued.  The counters are
+ * updated with atomic operations.  A thread parks on the mutex and condition
+ * variables only when it must wait: a consumer when the queue is
+ * empty, and a producer when the queue is full.  The other side
+ * takes the mutex only when a thread is parked.
  *
  * The queue just maintains node pointers; it does not manage node
  * memory in any way.
  *
  */
 typedef struct work_queue_st {
-    work_queue_node_t *head;        /* pointer to first node */
-    work_queue_node_t *tail;        /* pointer to last node */
+    work_queue_lane_t *lanes;       /* the rings */
+    uint32_t           lane_count;  /* number of lanes */
+    uint32_t           next_lane;   /* lane of the next put */
 
-    pthread_mutex_t    mutex;       /* master queue lock mutex */
+    pthread_mutex_t    mutex;       /* protects the parking */
     pthread_cond_t     cond_posted; /* used to wake up a consumer */
     pthread_cond_t     cond_avail;  /* used to signal a producer */
+    int                posted_waiters; /* consumers parked */
+    int                avail_waiters;  /* producers parked */
 
     int                depth;       /* number of items in queue */
     int                maxdepth;    /* max items allowed in queue */
     int                pending;     /* numitems being processed */
+    int                inflight;    /* items queued or being processed */
+    uint64_t           bytes;       /* size of queued and pending items */
+    uint64_t           maxbytes;    /* max bytes allowed in queue */
     int                active;      /* if work queue has been activated */
 #ifdef RWSCN_WORKQUEUE_DEBUG
     int                consumed;    /* num items consumed */
@@ -54,24 +88,56 @@ typedef struct work_queue_st {
 /* Public work queue API */
 work_queue_t *
 workqueue_create(
-    uint32_t            maxdepth);
+    uint32_t            maxdepth,
+    uint64_t            maxbytes,
+    uint32_t            lanes);
 int
 workqueue_put(
     work_queue_t       *q,
     work_queue_node_t  *newnode);
+
+int
+workqueue_try_reserve(
+    work_queue_t       *q,
+    size_t              size);
+
+void
+workqueue_reserve(
+    work_queue_t       *q,
+    size_t              size);
+
+int
+workqueue_put_reserved(
+    work_queue_t       *q,
+    work_queue_node_t  *newnode);
+
+void
+workqueue_release(
+    work_queue_t       *q,
+    size_t              size);
 int
 workqueue_get(
     work_queue_t       *q,
     work_queue_node_t **retnode);
 int
+workqueue_wait_get(
+    work_queue_t       *q,
+    uint32_t            lane,
+    work_queue_node_t **retnode);
+void
+workqueue_finish(
+    work_queue_t       *q,
+    size_t              size);
+int
+workqueue_wait_finish(
+    work_queue_t       *q,
+    int                 depth);
+int
 workqueue_depth(
     work_queue_t       *q);
-
-#if 1
 int
 workqueue_pending(
     work_queue_t       *q);
-#endif
 int
 workqueue_activate(
     work_queue_t       *q);
@@ -0,0 +1,101 @@
+#
+#  Helpers for the rwscan tests that check that a switch does not
+#  change the scans rwscan finds.
+#
+#  Each test calls rwscan_setup() and then rwscan_check_same() with
+#  its switches.  The reference is rwscan-hybrid.pl's run: the data
+#  sorted by source IP, protocol and destination IP, here with ties
+#  broken on the remaining fields that rwscan uses, so that every path
+#  that orders the flows of an event itself must give the same order.
+#
+#  RCSIDENT("$SiLK: RwscanTests.pm 945cf5167607 2019-01-07 18:54:17Z mthomas $")
+
+package RwscanTests;
+
+use strict;
+use SiLKTests;
+
+use Exporter qw(import);
+our @EXPORT = qw(rwscan_setup rwscan_run rwscan_check_same);
+
+# the fields on which the reference input is sorted
+our $SORT_FIELDS = ('sip,proto,dip,sport,dport,stime,duration,packets'
+                    .',bytes,flags');
+
+
+#  $env = rwscan_setup($name);
+#
+#    Find rwscan, rwset, rwsort and the test data, exiting with status
+#    77 when any is missing.  In a new temporary directory, write the
+#    set of internal hosts, which are the sources in the data, and an
+#    uncompressed copy of the data sorted on $SORT_FIELDS.  Return a
+#    reference to a hash that holds the paths to the applications
+#    ('rwscan', 'rwset', 'rwsort'), the files ('data', 'internal',
+#    'sorted'), the directory ('tmpdir'), the test's $name ('name'),
+#    and the switches of the reference run ('scan').
+sub rwscan_setup
+{
+    my ($name) = @_;
+    my %env = (name => $name);
+
+    $env{rwscan} = check_silk_app('rwscan');
+    $env{rwset} = check_silk_app('rwset');
+    $env{rwsort} = check_silk_app('rwsort');
+    $env{data} = get_data_or_exit77('data');
+
+    $env{tmpdir} = make_tempdir();
+    $env{internal} = "$env{tmpdir}/internal.set";
+    $env{sorted} = "$env{tmpdir}/sorted.rwf";
+    $env{scan} = "--scan-model=0 --trw-internal-set=$env{internal}";
+
+    rwscan_run(\%env, "$env{rwset} --sip-file=$env{internal} $env{data}");
+    rwscan_run(\%env, ("$env{rwsort} --fields=$SORT_FIELDS"
+                       ." --compression-method=none"
+                       ." --output-path=$env{sorted} $env{data}"));
+    return \%env;
+}
+
+
+#  rwscan_run($env, $cmd);
+#
+#    Run $cmd, and die unless it succeeds.
+sub rwscan_run
+{
+    my ($env, $cmd) = @_;
+
+    system($cmd) == 0
+        or die "$env->{name}: Failed to run $cmd\n";
+}
+
+
+#  rwscan_check_same($env, $switches, $input);
+#
+#    Check that rwscan given $switches finds in $input the scans that
+#    rwscan without them finds in the sorted data, and die if not.
+#    $input is a list of files, or a command that writes records to
+#    its standard output followed by '|'; the default is the sorted
+#    data.  Both runs use the switches in $env->{scan}.  The output
+#    lines are sorted since the events may be analyzed in a different
+#    order.
+sub rwscan_check_same
+{
+    my ($env, $switches, $input) = @_;
+    my $rwscan = "$env->{rwscan} $env->{scan}";
+    my $md5;
+    my $cmd;
+
+    compute_md5(\$md5, "$rwscan $env->{sorted} | sort");
+
+    $input = $env->{sorted}
+        unless defined $input;
+    if ($input =~ /\|\s*$/) {
+        $cmd = "$input $rwscan $switches | sort";
+    } else {
+        $cmd = "$rwscan $switches $input | sort";
+    }
+    check_md5_output($md5, $cmd);
+}
+
+
+1;
+__END__
@@ -0,0 +1,18 @@
+#! /usr/bin/perl -w
+#
+#  Check that the BLR features of compressed events are the same as
+#  those of events held uncompressed.
+#
+#  RCSIDENT("$SiLK: rwscan-blr-features.pl 945cf5167607 2019-01-07 18:54:17Z mthomas $")
+
+use strict;
+use SiLKTests;
+use File::Basename qw(dirname);
+use lib dirname($0);
+use RwscanTests;
+
+my $env = rwscan_setup('rwscan-blr-features');
+
+$env->{scan} = '--scan-model=2 --model-fields';
+
+rwscan_check_same($env, '--compress-events=1024');
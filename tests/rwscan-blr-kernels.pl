@@ -0,0 +1,18 @@
+#! /usr/bin/perl -w
+#
+#  Check that the BLR features of events analyzed by several threads
+#  are the same as those found by one thread.
+#
+#  RCSIDENT("$SiLK: rwscan-blr-kernels.pl 945cf5167607 2019-01-07 18:54:17Z mthomas $")
+
+use strict;
+use SiLKTests;
+use File::Basename qw(dirname);
+use lib dirname($0);
+use RwscanTests;
+
+my $env = rwscan_setup('rwscan-blr-kernels');
+
+$env->{scan} = '--scan-model=2 --model-fields';
+
+rwscan_check_same($env, '--threads=4 --parallel-events=65536');
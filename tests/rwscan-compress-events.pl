@@ -0,0 +1,16 @@
+#! /usr/bin/perl -w
+#
+#  Check that --compress-events finds the same scans as rwscan finds
+#  when the flows of every event are held uncompressed.
+#
+#  RCSIDENT("$SiLK: rwscan-compress-events.pl 945cf5167607 2019-01-07 18:54:17Z mthomas $")
+
+use strict;
+use SiLKTests;
+use File::Basename qw(dirname);
+use lib dirname($0);
+use RwscanTests;
+
+my $env = rwscan_setup('rwscan-compress-events');
+
+rwscan_check_same($env, '--compress-events=1024');
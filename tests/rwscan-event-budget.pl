@@ -0,0 +1,28 @@
+#! /usr/bin/perl -w
+#
+#  Check the per-event budgets.
+#
+#  A flow budget no event reaches finds the same scans as rwscan finds
+#  without a budget.  Budgets that most events exceed sample the flows,
+#  which may change the scans that are found, so for those only check
+#  that rwscan succeeds and prints the sampled column.
+#
+#  RCSIDENT("$SiLK: rwscan-event-budget.pl 945cf5167607 2019-01-07 18:54:17Z mthomas $")
+
+use strict;
+use SiLKTests;
+use File::Basename qw(dirname);
+use lib dirname($0);
+use RwscanTests;
+
+my $env = rwscan_setup('rwscan-event-budget');
+
+rwscan_check_same($env, '--event-flow-budget=4000000000');
+
+for my $budget ('--event-flow-budget=1024', '--event-time-budget=1') {
+    my $cmd = ("$env->{rwscan} $env->{scan} --model-fields $budget"
+               ." $env->{sorted}");
+    my $output = `$cmd`;
+    ($? == 0 && $output =~ /\bsampled\b/)
+        or die "$env->{name}: Failed to run $cmd\n";
+}
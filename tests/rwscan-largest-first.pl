@@ -0,0 +1,19 @@
+#! /usr/bin/perl -w
+#
+#  Check that handing the largest events to the workers first finds the
+#  same scans as rwscan finds with one worker.
+#
+#  The queue is short, so the reader often holds events back while the
+#  workers are busy.
+#
+#  RCSIDENT("$SiLK: rwscan-largest-first.pl 945cf5167607 2019-01-07 18:54:17Z mthomas $")
+
+use strict;
+use SiLKTests;
+use File::Basename qw(dirname);
+use lib dirname($0);
+use RwscanTests;
+
+my $env = rwscan_setup('rwscan-largest-first');
+
+rwscan_check_same($env, '--threads=4 --queue-depth=2');
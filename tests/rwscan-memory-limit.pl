@@ -0,0 +1,19 @@
+#! /usr/bin/perl -w
+#
+#  Check that --memory-limit finds the same scans as rwscan finds
+#  without a limit.
+#
+#  The limit is the smallest allowed, so that the reader often waits for
+#  the workers to release the memory of the events they have analyzed.
+#
+#  RCSIDENT("$SiLK: rwscan-memory-limit.pl 945cf5167607 2019-01-07 18:54:17Z mthomas $")
+
+use strict;
+use SiLKTests;
+use File::Basename qw(dirname);
+use lib dirname($0);
+use RwscanTests;
+
+my $env = rwscan_setup('rwscan-memory-limit');
+
+rwscan_check_same($env, '--threads=4 --memory-limit=1M');
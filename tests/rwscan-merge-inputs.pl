@@ -0,0 +1,26 @@
+#! /usr/bin/perl -w
+#
+#  Check that --merge-inputs finds the same scans in two sorted files
+#  as rwscan finds in the single sorted file they were split from.
+#
+#  Splitting on the destination port gives most sources flows in both
+#  files.
+#
+#  RCSIDENT("$SiLK: rwscan-merge-inputs.pl 945cf5167607 2019-01-07 18:54:17Z mthomas $")
+
+use strict;
+use SiLKTests;
+use File::Basename qw(dirname);
+use lib dirname($0);
+use RwscanTests;
+
+my $env = rwscan_setup('rwscan-merge-inputs');
+my $rwfilter = check_silk_app('rwfilter');
+my $low = "$env->{tmpdir}/low.rwf";
+my $high = "$env->{tmpdir}/high.rwf";
+
+# each part keeps the order of the sorted data
+rwscan_run($env, ("$rwfilter --dport=0-1023 --pass=$low --fail=$high"
+                  ." $env->{sorted}"));
+
+rwscan_check_same($env, '--merge-inputs', "$low $high");
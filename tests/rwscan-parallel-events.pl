@@ -0,0 +1,18 @@
+#! /usr/bin/perl -w
+#
+#  Check that analyzing the larger events with several threads finds
+#  the same scans as rwscan finds with one thread.
+#
+#  65536 is the smallest value --parallel-events accepts.
+#
+#  RCSIDENT("$SiLK: rwscan-parallel-events.pl 945cf5167607 2019-01-07 18:54:17Z mthomas $")
+
+use strict;
+use SiLKTests;
+use File::Basename qw(dirname);
+use lib dirname($0);
+use RwscanTests;
+
+my $env = rwscan_setup('rwscan-parallel-events');
+
+rwscan_check_same($env, '--threads=4 --parallel-events=65536');
@@ -0,0 +1,16 @@
+#! /usr/bin/perl -w
+#
+#  Check that --reader-threads splits one uncompressed file among the
+#  readers and still finds the same scans as a single reader.
+#
+#  RCSIDENT("$SiLK: rwscan-reader-threads.pl 945cf5167607 2019-01-07 18:54:17Z mthomas $")
+
+use strict;
+use SiLKTests;
+use File::Basename qw(dirname);
+use lib dirname($0);
+use RwscanTests;
+
+my $env = rwscan_setup('rwscan-reader-threads');
+
+rwscan_check_same($env, '--reader-threads=4');
@@ -0,0 +1,22 @@
+#! /usr/bin/perl -w
+#
+#  Check that rwscan runs when --sketch-events estimates the BLR
+#  features of the larger events.
+#
+#  The estimates may change the scans that are found, so only the exit
+#  status is checked.
+#
+#  RCSIDENT("$SiLK: rwscan-sketch-events.pl 945cf5167607 2019-01-07 18:54:17Z mthomas $")
+
+use strict;
+use SiLKTests;
+use File::Basename qw(dirname);
+use lib dirname($0);
+use RwscanTests;
+
+my $env = rwscan_setup('rwscan-sketch-events');
+
+my $cmd = ("$env->{rwscan} $env->{scan} --model-fields"
+           ." --sketch-events=1024 $env->{sorted}");
+
+exit (check_exit_status($cmd) ? 0 : 1);
@@ -0,0 +1,23 @@
+#! /usr/bin/perl -w
+#
+#  Check that --sort-buffer-size finds the same scans in shuffled
+#  input as rwscan finds in the sorted input.
+#
+#  The buffer is small enough that the records are sorted into many
+#  temporary files and merged.  The external sort breaks ties on every
+#  field rwscan uses, so the order of the shuffled input does not
+#  matter.
+#
+#  RCSIDENT("$SiLK: rwscan-sort-buffer.pl 945cf5167607 2019-01-07 18:54:17Z mthomas $")
+
+use strict;
+use SiLKTests;
+use File::Basename qw(dirname);
+use lib dirname($0);
+use RwscanTests;
+
+my $env = rwscan_setup('rwscan-sort-buffer');
+
+rwscan_check_same($env, ("--sort-buffer-size=1M"
+                        ." --temp-directory=$env->{tmpdir}"),
+                  "$env->{rwsort} --fields=bytes,stime $env->{data} |");
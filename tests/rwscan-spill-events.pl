@@ -0,0 +1,20 @@
+#! /usr/bin/perl -w
+#
+#  Check that --spill-events finds the same scans as rwscan finds when
+#  every event is held in memory.
+#
+#  The limit is the smallest allowed, so that the flows of most events
+#  are written to temporary files and merged back.
+#
+#  RCSIDENT("$SiLK: rwscan-spill-events.pl 945cf5167607 2019-01-07 18:54:17Z mthomas $")
+
+use strict;
+use SiLKTests;
+use File::Basename qw(dirname);
+use lib dirname($0);
+use RwscanTests;
+
+my $env = rwscan_setup('rwscan-spill-events');
+
+rwscan_check_same($env, ("--compress-events=1024 --spill-events=1024"
+                        ." --temp-directory=$env->{tmpdir}"));
@@ -0,0 +1,24 @@
+#! /usr/bin/perl -w
+#
+#  Check that the default --trw-alpha and --trw-beta are the constants
+#  rwscan used before the switches existed, and that rwscan rejects an
+#  alpha that is not below beta.
+#
+#  RCSIDENT("$SiLK: rwscan-trw-bounds.pl 945cf5167607 2019-01-07 18:54:17Z mthomas $")
+
+use strict;
+use SiLKTests;
+use File::Basename qw(dirname);
+use lib dirname($0);
+use RwscanTests;
+
+my $env = rwscan_setup('rwscan-trw-bounds');
+
+$env->{scan} .= ' --model-fields';
+
+rwscan_check_same($env, '--trw-alpha=0.01 --trw-beta=0.99');
+
+my $cmd = ("$env->{rwscan} $env->{scan} --trw-alpha=0.5 --trw-beta=0.5"
+           ." $env->{sorted}");
+
+exit (check_exit_status($cmd) ? 1 : 0);
@@ -0,0 +1,16 @@
+#! /usr/bin/perl -w
+#
+#  Check that --trw-in-reader finds the same scans as the TRW test of
+#  the worker threads.
+#
+#  RCSIDENT("$SiLK: rwscan-trw-in-reader.pl 945cf5167607 2019-01-07 18:54:17Z mthomas $")
+
+use strict;
+use SiLKTests;
+use File::Basename qw(dirname);
+use lib dirname($0);
+use RwscanTests;
+
+my $env = rwscan_setup('rwscan-trw-in-reader');
+
+rwscan_check_same($env, '--trw-in-reader');
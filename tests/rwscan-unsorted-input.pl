@@ -0,0 +1,26 @@
+#! /usr/bin/perl -w
+#
+#  Check that --unsorted-input finds the same scans in shuffled input
+#  as rwscan finds in the sorted input, whether the input is read by
+#  one thread or divided among several.
+#
+#  The flows of each source are analyzed in the order of the sorted
+#  input, so the shuffled input is ordered on fields unrelated to it.
+#
+#  RCSIDENT("$SiLK: rwscan-unsorted-input.pl 945cf5167607 2019-01-07 18:54:17Z mthomas $")
+
+use strict;
+use SiLKTests;
+use File::Basename qw(dirname);
+use lib dirname($0);
+use RwscanTests;
+
+my $env = rwscan_setup('rwscan-unsorted-input');
+my $shuffled = "$env->{tmpdir}/shuffled.rwf";
+
+rwscan_run($env, ("$env->{rwsort} --fields=bytes,stime"
+                  ." --compression-method=none"
+                  ." --output-path=$shuffled $env->{data}"));
+
+rwscan_check_same($env, '--unsorted-input', $shuffled);
+rwscan_check_same($env, '--unsorted-input --reader-threads=4', $shuffled);